@@ -5,10 +5,12 @@ init:
 define TIMER_PIN            1
 define TIMER_IRQ            0x00000004
 define DISPLAY_PORT         8
-define DISPLAY_DMA          0x00000084
+define DISPLAY_SETUP        0x00000084
+define DISPLAY_PALETTE      0x0000008c
+define DISPLAY_DMA          0x0000048c
 define KEYBOARD_DATA_PIN    0x8
 define KEYBOARD_IRQ         0x00000008
-define OUTPUT_DMA           0x005eec88 + 1
+define OUTPUT_DMA           0x001c248c + 1
 define OUTPORT              2
 
 ; configuration
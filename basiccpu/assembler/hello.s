@@ -1,7 +1,7 @@
 init:
     jmp     main    ; skip past data
 
-define OUTPUT_DMA   0x005eec88
+define OUTPUT_DMA   0x001c248c
 define OUTPORT      2
 
 S1:
@@ -2,8 +2,10 @@ init:
     jmp     main    ; skip past data
 
 define DISPLAY_PORT 8
-define DISPLAY_DMA  0x00000084
-define OUTPUT_DMA   0x005eec88 + 1
+define DISPLAY_SETUP 0x00000084
+define DISPLAY_PALETTE 0x0000008c
+define DISPLAY_DMA  0x0000048c
+define OUTPUT_DMA   0x001c248c + 1
 define OUTPORT      2
 define KEYBOARD_IRQ      0x00000008
 define KEYBOARD_DATA_PIN 0x8
@@ -169,6 +169,10 @@ static const char* modeToString(MemAddress mode)
 
 /* public BasicCpu */
 
+BasicCpu::BasicCpu()
+: dirtyTrackers(0), instructionCount(0)
+{ }
+
 string BasicCpu::getName() const
 {
     return "BasicCpu";
@@ -182,6 +186,7 @@ void BasicCpu::start(Motherboard& mb, MemAddress addr)
     this->ip = addr;
 
     vector<uint8_t>& memory = Device::getMemory(mb);
+    this->dirtyTrackers = &mb.getDirtyTrackers();
 
     // Get location to interrupt vector
     InterruptController* ic = mb.getInterruptController();
@@ -226,12 +231,13 @@ void BasicCpu::start(Motherboard& mb, MemAddress addr)
     MemAddress  result = 0;     // value after  a calculation
     MemAddress* dest_reg;       // destination register
 
+    unsigned long long numInstructions = 0;
+
     #if EMULATOR_BENCHMARK
     typedef chrono::high_resolution_clock Clock;
     typedef std::chrono::microseconds microseconds;
 
     Clock::time_point t0 = Clock::now();
-    unsigned long long numInstructions = 0;
     unsigned long long numInterrupts   = 0;
     numOperations = 0;
 
@@ -271,9 +277,7 @@ void BasicCpu::start(Motherboard& mb, MemAddress addr)
         }
 
         Instruction instruction = getInstruction(memory, ip);
-        #if EMULATOR_BENCHMARK
         numInstructions++;
-        #endif
 
         #define CONVERT_OPCODE(OPCODE)  ( OPCODE >> INS_OPCODE )
         #define CONVERT_MODE(MODE)      ( MODE   >> INS_ADDR )
@@ -418,6 +422,7 @@ void BasicCpu::start(Motherboard& mb, MemAddress addr)
                 updateMemory32(memory, *registers[instruction.destreg], *registers[instruction.sources.src2]);
             else
                 /* TODO:  generate instruction fault */;
+            this->markDirty(*registers[instruction.destreg], 4);
             break;
 
         case CONVERT_OPCODE(STRB):
@@ -428,6 +433,7 @@ void BasicCpu::start(Motherboard& mb, MemAddress addr)
                 memory[*registers[instruction.destreg]] = *registers[instruction.sources.src2];
             else
                 /* TODO:  generate instruction fault */;
+            this->markDirty(*registers[instruction.destreg], 1);
             break;
 
         case CONVERT_OPCODE(PUSH):
@@ -478,6 +484,8 @@ void BasicCpu::start(Motherboard& mb, MemAddress addr)
 
         case CONVERT_OPCODE(WRITE):
             BCPU_DBGI("write", "immediate");
+            // a synchronous device may want to know where the CPU is
+            this->instructionCount.store(numInstructions, memory_order_relaxed);
             Device::writeMb(mb, instruction.getOperand(), getWord(memory, ip));
             break;
 
@@ -489,6 +497,7 @@ void BasicCpu::start(Motherboard& mb, MemAddress addr)
                 MemAddress* lenReg  = registers[instruction.sources.src2];
                 for (int i = 0; i < *lenReg; i++)
                     memory[*destReg + i] = memory[*srcReg + i];
+                this->markDirty(*destReg, *lenReg);
                 COUNT_OPERATION(
                     *lenReg + 1 /* comparisons */
                   + *lenReg     /* i++ */
@@ -507,6 +516,7 @@ void BasicCpu::start(Motherboard& mb, MemAddress addr)
                 MemAddress* lenReg  = registers[instruction.sources.src2];
                 for (int i = 0; i < *lenReg; i++)
                     memory[*destReg + i] = *srcReg;
+                this->markDirty(*destReg, *lenReg);
                 COUNT_OPERATION(
                     *lenReg + 1 /* comparisons */
                   + *lenReg     /* i++ */
@@ -706,6 +716,8 @@ void BasicCpu::start(Motherboard& mb, MemAddress addr)
         #endif
     }
 
+    this->instructionCount.store(numInstructions, memory_order_relaxed);
+
     #if EMULATOR_BENCHMARK
     Clock::time_point endtime = Clock::now();
     microseconds us = std::chrono::duration_cast<microseconds>(endtime - t0);
@@ -721,6 +733,11 @@ void BasicCpu::start(Motherboard& mb, MemAddress addr)
     #endif
 }
 
+uint64_t BasicCpu::getInstructionCount() const
+{
+    return this->instructionCount.load(memory_order_relaxed);
+}
+
 void BasicCpu::interrupt(unsigned int line)
 {
     this->interrupts[line] = 1;
@@ -728,11 +745,15 @@ void BasicCpu::interrupt(unsigned int line)
 
 void BasicCpu::pushRegisters(std::vector<uint8_t>& memory, MemAddress& ip)
 {
+    // rti gives the interrupted code back the stack it had, so that an
+    // interrupt taken in a handler does not move the handler's frame
+    MemAddress interruptedSp = sp;
+
     push(memory, sp, st);
     push(memory, sp, dl);
     push(memory, sp, ip);
     push(memory, sp, lr);
-    push(memory, sp, sp);
+    push(memory, sp, interruptedSp);
     push(memory, sp, 0);
     push(memory, sp, 0);
     push(memory, sp, 0);
@@ -793,6 +814,7 @@ void BasicCpu::colorset(std::vector<uint8_t>& memory, MemAddress what)
 
         COUNT_OPERATION(3 + 2); // tis actually conservative
     }
+    this->markDirty(r1, r2 * 3);
 }
 
 void BasicCpu::colorsetVertical(std::vector<uint8_t>& memory, MemAddress what)
@@ -810,6 +832,7 @@ void BasicCpu::colorsetVertical(std::vector<uint8_t>& memory, MemAddress what)
         memory[i+0] = red;
         memory[i+1] = green;
         memory[i+2] = blue;
+        this->markDirty(i, 3);
 
         COUNT_OPERATION(3 + 2); // tis actually conservative
     }
@@ -834,5 +857,6 @@ void BasicCpu::drawSquare(std::vector<uint8_t>& memory, MemAddress what)
 
             COUNT_OPERATION(3 + 2); // tis actually conservative
         }
+        this->markDirty(i, r3 * 3);
     }
 }
@@ -9,8 +9,10 @@
 
 #include "opcodes.h"
 #include <machine/cpu.h>
+#include <machine/dirtytracker.h>
 
 #include <bitset>
+#include <atomic>
 
 namespace machine
 {
@@ -21,6 +23,8 @@ public:
 
     static const uint16_t NUM_INTERRUPT_LINES = 32;
 
+    BasicCpu();
+
     /**
      * @return  Name of device
      */
@@ -35,6 +39,13 @@ public:
 
     void interrupt(unsigned int line);
 
+    /**
+     * @return  Number of instructions executed, as of the last WRITE
+     *          instruction.  The count is only published when the CPU
+     *          writes to a port, so that counting stays in a register.
+     */
+    uint64_t getInstructionCount() const;
+
     /*
      * 32-bit integer guest code is pre-decoded into this structure
      */
@@ -103,6 +114,19 @@ protected:
      */
     void updateStatus(MemAddress before, MemAddress result);
 
+    /**
+     * Tell the Motherboard's dirty trackers that memory was written
+     * @param[in]   addr    Start of written memory
+     * @param[in]   len     Number of bytes written
+     */
+    inline void markDirty(MemAddress addr, MemAddress len)
+    {
+        for (std::vector<DirtyTracker*>::size_type i = 0;
+             i < this->dirtyTrackers->size();
+             i++)
+            (*this->dirtyTrackers)[i]->mark(addr, len);
+    }
+
     void colorset(std::vector<uint8_t>& memory, MemAddress what);
 
     void colorsetVertical(std::vector<uint8_t>& memory, MemAddress what);
@@ -127,6 +151,10 @@ private:
 
     std::bitset<NUM_INTERRUPT_LINES> interrupts;
 
+    const std::vector<DirtyTracker*>* dirtyTrackers;
+
+    std::atomic<uint64_t> instructionCount;     //<! Published by WRITE
+
     #if EMULATOR_BENCHMARK
     unsigned long long numOperations;
     #endif
@@ -0,0 +1,533 @@
+/**
+ * @file    blockdevice.cpp
+ *
+ * Matrix VM
+ */
+
+#include "blockdevice.h"
+#include <dev/interruptcontroller.h>
+#include <machine/dirtytracker.h>
+#include <machine/guestmemory.h>
+
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <atomic>
+#include <algorithm>
+#include <stdexcept>
+#include <cassert>
+
+using namespace std;
+using namespace machine;
+
+// declared, but not defined, in device.h
+SLDECL Device* createDevice(void* args)
+{
+    // there is no default disk image
+    BlockDeviceArgs* bdArgs = reinterpret_cast<BlockDeviceArgs*>( args );
+    if (bdArgs && bdArgs->path)
+        return new BlockDevice(bdArgs->path,
+                               bdArgs->overlay ? bdArgs->overlay : "",
+                               bdArgs->interruptLine);
+    else
+        return 0;
+}
+
+static int64_t microseconds()
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return static_cast<int64_t>( now.tv_sec ) * 1000000 + now.tv_nsec / 1000;
+}
+
+/* public BlockDevice */
+
+BlockDevice::BlockDevice(const string& path, const string& overlay /* = "" */,
+                         int interruptLine /* = BLOCK_INT_LINE */)
+: mb(0), path(path), overlayPath(overlay), interruptLine(interruptLine),
+  fd(-1), readOnly(false), image(0), overlay(0), imageSize(0),
+  dirtyBegin(0), dirtyEnd(0), unflushed(0), run(false), chainsInFlight(0),
+  attachments(0), inFlight(0), maxInFlight(0)
+{
+    memset(this->queues, 0, sizeof(this->queues));
+    memset(this->latency, 0, sizeof(this->latency));
+}
+
+BlockDevice::~BlockDevice()
+{
+    #if EMULATOR_BENCHMARK
+    if (this->maxInFlight)
+    {
+        printf("Block requests in flight at most:  %u\n", this->maxInFlight);
+        for (int i = 0; i < BLOCK_LATENCY_BUCKETS; i++)
+        {
+            printf("Block requests under %8lld us:  %10u\n",
+                   2LL << i, this->latency[i]);
+        }
+    }
+    #endif
+
+    this->flush();
+    delete this->overlay;
+    if (this->image)
+        munmap(this->image, this->imageSize);
+    if (this->fd >= 0)
+        close(this->fd);
+}
+
+string BlockDevice::getName() const
+{
+    return "BlockDevice";
+}
+
+void BlockDevice::init(Motherboard& mb)
+{
+    this->mb = &mb;
+
+    // with an overlay, the image is never written
+    if (this->overlayPath.empty())
+        this->fd = open(this->path.c_str(), O_RDWR);
+    if (this->fd < 0)
+    {
+        this->fd = open(this->path.c_str(), O_RDONLY);
+        this->readOnly = true;
+    }
+    struct stat st;
+    if (this->fd < 0 || fstat(this->fd, &st) < 0)
+        throw runtime_error("Could not open disk image " + this->path);
+
+    // a partial sector at the end is left out
+    this->imageSize = st.st_size / BLOCK_SECTOR_SIZE * BLOCK_SECTOR_SIZE;
+    if (this->imageSize > 0)
+    {
+        void* image = mmap(0, this->imageSize,
+                           PROT_READ | (this->readOnly ? 0 : PROT_WRITE),
+                           MAP_SHARED, this->fd, 0);
+        if (image == MAP_FAILED)
+            throw runtime_error("Could not map disk image " + this->path);
+        this->image = static_cast<uint8_t*>( image );
+    }
+
+    if (!this->overlayPath.empty())
+    {
+        this->overlay  = new CowImage(this->overlayPath,
+                                      this->image, this->imageSize);
+        this->readOnly = false;
+    }
+
+    MemAddress dmaLoc = Device::reserveMemIO(
+        mb, *this, BLOCK_VIRTQUEUE_CONFIG + VIRTQUEUE_CONFIG_SIZE);
+    if (dmaLoc < 0)
+        throw runtime_error("Could not request DMA memory for block device");
+    else
+        this->mappingAddr = dmaLoc;
+
+    uint8_t* info = &Device::getMemory(mb)[dmaLoc];
+    write32(info + BLOCK_INFO_SECTORS, this->imageSize / BLOCK_SECTOR_SIZE);
+    write32(info + BLOCK_INFO_SECTOR_SIZE, BLOCK_SECTOR_SIZE);
+    write32(info + BLOCK_INFO_FLAGS, this->readOnly ? BLOCK_INFO_READ_ONLY : 0);
+    write32(info + BLOCK_INFO_QUEUES, BLOCK_QUEUE_COUNT);
+    write32(info + BLOCK_INFO_DEPTH, BLOCK_QUEUE_DEPTH);
+    this->virtqueue.init(&Device::getMemory(mb)[0], mb.getMemorySize(),
+                         dmaLoc + BLOCK_VIRTQUEUE_CONFIG,
+                         BLOCK_VIRTQUEUE_ENTRIES);
+
+    if (!Device::requestPort(mb, this, DEFAULT_BLOCK_PORT) ||
+        !Device::requestPort(mb, this, DEFAULT_BLOCK_QUEUE_PORT) ||
+        !Device::requestPort(mb, this, DEFAULT_BLOCK_VIRTQUEUE_PORT))
+        throw runtime_error("Could not initiate device ports for block device");
+
+    this->run = true;
+    for (int i = 0; i < BLOCK_IO_THREADS; i++)
+        mb.requestThread(this, &BlockDevice::runWorker);
+}
+
+void BlockDevice::write(MemAddress what, int port)
+{
+    if (port == DEFAULT_BLOCK_QUEUE_PORT)
+    {
+        if (what < 0 || what >= BLOCK_QUEUE_COUNT)
+            return;
+
+        const uint8_t* control = &Device::getMemory(*this->mb)[0] +
+                                 this->mappingAddr + BLOCK_INFO_SIZE +
+                                 what * BLOCK_QUEUE_SIZE;
+
+        boost::lock_guard<boost::mutex> lock(this->mutex);
+        // the guest stores a word a byte at a time, so the host threads use
+        // copies taken here, on the thread that stored them
+        Queue& q = this->queues[what];
+        q.cqTail    = read32(control + BLOCK_QUEUE_CQ_TAIL);
+        q.threshold = read32(control + BLOCK_QUEUE_THRESHOLD);
+        q.armed     = true;
+        this->submit(what);
+        this->notify(what);
+        return;
+    }
+
+    if (port == DEFAULT_BLOCK_VIRTQUEUE_PORT)
+    {
+        if ((what & VIRTQUEUE_KICK_QUEUE) != 0)
+            return;
+
+        boost::lock_guard<boost::mutex> lock(this->mutex);
+        if (what & VIRTQUEUE_KICK_ATTACH)
+        {
+            // chains the host threads still have go nowhere
+            this->virtqueue.attach();
+            this->chainsInFlight = 0;
+            this->attachments++;
+        }
+        this->virtqueue.kick();
+        this->submitChains();
+        return;
+    }
+
+    // without a descriptor to report to, the request is dropped
+    if (!inMemory(what, BLOCK_DESC_SIZE, this->mb->getMemorySize()))
+        return;
+
+    uint8_t* desc = &Device::getMemory(*this->mb)[what];
+    int status = this->serve(read32(desc + BLOCK_DESC_OP),
+                             read32(desc + BLOCK_DESC_SECTOR),
+                             read32(desc + BLOCK_DESC_COUNT),
+                             read32(desc + BLOCK_DESC_BUFFER));
+    write32(desc + BLOCK_DESC_STATUS, status);
+
+    InterruptController* ic = this->mb->getInterruptController();
+    if (ic && this->interruptLine >= 0)
+        ic->interrupt(this->interruptLine);
+}
+
+PortMode BlockDevice::getPortMode(int port) const
+{
+    return port == DEFAULT_BLOCK_PORT ? PORT_POSTED : PORT_SYNCHRONOUS;
+}
+
+void BlockDevice::stopThread(boost::thread* thd)
+{
+    boost::lock_guard<boost::mutex> lock(this->mutex);
+    this->run = false;
+    this->work.notify_all();
+}
+
+/* protected BlockDevice */
+
+int BlockDevice::serve(uint32_t op, uint32_t sector, uint32_t count,
+                       MemAddress buffer)
+{
+    uint64_t offset = static_cast<uint64_t>( sector ) * BLOCK_SECTOR_SIZE;
+    uint64_t length = static_cast<uint64_t>( count ) * BLOCK_SECTOR_SIZE;
+
+    if (op == BLOCK_OP_FLUSH)
+        return this->flush() ? BLOCK_STATUS_DONE : BLOCK_STATUS_IO_ERROR;
+    if (op != BLOCK_OP_READ && op != BLOCK_OP_WRITE)
+        return BLOCK_STATUS_BAD_OP;
+
+    if (offset + length > this->imageSize)
+        return BLOCK_STATUS_BAD_SECTOR;
+    if (!inMemory(buffer, length, this->mb->getMemorySize()))
+        return BLOCK_STATUS_BAD_BUFFER;
+    if (length == 0)
+        return BLOCK_STATUS_DONE;
+
+    uint8_t* memory = &Device::getMemory(*this->mb)[buffer];
+    if (op == BLOCK_OP_READ)
+    {
+        if (this->overlay && !this->overlay->read(offset, length, memory))
+            return BLOCK_STATUS_IO_ERROR;
+        else if (!this->overlay)
+            memcpy(memory, this->image + offset, length);
+        this->markDirty(buffer, static_cast<MemAddress>( length ));
+        return BLOCK_STATUS_DONE;
+    }
+
+    if (this->readOnly)
+        return BLOCK_STATUS_READ_ONLY;
+
+    if (this->overlay && !this->overlay->write(offset, length, memory))
+        return BLOCK_STATUS_IO_ERROR;
+    else if (!this->overlay)
+        memcpy(this->image + offset, memory, length);
+
+    bool batched;
+    {
+        boost::lock_guard<boost::mutex> lock(this->dirtyMutex);
+        if (this->unflushed == 0)
+        {
+            this->dirtyBegin = offset;
+            this->dirtyEnd   = offset + length;
+        }
+        else
+        {
+            this->dirtyBegin = min(this->dirtyBegin, offset);
+            this->dirtyEnd   = max(this->dirtyEnd, offset + length);
+        }
+        this->unflushed += length;
+        batched = this->unflushed >= BLOCK_FLUSH_BATCH;
+    }
+
+    if (batched && !this->flush())
+        return BLOCK_STATUS_IO_ERROR;
+    return BLOCK_STATUS_DONE;
+}
+
+void BlockDevice::submit(int queue)
+{
+    Queue& q = this->queues[queue];
+    uint8_t* memory  = &Device::getMemory(*this->mb)[0];
+    uint8_t* control = memory + this->mappingAddr + BLOCK_INFO_SIZE +
+                       queue * BLOCK_QUEUE_SIZE;
+
+    uint32_t sqHead = read32(control + BLOCK_QUEUE_SQ_HEAD);
+    // the entries must be read after the head that covers them
+    atomic_thread_fence(memory_order_acquire);
+
+    uint32_t taken = 0;
+    while (q.sqTail != sqHead &&
+           q.cqHead - q.cqTail + q.inFlight < BLOCK_QUEUE_DEPTH)
+    {
+        const uint8_t* sqe = control + BLOCK_QUEUE_SQ +
+                             (q.sqTail % BLOCK_QUEUE_DEPTH) * BLOCK_SQE_SIZE;
+        Request request;
+        request.queue  = queue;
+        request.op     = read32(sqe + BLOCK_SQE_OP);
+        request.sector = read32(sqe + BLOCK_SQE_SECTOR);
+        request.count  = read32(sqe + BLOCK_SQE_COUNT);
+        request.buffer = read32(sqe + BLOCK_SQE_BUFFER);
+        request.tag    = read32(sqe + BLOCK_SQE_TAG);
+        request.taken  = microseconds();
+        this->requests.push_back(request);
+
+        q.sqTail++;
+        q.inFlight++;
+        taken++;
+    }
+    if (!taken)
+        return;
+
+    write32(control + BLOCK_QUEUE_SQ_TAIL, q.sqTail);
+    write32(control + BLOCK_QUEUE_IN_FLIGHT, q.inFlight);
+    this->countTaken(taken);
+}
+
+void BlockDevice::notify(int queue)
+{
+    Queue& q = this->queues[queue];
+    uint32_t waiting   = q.cqHead - q.cqTail;
+    uint32_t threshold = max<uint32_t>(q.threshold, 1);
+    if (!q.armed || !waiting || (waiting < threshold && q.inFlight > 0))
+        return;
+
+    q.armed = false;
+    InterruptController* ic = this->mb->getInterruptController();
+    if (ic && this->interruptLine >= 0)
+        ic->interrupt(this->interruptLine);
+}
+
+void BlockDevice::submitChains()
+{
+    uint32_t taken = 0;
+
+    // the guest may go on adding chains without writing the port meanwhile
+    this->virtqueue.disableNotify();
+    do
+    {
+        VirtQueue::Chain chain;
+        while (this->virtqueue.pop(chain))
+        {
+            Request request;
+            request.queue  = -1;
+            request.tag    = chain.head;
+            request.taken  = microseconds();
+            request.buffers.swap(chain.buffers);
+            request.attachment = this->attachments;
+            this->requests.push_back(request);
+
+            this->chainsInFlight++;
+            taken++;
+        }
+    } while (this->virtqueue.enableNotify());
+
+    // chains that could not be followed were used already
+    if (this->virtqueue.publish(this->chainsInFlight == 0))
+    {
+        InterruptController* ic = this->mb->getInterruptController();
+        if (ic && this->interruptLine >= 0)
+            ic->interrupt(this->interruptLine);
+    }
+
+    if (taken)
+        this->countTaken(taken);
+}
+
+void BlockDevice::countTaken(uint32_t count)
+{
+    this->inFlight += count;
+    if (this->inFlight > this->maxInFlight)
+    {
+        this->maxInFlight = this->inFlight;
+        vector<uint8_t>& memory = Device::getMemory(*this->mb);
+        write32(&memory[this->mappingAddr + BLOCK_INFO_MAX_DEPTH],
+                this->maxInFlight);
+    }
+    this->work.notify_all();
+}
+
+void BlockDevice::serveChain(const vector<VirtQueue::Buffer>& buffers,
+                             uint32_t& written)
+{
+    written = 0;
+    if (buffers.size() < 2 ||
+        buffers.front().writable ||
+        buffers.front().length < BLOCK_VIRTQUEUE_HEADER ||
+        !buffers.back().writable ||
+        buffers.back().length < 4)
+        return;
+
+    uint8_t* memory = &Device::getMemory(*this->mb)[0];
+    uint32_t op     = read32(memory + buffers.front().address);
+    uint32_t sector = read32(memory + buffers.front().address + 4);
+
+    int status;
+    if (buffers.size() == 2)
+        status = this->serve(op, sector, 0, 0);
+    for (vector<VirtQueue::Buffer>::size_type i = 1;
+         i + 1 < buffers.size();
+         i++)
+    {
+        const VirtQueue::Buffer& buffer = buffers[i];
+        // reads go into writable buffers, writes come from readable ones
+        if (buffer.length % BLOCK_SECTOR_SIZE ||
+            buffer.writable != (op == BLOCK_OP_READ))
+        {
+            status = op == BLOCK_OP_READ || op == BLOCK_OP_WRITE
+                   ? BLOCK_STATUS_BAD_BUFFER
+                   : BLOCK_STATUS_BAD_OP;
+        }
+        else
+        {
+            status = this->serve(op, sector,
+                                 buffer.length / BLOCK_SECTOR_SIZE,
+                                 buffer.address);
+        }
+        if (status != BLOCK_STATUS_DONE)
+            break;
+
+        if (buffer.writable)
+            written += buffer.length;
+        sector += buffer.length / BLOCK_SECTOR_SIZE;
+    }
+
+    write32(memory + buffers.back().address, status);
+    written += 4;
+}
+
+void BlockDevice::runWorker(Device* dev, Motherboard& mb)
+{
+    BlockDevice* block = dynamic_cast<BlockDevice*>( dev );
+    assert(block);
+
+    block->runWorker();
+}
+
+void BlockDevice::runWorker()
+{
+    uint8_t* memory = &Device::getMemory(*this->mb)[0];
+
+    boost::unique_lock<boost::mutex> lock(this->mutex);
+    while (true)
+    {
+        while (this->run && this->requests.empty())
+            this->work.wait(lock);
+        if (this->requests.empty())
+            break;  // stopped, and every request taken has been served
+
+        Request request = this->requests.front();
+        this->requests.pop_front();
+
+        lock.unlock();
+        int status = 0;
+        uint32_t written = 0;
+        if (request.queue < 0)
+            this->serveChain(request.buffers, written);
+        else
+            status = this->serve(request.op, request.sector,
+                                 request.count, request.buffer);
+        int64_t took = microseconds() - request.taken;
+        lock.lock();
+
+        int bucket = 0;
+        while (bucket < BLOCK_LATENCY_BUCKETS - 1 && took >= (2LL << bucket))
+            bucket++;
+        this->latency[bucket]++;
+        write32(memory + this->mappingAddr + BLOCK_INFO_LATENCY + 4 * bucket,
+                this->latency[bucket]);
+
+        this->inFlight--;
+        if (request.queue < 0)
+        {
+            if (request.attachment != this->attachments)
+                continue;   // the virtqueue was attached again meanwhile
+
+            this->virtqueue.push(request.tag, written);
+            this->chainsInFlight--;
+            if (this->virtqueue.publish(this->chainsInFlight == 0))
+            {
+                InterruptController* ic = this->mb->getInterruptController();
+                if (ic && this->interruptLine >= 0)
+                    ic->interrupt(this->interruptLine);
+            }
+            continue;
+        }
+
+        Queue& q = this->queues[request.queue];
+        uint8_t* control = memory + this->mappingAddr + BLOCK_INFO_SIZE +
+                           request.queue * BLOCK_QUEUE_SIZE;
+        uint8_t* cqe = control + BLOCK_QUEUE_CQ +
+                       (q.cqHead % BLOCK_QUEUE_DEPTH) * BLOCK_CQE_SIZE;
+        write32(cqe + BLOCK_CQE_TAG, request.tag);
+        write32(cqe + BLOCK_CQE_STATUS, status);
+        q.cqHead++;
+        q.inFlight--;
+        // the completion must be in place before the guest sees the head
+        atomic_thread_fence(memory_order_release);
+        write32(control + BLOCK_QUEUE_CQ_HEAD, q.cqHead);
+        write32(control + BLOCK_QUEUE_IN_FLIGHT, q.inFlight);
+
+        this->notify(request.queue);
+    }
+}
+
+bool BlockDevice::flush()
+{
+    // a flush returns only once the writes before it are out, even those
+    // that another flush is writing
+    boost::lock_guard<boost::mutex> flushing(this->flushMutex);
+
+    boost::unique_lock<boost::mutex> lock(this->dirtyMutex);
+    if (this->unflushed == 0)
+        return true;
+
+    // msync wants a page-aligned start
+    uint64_t page  = sysconf(_SC_PAGESIZE);
+    uint64_t begin = this->dirtyBegin / page * page;
+    uint64_t end   = this->dirtyEnd;
+    this->unflushed = 0;
+    lock.unlock();
+
+    if (this->overlay)
+        return this->overlay->flush();
+    return msync(this->image + begin, end - begin, MS_SYNC) == 0;
+}
+
+void BlockDevice::markDirty(MemAddress addr, MemAddress len)
+{
+    const vector<DirtyTracker*>& trackers = this->mb->getDirtyTrackers();
+    for (vector<DirtyTracker*>::size_type i = 0; i < trackers.size(); i++)
+        trackers[i]->mark(addr, len);
+}
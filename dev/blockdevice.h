@@ -0,0 +1,377 @@
+/**
+ * @file    blockdevice.h
+ *
+ * Matrix VM
+ */
+
+#ifndef BLOCKDEVICE_H
+#define BLOCKDEVICE_H
+
+#include <machine/device.h>
+#include <machine/virtqueue.h>
+#include "cowimage.h"
+
+#include <string>
+#include <deque>
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/condition_variable.hpp>
+
+#define BLOCK_SECTOR_SIZE       512
+
+/* info, at the start of the reserved memory (big endian), written by the
+   device:
+    0   4   number of sectors on the disk
+    4   4   bytes per sector
+    8   4   BLOCK_INFO_ flags
+   12   4   number of queues
+   16   4   entries in each ring of a queue
+   20   4   most requests ever in flight at once, over all queues
+   24   4n  latency histogram:  count of requests that took under 2 us,
+            2 to 4 us, 4 to 8 us, and so on; the last counts the rest
+   88       queues, BLOCK_QUEUE_SIZE bytes each
+   ..   16  virtqueue config, as VirtQueue describes */
+#define BLOCK_INFO_SECTORS      0
+#define BLOCK_INFO_SECTOR_SIZE  4
+#define BLOCK_INFO_FLAGS        8
+#define BLOCK_INFO_QUEUES       12
+#define BLOCK_INFO_DEPTH        16
+#define BLOCK_INFO_MAX_DEPTH    20
+#define BLOCK_INFO_LATENCY      24
+#define BLOCK_LATENCY_BUCKETS   16
+#define BLOCK_INFO_SIZE         (BLOCK_INFO_LATENCY + 4 * BLOCK_LATENCY_BUCKETS)
+
+#define BLOCK_INFO_READ_ONLY    0x1
+
+/* request descriptor, anywhere in guest memory (big endian):
+    0   4   BLOCK_OP_ value
+    4   4   first sector
+    8   4   number of sectors
+   12   4   address of the buffer
+   16   4   status, written by the device:  a BLOCK_STATUS_ value */
+#define BLOCK_DESC_OP           0
+#define BLOCK_DESC_SECTOR       4
+#define BLOCK_DESC_COUNT        8
+#define BLOCK_DESC_BUFFER       12
+#define BLOCK_DESC_STATUS       16
+#define BLOCK_DESC_SIZE         20
+
+#define BLOCK_OP_READ           1       // disk to buffer
+#define BLOCK_OP_WRITE          2       // buffer to disk
+#define BLOCK_OP_FLUSH          3       // make earlier writes durable
+
+#define BLOCK_STATUS_DONE       0
+#define BLOCK_STATUS_BAD_OP     1
+#define BLOCK_STATUS_BAD_SECTOR 2       // past the end of the disk
+#define BLOCK_STATUS_BAD_BUFFER 3       // buffer is not in memory
+#define BLOCK_STATUS_READ_ONLY  4
+#define BLOCK_STATUS_IO_ERROR   5
+
+/* queue (big endian):
+    0   4   submission head:  requests submitted so far, written by the guest
+    4   4   submission tail:  requests taken so far, written by the device
+    8   4   completion head:  requests completed so far, written by the device
+   12   4   completion tail:  completions taken so far, written by the guest
+   16   4   completions to wait for before interrupting; written by the guest
+   20   4   requests in flight, written by the device
+   24   20n submission ring; request i is in entry i % BLOCK_QUEUE_DEPTH
+   ..   8n  completion ring */
+#define BLOCK_QUEUE_SQ_HEAD     0
+#define BLOCK_QUEUE_SQ_TAIL     4
+#define BLOCK_QUEUE_CQ_HEAD     8
+#define BLOCK_QUEUE_CQ_TAIL     12
+#define BLOCK_QUEUE_THRESHOLD   16
+#define BLOCK_QUEUE_IN_FLIGHT   20
+#define BLOCK_QUEUE_SQ          24
+#define BLOCK_QUEUE_CQ          (BLOCK_QUEUE_SQ + \
+                                 BLOCK_QUEUE_DEPTH * BLOCK_SQE_SIZE)
+#define BLOCK_QUEUE_SIZE        (BLOCK_QUEUE_CQ + \
+                                 BLOCK_QUEUE_DEPTH * BLOCK_CQE_SIZE)
+
+/* submission entry (big endian):
+    0   4   BLOCK_OP_ value
+    4   4   first sector
+    8   4   number of sectors
+   12   4   address of the buffer
+   16   4   tag, handed back in the completion */
+#define BLOCK_SQE_OP            0
+#define BLOCK_SQE_SECTOR        4
+#define BLOCK_SQE_COUNT         8
+#define BLOCK_SQE_BUFFER        12
+#define BLOCK_SQE_TAG           16
+#define BLOCK_SQE_SIZE          20
+
+/* completion entry (big endian):
+    0   4   tag of the request
+    4   4   a BLOCK_STATUS_ value */
+#define BLOCK_CQE_TAG           0
+#define BLOCK_CQE_STATUS        4
+#define BLOCK_CQE_SIZE          8
+
+#define BLOCK_QUEUE_COUNT       4
+#define BLOCK_QUEUE_DEPTH       64
+
+#define BLOCK_VIRTQUEUE_CONFIG  (BLOCK_INFO_SIZE + \
+                                 BLOCK_QUEUE_COUNT * BLOCK_QUEUE_SIZE)
+
+/* request on the virtqueue, a chain of:
+    a readable header (big endian):
+        0   4   BLOCK_OP_ value
+        4   4   first sector
+    readable buffers to write, or writable buffers to read into; whole
+    sectors each, one after the other on the disk
+    a writable status (big endian):
+        0   4   a BLOCK_STATUS_ value
+
+   The bytes written to a served chain are the status and what was read;
+   a chain that is not of this form is used with none written. */
+#define BLOCK_VIRTQUEUE_HEADER  8
+#define BLOCK_VIRTQUEUE_ENTRIES 256
+
+// host threads serving queued requests
+#define BLOCK_IO_THREADS        4
+
+// bytes written before they are flushed to the image without being asked
+#define BLOCK_FLUSH_BATCH       (4 * 1024 * 1024)
+
+#define DEFAULT_BLOCK_PORT      10
+/* written with the number of a queue that has new requests or free room */
+#define DEFAULT_BLOCK_QUEUE_PORT    11
+/* written with a VIRTQUEUE_KICK_ value for queue 0, the only one */
+#define DEFAULT_BLOCK_VIRTQUEUE_PORT    14
+/* raised when a request has completed */
+#define BLOCK_INT_LINE          7
+
+namespace machine
+{
+
+struct BlockDeviceArgs
+{
+    const char* path;   //!< Disk image file
+    const char* overlay;    //!< Overlay for writes, or null to write the image
+    int interruptLine;  //!< Negative for no completion interrupt
+
+    BlockDeviceArgs()
+    : path(0), overlay(0), interruptLine(BLOCK_INT_LINE)
+    { }
+};
+
+/**
+ * @class BlockDevice
+ *
+ * A virtual disk, backed by an image file on the host that is mapped into
+ * the VM's address space.
+ *
+ * The guest fills in a request descriptor and writes its address to the
+ * port.  Requests are served on a host thread, in order, while the CPU keeps
+ * running:  reads and writes are copies between the mapping and the buffer.
+ * When a request is done, the device writes the status into the descriptor
+ * and interrupts.
+ *
+ * For many requests in flight at once, the guest uses the queues instead.
+ * It adds requests to a queue's submission ring and writes the queue's number
+ * to the queue port.  A pool of host threads serves them in parallel, so they
+ * may complete in any order:  the tag of each request and its status are
+ * added to the completion ring.  Requests that overlap must not be in flight
+ * at the same time.  A request is taken only while its completion has room.
+ *
+ * Completions interrupt sparingly.  Writing the queue port arms the queue,
+ * and an armed queue interrupts once, when its threshold of completions is
+ * waiting or it has nothing left in flight.  The guest takes the completions,
+ * stores the new completion tail, and writes the port again to be told of
+ * more.  The device reads the completion tail and threshold only on those
+ * writes.  Each queue can belong to a different CPU, without locking.
+ *
+ * The disk also serves a VirtQueue, the transport that devices share.  Its
+ * requests are served by the same host threads, and a request may gather
+ * many buffers.
+ *
+ * Written sectors reach the image file in batches:  when BLOCK_FLUSH_BATCH
+ * bytes have been written since the last flush, on a BLOCK_OP_FLUSH request,
+ * and when the device goes away.  Only a completed flush makes earlier writes
+ * durable.  An image that cannot be opened for writing is attached read-only.
+ *
+ * With an overlay, the image is only read, and can be shared by many
+ * machines; the clusters written go to the overlay, as CowImage describes.
+ */
+class BlockDevice : public Device
+{
+public:
+
+    /**
+     * @param[in]   path            Disk image file
+     * @param[in]   overlay         Overlay to keep writes in, created if
+     *                              there is none; empty to write the image
+     * @param[in]   interruptLine   Line to interrupt on when a request has
+     *                              completed, or negative for none
+     */
+    BlockDevice(const std::string& path, const std::string& overlay = "",
+                int interruptLine = BLOCK_INT_LINE);
+
+    virtual ~BlockDevice();
+
+    /**
+     * @return  Name of the device
+     */
+    virtual std::string getName() const;
+
+    virtual void init(Motherboard& mb);
+
+    /**
+     * Serve a request, or look at a queue
+     * @param[in]   what    Address of the request descriptor, the number of
+     *                      the queue, or a VIRTQUEUE_KICK_ value
+     * @param[in]   port    DEFAULT_BLOCK_PORT, DEFAULT_BLOCK_QUEUE_PORT or
+     *                      DEFAULT_BLOCK_VIRTQUEUE_PORT
+     */
+    virtual void write(MemAddress what, int port);
+
+    /**
+     * @param[in]   port
+     * @return  PORT_POSTED for a request, which is served off the CPU thread;
+     *          PORT_SYNCHRONOUS for a queue or the virtqueue, which only hand
+     *          requests to the host threads
+     */
+    virtual PortMode getPortMode(int port) const;
+
+    /**
+     * Stops the host threads, once they have served the requests taken
+     * @param[in]   thd     Thread to stop; ignored
+     */
+    virtual void stopThread(boost::thread* thd);
+
+protected:
+
+    /**
+     * Serve a request
+     * @param[in]   op      BLOCK_OP_ value
+     * @param[in]   sector  First sector
+     * @param[in]   count   Number of sectors
+     * @param[in]   buffer  Address of the buffer
+     * @return  A BLOCK_STATUS_ value
+     */
+    int serve(uint32_t op, uint32_t sector, uint32_t count, MemAddress buffer);
+
+    /**
+     * Take the requests a queue has room for, and interrupt if it is armed
+     * and done
+     * @param[in]   queue   Number of the queue
+     * @pre `mutex` is held
+     */
+    void submit(int queue);
+
+    /**
+     * Interrupt for a queue, if it is armed and either has enough completions
+     * waiting or nothing in flight
+     * @param[in]   queue   Number of the queue
+     * @pre `mutex` is held
+     */
+    void notify(int queue);
+
+    /**
+     * Take the chains available on the virtqueue, until the guest has no
+     * more to add
+     * @pre `mutex` is held
+     */
+    void submitChains();
+
+    /**
+     * Count requests taken, and wake the host threads
+     * @param[in]   count   Requests just taken
+     * @pre `mutex` is held
+     */
+    void countTaken(uint32_t count);
+
+    /**
+     * Serve a request from the virtqueue
+     * @param[in]   buffers     The chain's buffers
+     * @param[out]  written     Bytes written to the chain
+     */
+    void serveChain(const std::vector<VirtQueue::Buffer>& buffers,
+                    uint32_t& written);
+
+    /**
+     * Delegate callback to call runWorker()
+     */
+    static void runWorker(Device* dev, Motherboard& mb);
+
+    /**
+     * Serves queued requests until stopped
+     */
+    void runWorker();
+
+    /**
+     * Write the dirty part of the mapping to the image file, or make the
+     * overlay durable
+     * @return  Whether it succeeded
+     */
+    bool flush();
+
+    /**
+     * Mark read pixels as dirty
+     * @param[in]   addr
+     * @param[in]   len
+     */
+    void markDirty(MemAddress addr, MemAddress len);
+
+private:
+
+    Motherboard* mb;
+
+    std::string path;
+    std::string overlayPath;
+    int interruptLine;
+
+    MemAddress mappingAddr; //<! The DMA address of the obtained reserved memory
+
+    int         fd;
+    bool        readOnly;
+    uint8_t*    image;      //<! The image file, mapped
+    CowImage*   overlay;    //<! Where writes go instead, or null
+    uint64_t    imageSize;  //<! Bytes mapped; whole sectors
+    boost::mutex    flushMutex;
+    boost::mutex    dirtyMutex;
+    uint64_t    dirtyBegin; //<! Range written since the last flush
+    uint64_t    dirtyEnd;
+    uint64_t    unflushed;  //<! Bytes written since the last flush
+
+    /* a request taken from a queue */
+    struct Request
+    {
+        int         queue;  //<! Negative for the virtqueue
+        uint32_t    op;
+        uint32_t    sector;
+        uint32_t    count;
+        MemAddress  buffer;
+        uint32_t    tag;
+        int64_t     taken;  //<! Microseconds, when the request was taken
+        std::vector<VirtQueue::Buffer> buffers;     //<! Of a virtqueue chain
+        uint32_t    attachment; //<! Of the virtqueue, when the chain was taken
+    };
+
+    /* host state of a queue */
+    struct Queue
+    {
+        uint32_t    sqTail;
+        uint32_t    cqHead;
+        uint32_t    inFlight;
+        bool        armed;  //<! Whether the next completions interrupt
+        uint32_t    cqTail;     //<! The guest's, as of its last write
+        uint32_t    threshold;  //<! The guest's, as of its last write
+    };
+
+    boost::mutex                mutex;
+    boost::condition_variable   work;
+    bool                        run;
+    std::deque<Request>         requests;   //<! Taken, but not started
+    Queue                       queues[BLOCK_QUEUE_COUNT];
+    VirtQueue                   virtqueue;
+    uint32_t                    chainsInFlight; //<! From the virtqueue
+    uint32_t                    attachments;    //<! Of the virtqueue so far
+    uint32_t                    inFlight;   //<! Over all queues
+    uint32_t                    maxInFlight;
+    uint32_t                    latency[BLOCK_LATENCY_BUCKETS];
+};
+
+}   // namespace machine
+
+#endif // BLOCKDEVICE_H
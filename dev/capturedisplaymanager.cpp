@@ -0,0 +1,229 @@
+#include "capturedisplaymanager.h"
+#include "pixelconvert.h"
+
+#include <string.h>
+#include <stdexcept>
+#include <algorithm>
+
+using namespace std;
+using namespace machine;
+
+CaptureDisplayManager::CaptureDisplayManager(const string& path)
+: path(path), file(0), y4m(false), framebuffer(0), width(0), height(0),
+  paletteSerial(0), toDestroy(false), written(0), dropped(0)
+{
+    string::size_type ext = path.rfind('.');
+    this->y4m = ext != string::npos && path.substr(ext) == ".y4m";
+}
+
+CaptureDisplayManager::~CaptureDisplayManager()
+{
+    if (this->file)
+        fclose(this->file);
+
+    for (deque<vector<uint32_t>*>::size_type i = 0; i < this->queue.size(); i++)
+        delete this->queue[i];
+    for (vector<vector<uint32_t>*>::size_type i = 0;
+         i < this->spare.size();
+         i++)
+        delete this->spare[i];
+}
+
+void CaptureDisplayManager::init(
+    const Framebuffer&      framebuffer,
+    InterruptController*    ic
+    )
+{
+    this->framebuffer = &framebuffer;
+    this->mode   = framebuffer.getMode();
+    this->width  = this->mode.width;
+    this->height = this->mode.height;
+    this->canvas.assign(this->width * this->height, 0);
+    this->palette.resize(FRAMEBUFFER_PALETTE_SIZE);
+    this->paletteSerial = framebuffer.getPalette(&this->palette[0]);
+    this->toDestroy = false;
+
+    this->file = fopen(this->path.c_str(), "wb");
+    if (!this->file)
+        throw runtime_error("Could not open capture file " + this->path);
+
+    if (this->y4m)
+    {
+        // frames come at the guest's pace, not at a fixed rate
+        fprintf(this->file, "YUV4MPEG2 W%d H%d F60:1 Ip A1:1 C420jpeg\n",
+                this->width, this->height);
+    }
+}
+
+void CaptureDisplayManager::show()
+{
+    while (1)
+    {
+        vector<uint32_t>* frame;
+        {
+            boost::unique_lock<boost::mutex> lock(this->mutex);
+            while (this->queue.empty() && !this->toDestroy)
+                this->ready.wait(lock);
+            // write what was flushed before destroy() before returning
+            if (this->queue.empty())
+                break;
+            frame = this->queue.front();
+            this->queue.pop_front();
+        }
+
+        this->writeFrame(*frame);
+
+        boost::lock_guard<boost::mutex> lock(this->mutex);
+        this->spare.push_back(frame);
+        this->written++;
+    }
+
+    fflush(this->file);
+    printf("Captured %lu frames to %s (%lu dropped)\n",
+           this->written, this->path.c_str(), this->dropped);
+}
+
+void CaptureDisplayManager::flush(const vector<DirtyRect>& rects)
+{
+    const vector<DirtyRect>* draw = &rects;
+
+    // a new mode is drawn from scratch
+    vector<DirtyRect> all;
+    FramebufferMode mode = this->framebuffer->getMode();
+    if (mode != this->mode)
+    {
+        this->mode = mode;
+        fill(this->canvas.begin(), this->canvas.end(), 0);
+
+        DirtyRect rect;
+        rect.x      = 0;
+        rect.y      = 0;
+        rect.width  = mode.width;
+        rect.height = mode.height;
+        all.assign(1, rect);
+        draw = &all;
+    }
+    if (this->framebuffer->getPaletteSerial() != this->paletteSerial)
+        this->paletteSerial = this->framebuffer->getPalette(&this->palette[0]);
+
+    /* bring the dirty areas of the canvas up to date */
+    const uint8_t* pixels =
+        this->framebuffer->getPixels(this->framebuffer->getFrontPage());
+    const int pitch = mode.getPitch();
+    const int bpp   = mode.getBytesPerPixel();
+    for (vector<DirtyRect>::size_type i = 0; i < draw->size(); i++)
+    {
+        const DirtyRect& rect = (*draw)[i];
+        int right  = min(rect.x + rect.width,  min(mode.width,  this->width));
+        int bottom = min(rect.y + rect.height, min(mode.height, this->height));
+        for (int y = rect.y; y < bottom; y++)
+        {
+            if (rect.x >= right)
+                break;
+            convertToXrgb32(mode.format, pixels + y * pitch + rect.x * bpp,
+                            &this->canvas[y * this->width + rect.x],
+                            right - rect.x, &this->palette[0]);
+        }
+    }
+
+    /* take a frame, dropping the oldest waiting one if the queue is full */
+    vector<uint32_t>* frame = 0;
+    {
+        boost::lock_guard<boost::mutex> lock(this->mutex);
+        if (this->queue.size() >= CAPTURE_QUEUE_FRAMES)
+        {
+            frame = this->queue.front();
+            this->queue.pop_front();
+            this->dropped++;
+        }
+        else if (!this->spare.empty())
+        {
+            frame = this->spare.back();
+            this->spare.pop_back();
+        }
+    }
+    if (!frame)
+        frame = new vector<uint32_t>;
+
+    *frame = this->canvas;
+    {
+        boost::lock_guard<boost::mutex> lock(this->mutex);
+        this->queue.push_back(frame);
+    }
+    this->ready.notify_one();
+
+    // the frame is copied, so the guest may draw again
+    this->flushed();
+}
+
+void CaptureDisplayManager::destroy()
+{
+    {
+        boost::lock_guard<boost::mutex> lock(this->mutex);
+        this->toDestroy = true;
+    }
+    this->ready.notify_one();
+}
+
+void CaptureDisplayManager::writeFrame(const vector<uint32_t>& frame)
+{
+    const int w = this->width;
+    const int h = this->height;
+
+    if (!this->y4m)
+    {
+        this->out.resize(w * h * 3);
+        uint8_t* dst = &this->out[0];
+        for (int i = 0; i < w * h; i++, dst += 3)
+        {
+            dst[0] = frame[i] >> 16;
+            dst[1] = frame[i] >> 8;
+            dst[2] = frame[i];
+        }
+        fwrite(&this->out[0], 1, this->out.size(), this->file);
+        return;
+    }
+
+    /* full range BT.601, as JPEG uses; chroma is averaged over 2x2 blocks */
+    const int cw = (w + 1) / 2;
+    const int ch = (h + 1) / 2;
+    this->out.resize(w * h + 2 * cw * ch);
+    uint8_t* py = &this->out[0];
+    uint8_t* pu = py + w * h;
+    uint8_t* pv = pu + cw * ch;
+
+    for (int i = 0; i < w * h; i++)
+    {
+        int r = (frame[i] >> 16) & 0xFF;
+        int g = (frame[i] >> 8) & 0xFF;
+        int b = frame[i] & 0xFF;
+        py[i] = (77 * r + 150 * g + 29 * b + 128) >> 8;
+    }
+
+    for (int cy = 0; cy < ch; cy++)
+    {
+        for (int cx = 0; cx < cw; cx++)
+        {
+            int r = 0, g = 0, b = 0, n = 0;
+            for (int y = cy * 2; y < min(cy * 2 + 2, h); y++)
+            {
+                for (int x = cx * 2; x < min(cx * 2 + 2, w); x++, n++)
+                {
+                    uint32_t p = frame[y * w + x];
+                    r += (p >> 16) & 0xFF;
+                    g += (p >> 8) & 0xFF;
+                    b += p & 0xFF;
+                }
+            }
+            r /= n;
+            g /= n;
+            b /= n;
+            // offset by 128 << 8 so that the shifts are of positive numbers
+            pu[cy * cw + cx] = (-43 * r -  84 * g + 127 * b + 32896) >> 8;
+            pv[cy * cw + cx] = (127 * r - 106 * g -  21 * b + 32896) >> 8;
+        }
+    }
+
+    fputs("FRAME\n", this->file);
+    fwrite(&this->out[0], 1, this->out.size(), this->file);
+}
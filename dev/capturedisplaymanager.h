@@ -0,0 +1,104 @@
+#ifndef CAPTUREDISPLAYMANAGER_H
+#define CAPTUREDISPLAYMANAGER_H
+
+#include "displaymanager.h"
+
+#include <stdio.h>
+#include <string>
+#include <deque>
+#include <boost/thread.hpp>
+
+// frames waiting to be written; past this, the oldest is dropped
+#define CAPTURE_QUEUE_FRAMES 8
+
+/**
+ * @class CaptureDisplayManager
+ *
+ * A headless display that writes every flushed frame to a file, for checking
+ * display output where there is no X server.
+ *
+ * A path that ends in ".y4m" gets a YUV4MPEG2 stream (4:2:0, one frame per
+ * flush); any other path gets raw RGB24 frames, one after another.  Frames
+ * are the size of the mode the display starts in; later modes are cropped or
+ * padded with black to fit.
+ *
+ * flush() copies the frame into a bounded queue and completes at once, and
+ * the thread that the DisplayDevice gives to show() writes the queue out.  If
+ * the disk falls behind, the oldest waiting frame is dropped, so the guest
+ * never waits on the disk.
+ */
+class CaptureDisplayManager : public DisplayManager
+{
+public:
+
+    /**
+     * @param[in]   path    File to write frames to
+     */
+    CaptureDisplayManager(const std::string& path);
+
+    ~CaptureDisplayManager();
+
+    /**
+     * Open the capture file
+     * @throw   runtime_error if the file cannot be opened
+     */
+    void init(
+        const machine::Framebuffer&     framebuffer,
+        machine::InterruptController*   ic
+        );
+
+    /**
+     * Write frames until the display is destroyed
+     */
+    void show();
+
+    /**
+     * Queue the front page as a frame.  Does not block on the disk.
+     * @param[in]   rects   Areas that changed since the last flush
+     */
+    void flush(const std::vector<machine::DirtyRect>& rects);
+
+    /**
+     * Ask show() to write the frames that are left and return
+     */
+    void destroy();
+
+protected:
+
+    /**
+     * Write a frame to the file, converted to the file's format
+     * @param[in]   frame   XRGB32 pixels, the size of the capture
+     */
+    void writeFrame(const std::vector<uint32_t>& frame);
+
+private:
+
+    std::string path;
+    FILE*       file;
+    bool        y4m;        //<! YUV4MPEG2, rather than raw RGB24
+
+    const machine::Framebuffer* framebuffer;
+    machine::FramebufferMode    mode;       //<! Mode `canvas` is in
+    int                         width;      //<! Size of captured frames
+    int                         height;
+
+    /* used by flush() only */
+    std::vector<uint32_t>   canvas;     //<! Front page, as of the last flush
+    std::vector<uint32_t>   palette;
+    unsigned                paletteSerial;
+
+    /* shared between flush() and show() */
+    boost::mutex                        mutex;
+    boost::condition_variable           ready;
+    std::deque<std::vector<uint32_t>*>  queue;  //<! Frames not yet written
+    std::vector<std::vector<uint32_t>*> spare;  //<! Frames to reuse
+    bool                                toDestroy;
+    unsigned long                       written;
+    unsigned long                       dropped;
+
+    /* used by show() only */
+    std::vector<uint8_t>    out;        //<! Converted frame
+
+};
+
+#endif // CAPTUREDISPLAYMANAGER_H
@@ -5,8 +5,15 @@
  */
 
 #include "charoutputdevice.h"
+#include <dev/interruptcontroller.h>
 
 #include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/uio.h>
+#include <algorithm>
 #include <stdexcept>
 #include <cassert>
 
@@ -16,11 +23,28 @@ using namespace machine;
 // declared, but not defined, in device.h
 SLDECL Device* createDevice(void* args)
 {
-    return new CharOutputDevice;
+    CharOutputDeviceArgs* codArgs =
+        reinterpret_cast<CharOutputDeviceArgs*>( args );
+    if (codArgs)
+        return new CharOutputDevice(codArgs->interruptLine, codArgs->path);
+    else
+        return new CharOutputDevice;
 }
 
 /* public CharOutputDevice */
 
+CharOutputDevice::CharOutputDevice(int interruptLine /* = -1 */,
+                                   const char* path /* = 0 */)
+: mb(0), interruptLine(interruptLine), path(path ? path : "-"), fd(-1),
+  run(false), ring(OUTDEV_RING_SIZE), head(0), tail(0)
+{ }
+
+CharOutputDevice::~CharOutputDevice()
+{
+    if (this->fd > STDOUT_FILENO)
+        close(this->fd);
+}
+
 string CharOutputDevice::getName() const
 {
     return "HostStdout";
@@ -30,6 +54,15 @@ void CharOutputDevice::init(Motherboard& mb)
 {
     this->mb = &mb;
 
+    if (this->path == "-")
+        this->fd = STDOUT_FILENO;
+    else if ((this->fd = open(this->path.c_str(),
+                              O_WRONLY | O_CREAT | O_TRUNC, 0644)) < 0)
+    {
+        throw runtime_error("Could not open " + this->path +
+                            " for character output");
+    }
+
     MemAddress dmaLoc = Device::reserveMemIO(mb, *this, OUTDEV_BUFFER_SIZE);
     if (dmaLoc < 0)
         throw runtime_error("Could not request DMA memory for host stdout");
@@ -43,13 +76,122 @@ void CharOutputDevice::init(Motherboard& mb)
 
     if (!Device::requestPort(mb, this, 2))
         throw runtime_error("Could not initiate device port for host stdout");
+
+    this->run = true;
+    mb.requestThread(this, &CharOutputDevice::runWriter);
 }
 
 void CharOutputDevice::write(MemAddress what, int port)
 {
-    // TODO:  thread it
-    #if !EMULATOR_BENCHMARK
-    printf("%s", reinterpret_cast<const char*>( &Device::getMemory(*mb)[this->mappingAddr+1] ));
+    vector<uint8_t>& memory = Device::getMemory(*this->mb);
+    const char* text =
+        reinterpret_cast<const char*>( &memory[this->mappingAddr + 1] );
+    // the guest can overwrite the boundary char, so never look past the
+    // buffer; the text starts at its second byte
+    size_t length = strnlen(text, OUTDEV_BUFFER_SIZE - 2);
+
+    {
+        boost::unique_lock<boost::mutex> lock(this->mutex);
+        while (this->ring.size() - (this->head - this->tail) < length)
+            this->drained.wait(lock);
+
+        // the text may wrap around the end of the ring
+        size_t begin = this->head % this->ring.size();
+        size_t first = min(length, this->ring.size() - begin);
+        memcpy(&this->ring[begin], text, first);
+        memcpy(&this->ring[0], text + first, length - first);
+        this->head += length;
+        this->filled.notify_one();
+    }
+
+    InterruptController* ic = this->mb->getInterruptController();
+    if (ic && this->interruptLine >= 0)
+        ic->interrupt(this->interruptLine);
+}
+
+void CharOutputDevice::stopThread(boost::thread* thd)
+{
+    boost::lock_guard<boost::mutex> lock(this->mutex);
+    this->run = false;
+    this->filled.notify_one();
+}
+
+/* protected CharOutputDevice */
+
+void CharOutputDevice::runWriter(Device* dev, Motherboard& mb)
+{
+    CharOutputDevice* cod = dynamic_cast<CharOutputDevice*>( dev );
+    assert(cod);
+
+    cod->runWriter();
+}
+
+void CharOutputDevice::runWriter()
+{
+    boost::unique_lock<boost::mutex> lock(this->mutex);
+    while (true)
+    {
+        while (this->run && this->head == this->tail)
+            this->filled.wait(lock);
+        if (this->head == this->tail)
+            break;  // stopped, and everything has been written
+
+        // everything queued so far goes out in one call
+        size_t begin  = this->tail % this->ring.size();
+        size_t queued = this->head - this->tail;
+        struct iovec iov[2];
+        iov[0].iov_base = &this->ring[begin];
+        iov[0].iov_len  = min(queued, this->ring.size() - begin);
+        iov[1].iov_base = &this->ring[0];
+        iov[1].iov_len  = queued - iov[0].iov_len;
+
+        lock.unlock();
+        ssize_t written = this->writeOut(iov, iov[1].iov_len ? 2 : 1);
+        lock.lock();
+
+        // on error, drop what was queued rather than stall the guest
+        this->tail += written >= 0 ? written : queued;
+        this->drained.notify_all();
+    }
+
+    #if EMULATOR_BENCHMARK
+    // the run is over; the output no longer affects its timing
+    if (this->fd == STDOUT_FILENO)
+        fflush(stdout);
+    for (size_t done = 0; done < this->sink.size(); )
+    {
+        ssize_t written = ::write(this->fd, this->sink.data() + done,
+                                  this->sink.size() - done);
+        if (written < 0 && errno == EINTR)
+            continue;
+        if (written <= 0)
+            break;
+        done += written;
+    }
+    #endif
+}
+
+ssize_t CharOutputDevice::writeOut(const struct iovec* iov, int count)
+{
+    #if EMULATOR_BENCHMARK
+    ssize_t written = 0;
+    for (int i = 0; i < count; ++i)
+    {
+        this->sink.append(static_cast<const char*>( iov[i].iov_base ),
+                          iov[i].iov_len);
+        written += iov[i].iov_len;
+    }
+    // keep the latest output; trimming only now and then keeps appends cheap
+    if (this->sink.size() > 2 * OUTDEV_SINK_SIZE)
+        this->sink.erase(0, this->sink.size() - OUTDEV_SINK_SIZE);
+    return written;
+    #else
+    // keep the output in order with the VM's own messages
+    if (this->fd == STDOUT_FILENO)
+        fflush(stdout);
+
+    ssize_t written;
+    while ((written = ::writev(this->fd, iov, count)) < 0 && errno == EINTR);
+    return written;
     #endif
-    // TODO:  interrupt
 }
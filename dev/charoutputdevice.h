@@ -9,27 +9,64 @@
 
 #include <machine/device.h>
 
+#include <sys/types.h>
 #include <string>
+#include <vector>
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/condition_variable.hpp>
 
 // corresponds to the amount of memory-mapped to reserve
 #define OUTDEV_BUFFER_SIZE 83
 // 8 bits for flags + 80 chars + 1 null char + 1 boundary char (to eliminate
 // costly manipulation)
 
+/* raised when the buffer may be reused, if the device is given the line */
+#define OUTDEV_INT_LINE 3
+
+// bytes of output held on the host while the writer catches up
+#define OUTDEV_RING_SIZE (64 * 1024)
+// bytes of the latest output kept in memory by benchmark builds
+#define OUTDEV_SINK_SIZE (1024 * 1024)
+
+struct iovec;
+
 namespace machine
 {
 
+struct CharOutputDeviceArgs
+{
+    int interruptLine;  //!< Negative for no completion interrupt
+    const char* path;   //!< File to write to, or null for stdout
+
+    CharOutputDeviceArgs()
+    : interruptLine(-1), path(0)
+    { }
+};
+
 /**
  * @class CharOutputDevice
  *
  * This is a character output device.  This allows the virtualized system to
  * communicate with the real operating system through character data.
+ *
+ * Writing the port copies the guest's buffer into a ring on the host and
+ * returns; a writer thread hands everything in the ring to the file at once,
+ * so the guest only waits on the terminal when the ring is full.  Benchmark
+ * builds keep the output in memory instead, and print it when the machine
+ * stops.
  */
 class CharOutputDevice : public Device
 {
 public:
 
-    virtual ~CharOutputDevice() { }
+    /**
+     * @param[in]   interruptLine   Line to interrupt on when the buffer has
+     *                              been copied out, or negative for none
+     * @param[in]   path            File to write to, or null or "-" for stdout
+     */
+    CharOutputDevice(int interruptLine = -1, const char* path = 0);
+
+    virtual ~CharOutputDevice();
 
     /**
      * @return  Name of the device
@@ -39,19 +76,66 @@ public:
     virtual void init(Motherboard& init);
 
     /**
-     * Writes the buffer located at the reserverd DMA location to a file on the
-     * host
+     * Queues the buffer located at the reserverd DMA location to be written
+     * to a file on the host
+     *
+     * When the buffer has been copied, the device interrupts on its interrupt
+     * line, after which the guest may reuse the buffer.  Blocks only while
+     * the ring is full.
      *
      * @param[in]   what    Ignored
      * @param[in]   port    Currently ignored
      */
     virtual void write(MemAddress what, int port);
 
+    /**
+     * Stops the writer thread once it has written everything queued
+     * @param[in]   thd     Thread to stop; ignored
+     */
+    virtual void stopThread(boost::thread* thd);
+
+protected:
+
+    /**
+     * Delegate callback to call runWriter()
+     */
+    static void runWriter(Device* dev, Motherboard& mb);
+
+    /**
+     * Writes out the ring whenever it has data, until stopped and drained
+     */
+    void runWriter();
+
+    /**
+     * Write part of the ring to the file, or to the sink in benchmark builds
+     * @param[in]   iov     Parts of the ring to write, in order
+     * @param[in]   count   Number of parts
+     * @return  Number of bytes written, or negative on error
+     */
+    ssize_t writeOut(const struct iovec* iov, int count);
+
 private:
 
     Motherboard* mb;
 
+    int interruptLine;
+
     MemAddress mappingAddr; //<! The DMA address of the obtained reserved memory
+
+    std::string path;
+    int         fd;
+
+    boost::mutex                mutex;
+    boost::condition_variable   filled;     //<! Signaled when data is queued
+    boost::condition_variable   drained;    //<! Signaled when data is written
+    bool                        run;
+    std::vector<char>           ring;
+    uint64_t                    head;       //<! Bytes ever queued
+    uint64_t                    tail;       //<! Bytes ever written
+
+    #if EMULATOR_BENCHMARK
+    std::string sink;
+    #endif
 };
 
 }   // namespace machine
@@ -0,0 +1,276 @@
+/**
+ * @file    cowimage.cpp
+ *
+ * Matrix VM
+ */
+
+#include "cowimage.h"
+#include <machine/guestmemory.h>
+
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <algorithm>
+#include <stdexcept>
+#include <boost/thread/lock_guard.hpp>
+
+using namespace std;
+using namespace machine;
+
+static bool preadAll(int fd, uint8_t* into, uint64_t length, uint64_t offset)
+{
+    while (length > 0)
+    {
+        ssize_t n = pread(fd, into, length, offset);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0)
+            return false;
+        if (n == 0)
+        {   // past the end of the file; never written, so zero
+            memset(into, 0, length);
+            return true;
+        }
+        into   += n;
+        length -= n;
+        offset += n;
+    }
+    return true;
+}
+
+static bool pwriteAll(int fd, const uint8_t* from, uint64_t length,
+                      uint64_t offset)
+{
+    while (length > 0)
+    {
+        ssize_t n = pwrite(fd, from, length, offset);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return false;
+        from   += n;
+        length -= n;
+        offset += n;
+    }
+    return true;
+}
+
+/* public CowImage */
+
+CowImage::CowImage(const string& path, const uint8_t* base, uint64_t size)
+: fd(-1), base(base), size(size), clusterBits(COW_CLUSTER_BITS), end(0)
+{
+    this->fd = open(path.c_str(), O_RDWR | O_CREAT, 0644);
+    struct stat st;
+    if (this->fd < 0 || fstat(this->fd, &st) < 0)
+        throw runtime_error("Could not open overlay " + path);
+
+    uint8_t header[COW_HEADER_SIZE];
+    if (st.st_size == 0)
+    {
+        /* new overlay:  a header and an L1 table of zeros, which the file
+           system need not store */
+        this->clusterSize = static_cast<uint64_t>( 1 ) << this->clusterBits;
+        this->l2Entries   = this->clusterSize / 8;
+        uint64_t clusters = (size + this->clusterSize - 1) >> this->clusterBits;
+        this->l1.assign((clusters + this->l2Entries - 1) / this->l2Entries, 0);
+
+        write32(header + 0, COW_MAGIC);
+        write32(header + 4, COW_VERSION);
+        write64(header + 8, size);
+        write32(header + 16, this->clusterBits);
+        write32(header + 20, this->l1.size());
+        write64(header + 24, COW_L1_OFFSET);
+        if (!pwriteAll(this->fd, header, sizeof(header), 0))
+            throw runtime_error("Could not write overlay " + path);
+
+        this->end = COW_L1_OFFSET + 8 * this->l1.size();
+        this->end = (this->end + this->clusterSize - 1) &
+                    ~(this->clusterSize - 1);
+        if (ftruncate(this->fd, this->end) < 0)
+            throw runtime_error("Could not write overlay " + path);
+        return;
+    }
+
+    if (!preadAll(this->fd, header, sizeof(header), 0) ||
+        read32(header + 0) != COW_MAGIC || read32(header + 4) != COW_VERSION)
+        throw runtime_error(path + " is not an overlay");
+    if (read64(header + 8) != size)
+    {
+        throw runtime_error(path +
+                            " is an overlay of an image of another size");
+    }
+
+    this->clusterBits = read32(header + 16);
+    if (this->clusterBits < 9 || this->clusterBits > 24)
+        throw runtime_error(path + " has a bad cluster size");
+    this->clusterSize = static_cast<uint64_t>( 1 ) << this->clusterBits;
+    this->l2Entries   = this->clusterSize / 8;
+
+    uint64_t clusters = (size + this->clusterSize - 1) >> this->clusterBits;
+    uint32_t l1Size   = read32(header + 20);
+    if (l1Size != (clusters + this->l2Entries - 1) / this->l2Entries ||
+        read64(header + 24) != COW_L1_OFFSET)
+        throw runtime_error(path + " has a bad L1 table");
+
+    vector<uint8_t> table(8 * l1Size);
+    if (!preadAll(this->fd, &table[0], table.size(), COW_L1_OFFSET))
+        throw runtime_error("Could not read overlay " + path);
+    this->l1.resize(l1Size);
+    for (uint32_t i = 0; i < l1Size; i++)
+        this->l1[i] = read64(&table[8 * i]);
+
+    // clusters are only ever added at the end
+    this->end = (st.st_size + this->clusterSize - 1) & ~(this->clusterSize - 1);
+}
+
+CowImage::~CowImage()
+{
+    if (this->fd >= 0)
+        close(this->fd);
+}
+
+bool CowImage::read(uint64_t offset, uint64_t length, uint8_t* into)
+{
+    while (length > 0)
+    {
+        uint64_t within = offset & (this->clusterSize - 1);
+        uint64_t chunk  = min(length, this->clusterSize - within);
+
+        uint64_t data;
+        {
+            boost::lock_guard<boost::mutex> lock(this->mutex);
+            data = this->lookup(offset >> this->clusterBits, false);
+        }
+        if (data)
+        {
+            if (!preadAll(this->fd, into, chunk, data + within))
+                return false;
+        }
+        else
+            memcpy(into, this->base + offset, chunk);
+
+        offset += chunk;
+        length -= chunk;
+        into   += chunk;
+    }
+    return true;
+}
+
+bool CowImage::write(uint64_t offset, uint64_t length, const uint8_t* from)
+{
+    while (length > 0)
+    {
+        uint64_t within = offset & (this->clusterSize - 1);
+        uint64_t chunk  = min(length, this->clusterSize - within);
+
+        uint64_t data;
+        {
+            boost::lock_guard<boost::mutex> lock(this->mutex);
+            data = this->lookup(offset >> this->clusterBits, true);
+        }
+        if (!data || !pwriteAll(this->fd, from, chunk, data + within))
+            return false;
+
+        offset += chunk;
+        length -= chunk;
+        from   += chunk;
+    }
+    return true;
+}
+
+bool CowImage::flush()
+{
+    return fdatasync(this->fd) == 0;
+}
+
+/* protected CowImage */
+
+uint64_t CowImage::lookup(uint64_t cluster, bool allocate)
+{
+    L2Table* table = this->getTable(cluster / this->l2Entries, allocate);
+    if (!table)
+        return 0;
+
+    uint64_t index = cluster % this->l2Entries;
+    uint64_t data  = table->entries[index];
+    if (data || !allocate)
+        return data;
+
+    /* first write to the cluster:  copy it from the base, then point the
+       table at the copy */
+    data = this->allocateCluster();
+    if (!data)
+        return 0;
+    uint64_t start  = cluster << this->clusterBits;
+    uint64_t length = min(this->clusterSize, this->size - start);
+    if (!pwriteAll(this->fd, this->base + start, length, data))
+        return 0;
+
+    uint8_t entry[8];
+    write64(entry, data);
+    uint64_t l2Offset = this->l1[table->l1Index];
+    if (!pwriteAll(this->fd, entry, sizeof(entry), l2Offset + 8 * index))
+        return 0;
+    table->entries[index] = data;
+    return data;
+}
+
+CowImage::L2Table* CowImage::getTable(uint64_t l1Index, bool allocate)
+{
+    for (list<L2Table>::iterator iter = this->cache.begin();
+         iter != this->cache.end();
+         ++iter)
+    {
+        if (iter->l1Index == l1Index)
+        {   // most recently used first
+            this->cache.splice(this->cache.begin(), this->cache, iter);
+            return &this->cache.front();
+        }
+    }
+
+    uint64_t l2Offset = this->l1[l1Index];
+    if (!l2Offset && !allocate)
+        return 0;
+
+    L2Table loaded;
+    loaded.l1Index = l1Index;
+    loaded.entries.assign(this->l2Entries, 0);
+    if (l2Offset)
+    {
+        vector<uint8_t> table(this->clusterSize);
+        if (!preadAll(this->fd, &table[0], table.size(), l2Offset))
+            return 0;
+        for (uint64_t i = 0; i < this->l2Entries; i++)
+            loaded.entries[i] = read64(&table[8 * i]);
+    }
+    else
+    {   // a new table is a cluster of zeros
+        l2Offset = this->allocateCluster();
+        if (!l2Offset)
+            return 0;
+        uint8_t entry[8];
+        write64(entry, l2Offset);
+        if (!pwriteAll(this->fd, entry, sizeof(entry),
+                       COW_L1_OFFSET + 8 * l1Index))
+            return 0;
+        this->l1[l1Index] = l2Offset;
+    }
+
+    if (this->cache.size() >= COW_L2_CACHE)
+        this->cache.pop_back();
+    this->cache.push_front(loaded);
+    return &this->cache.front();
+}
+
+uint64_t CowImage::allocateCluster()
+{
+    // extending the file reads back zeros, without storing them
+    if (ftruncate(this->fd, this->end + this->clusterSize) < 0)
+        return 0;
+    uint64_t cluster = this->end;
+    this->end += this->clusterSize;
+    return cluster;
+}
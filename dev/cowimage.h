@@ -0,0 +1,145 @@
+/**
+ * @file    cowimage.h
+ *
+ * Matrix VM
+ */
+
+#ifndef COWIMAGE_H
+#define COWIMAGE_H
+
+#include <common.h>
+
+#include <string>
+#include <list>
+#include <boost/thread/mutex.hpp>
+
+/* overlay file header (big endian):
+    0   4   COW_MAGIC
+    4   4   COW_VERSION
+    8   8   size of the disk, in bytes; the size of the base
+   16   4   log2 of the cluster size
+   20   4   number of L1 entries
+   24   8   offset of the L1 table
+
+   The L1 table has an 8-byte entry for each L2 table:  its offset in the
+   file, or 0 while nothing it covers has been written.  An L2 table is one
+   cluster of 8-byte entries, one for each cluster of the disk:  the offset
+   of the cluster's data in the file, or 0 while the base still has it. */
+#define COW_MAGIC           0x4d56434f  // "MVCO"
+#define COW_VERSION         1
+#define COW_HEADER_SIZE     32
+#define COW_L1_OFFSET       512
+
+#define COW_CLUSTER_BITS    16          // 64 KiB clusters
+// L2 tables kept in memory
+#define COW_L2_CACHE        16
+
+namespace machine
+{
+
+/**
+ * @class CowImage
+ *
+ * A disk that reads from a base image until a cluster is first written, and
+ * keeps the written clusters in a sparse overlay file, so that many machines
+ * can share one base.
+ *
+ * A new overlay is only a header and an empty L1 table, so it is created in
+ * constant time, and grows by a cluster for each cluster written, plus an L2
+ * table for each run of clusters that the table covers.  Clusters are copied
+ * from the base when first written, whole.
+ *
+ * Reads and writes may come from several threads at once, as long as they do
+ * not overlap.
+ */
+class CowImage
+{
+public:
+
+    /**
+     * Open an overlay, or create it if there is none
+     * @param[in]   path    Overlay file
+     * @param[in]   base    The base image, mapped
+     * @param[in]   size    Bytes in the base image
+     * @throws  runtime_error if the overlay cannot be opened, or is not an
+     *          overlay of an image of this size
+     */
+    CowImage(const std::string& path, const uint8_t* base, uint64_t size);
+
+    ~CowImage();
+
+    /**
+     * @param[in]   offset  Byte on the disk to read from
+     * @param[in]   length  Bytes to read
+     * @param[out]  into
+     * @return  Whether it succeeded
+     */
+    bool read(uint64_t offset, uint64_t length, uint8_t* into);
+
+    /**
+     * @param[in]   offset  Byte on the disk to write to
+     * @param[in]   length  Bytes to write
+     * @param[in]   from
+     * @return  Whether it succeeded
+     */
+    bool write(uint64_t offset, uint64_t length, const uint8_t* from);
+
+    /**
+     * Make the writes so far durable
+     * @return  Whether it succeeded
+     */
+    bool flush();
+
+protected:
+
+    /* an L2 table, in memory */
+    struct L2Table
+    {
+        uint64_t                l1Index;
+        std::vector<uint64_t>   entries;
+    };
+
+    /**
+     * Find where a cluster's data is in the overlay
+     * @param[in]   cluster     Number of the cluster on the disk
+     * @param[in]   allocate    Whether to give the cluster a copy in the
+     *                          overlay if it has none
+     * @return  Offset of the data in the overlay; 0 if it is in the base, or
+     *          could not be allocated
+     * @pre `mutex` is held
+     */
+    uint64_t lookup(uint64_t cluster, bool allocate);
+
+    /**
+     * Get an L2 table into the cache
+     * @param[in]   l1Index
+     * @param[in]   allocate    Whether to add the table if there is none
+     * @return  The table, or null if there is none
+     * @pre `mutex` is held
+     */
+    L2Table* getTable(uint64_t l1Index, bool allocate);
+
+    /**
+     * @return  Offset of a new cluster at the end of the overlay
+     * @pre `mutex` is held
+     */
+    uint64_t allocateCluster();
+
+private:
+
+    int             fd;
+    const uint8_t*  base;
+    uint64_t        size;
+    uint32_t        clusterBits;
+    uint64_t        clusterSize;
+    uint64_t        l2Entries;  //<! Entries in an L2 table
+    uint64_t        end;        //<! Where the next cluster goes
+
+    boost::mutex            mutex;
+    std::vector<uint64_t>   l1;
+    std::list<L2Table>      cache;  //<! Most recently used first
+};
+
+}   // namespace machine
+
+#endif // COWIMAGE_H
@@ -0,0 +1,92 @@
+/**
+ * @file    crc32c.cpp
+ *
+ * Matrix VM
+ */
+
+#include "crc32c.h"
+
+#include <string.h>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#  define CRC_X86 1
+#  include <immintrin.h>
+#else
+#  define CRC_X86 0
+#endif
+
+typedef uint32_t (*CrcFunc)(uint32_t crc, const uint8_t* data, size_t len);
+
+/* reflected Castagnoli polynomial */
+#define CRC32C_POLY 0x82F63B78
+
+/**
+ * Byte-at-a-time lookup table
+ */
+struct CrcTable
+{
+    uint32_t entries[256];
+
+    CrcTable()
+    {
+        for (uint32_t i = 0; i < 256; i++)
+        {
+            uint32_t crc = i;
+            for (int bit = 0; bit < 8; bit++)
+                crc = crc & 1 ? (crc >> 1) ^ CRC32C_POLY : crc >> 1;
+            this->entries[i] = crc;
+        }
+    }
+};
+
+static uint32_t crcScalar(uint32_t crc, const uint8_t* data, size_t len)
+{
+    static const CrcTable table;
+    for (size_t i = 0; i < len; i++)
+        crc = table.entries[(crc ^ data[i]) & 0xFF] ^ (crc >> 8);
+    return crc;
+}
+
+#if CRC_X86
+
+__attribute__((target("sse4.2")))
+static uint32_t crcSse42(uint32_t crc, const uint8_t* data, size_t len)
+{
+    #if defined(__x86_64__)
+    uint64_t crc64 = crc;
+    for (; len >= 8; len -= 8, data += 8)
+    {
+        uint64_t word;
+        memcpy(&word, data, 8);
+        crc64 = _mm_crc32_u64(crc64, word);
+    }
+    crc = static_cast<uint32_t>( crc64 );
+    #endif
+    for (; len >= 4; len -= 4, data += 4)
+    {
+        uint32_t word;
+        memcpy(&word, data, 4);
+        crc = _mm_crc32_u32(crc, word);
+    }
+    for (; len; len--, data++)
+        crc = _mm_crc32_u8(crc, *data);
+    return crc;
+}
+
+#endif  // CRC_X86
+
+static CrcFunc pickCrc()
+{
+    #if CRC_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("sse4.2"))
+        return crcSse42;
+    #endif
+    return crcScalar;
+}
+
+uint32_t crc32c(uint32_t crc, const void* data, size_t len)
+{
+    static const CrcFunc func = pickCrc();
+    return ~func(~crc, static_cast<const uint8_t*>( data ), len);
+}
@@ -0,0 +1,25 @@
+/**
+ * @file    crc32c.h
+ *
+ * Matrix VM
+ *
+ * CRC-32C (Castagnoli), as used to fingerprint frames.  The SSE4.2 crc32
+ * instruction is used when the host CPU has it.
+ */
+
+#ifndef CRC32C_H
+#define CRC32C_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+/**
+ * Continue a CRC-32C over more data
+ * @param[in]   crc     CRC of the data so far; 0 to start
+ * @param[in]   data
+ * @param[in]   len     Bytes of data
+ * @return  CRC of the data so far and `data`
+ */
+uint32_t crc32c(uint32_t crc, const void* data, size_t len);
+
+#endif // CRC32C_H
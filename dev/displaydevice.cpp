@@ -17,13 +17,24 @@ using namespace machine;
 SLDECL Device* createDevice(void* args)
 {
     DisplayDeviceArgs* ddaArgs = reinterpret_cast<DisplayDeviceArgs*>( args );
-    return new DisplayDevice(ddaArgs->displayManager);
+    return new DisplayDevice(ddaArgs->displayManager, ddaArgs->interruptLine,
+                             ddaArgs->maxMode);
 }
 
 /* public DisplayDevice */
 
-DisplayDevice::DisplayDevice(DisplayManager* display)
-: display(display)
+DisplayDevice::DisplayDevice(DisplayManager* display,
+                             int interruptLine /* = -1 */)
+: display(display), interruptLine(interruptLine)
+{
+    this->maxMode.width  = DISPLAY_DEFAULT_WIDTH;
+    this->maxMode.height = DISPLAY_DEFAULT_HEIGHT;
+    this->maxMode.format = DISPLAY_DEFAULT_FORMAT;
+}
+
+DisplayDevice::DisplayDevice(DisplayManager* display, int interruptLine,
+                             const FramebufferMode& maxMode)
+: display(display), interruptLine(interruptLine), maxMode(maxMode)
 { }
 
 string DisplayDevice::getName() const
@@ -35,8 +46,13 @@ void DisplayDevice::init(Motherboard& mb)
 {
     this->mb = &mb;
 
+    int pageSize = this->maxMode.getPageSize();
+    if (pageSize <= 0)
+        throw runtime_error("Invalid host display mode");
+
     /* Reserve display memory */
-    MemAddress dmaLoc = Device::reserveMemIO(mb, *this, DISPLAY_BUFFER_SIZE);
+    MemAddress dmaLoc = Device::reserveMemIO(mb, *this,
+        DISPLAY_PAGES_OFFSET + FRAMEBUFFER_PAGES * pageSize);
     if (dmaLoc < 0)
         throw runtime_error("Could not request DMA memory for host display");
     else
@@ -50,7 +66,22 @@ void DisplayDevice::init(Motherboard& mb)
     if (this->display)
     {
         vector<uint8_t>& memory = Device::getMemory(mb);
-        this->display->init(memory, dmaLoc, this->mb->getInterruptController(), 640, 480);
+        this->framebuffer.setup(memory, dmaLoc + DISPLAY_PAGES_OFFSET,
+                                this->maxMode);
+        for (int i = 0; i < FRAMEBUFFER_PAGES; i++)
+        {
+            this->trackers[i].setRegion(this->framebuffer.getPageAddress(i),
+                                        this->maxMode.width,
+                                        this->maxMode.height,
+                                        this->maxMode.getBytesPerPixel());
+            mb.addDirtyTracker(&this->trackers[i]);
+        }
+        this->writeSetup();
+        this->writePalette();
+
+        InterruptController* ic = this->mb->getInterruptController();
+        this->display->init(this->framebuffer, ic);
+        this->display->setFlushInterrupt(ic, this->interruptLine);
         mb.requestThread(this, &DisplayDevice::showDisplay);
     }
     else
@@ -61,9 +92,62 @@ void DisplayDevice::init(Motherboard& mb)
 
 void DisplayDevice::write(MemAddress what, int port)
 {
-    // TODO:  thread it
-    this->display->flush();
-    // TODO:  interrupt
+    int  front;
+    bool all = true;    // whether the whole page is new to the display
+    switch (what)
+    {
+    case DISPLAY_CMD_FLIP:
+        front = this->framebuffer.flip();
+        break;
+    case DISPLAY_CMD_MODE:
+        this->setMode();
+        front = this->framebuffer.getFrontPage();
+        break;
+    case DISPLAY_CMD_PALETTE:
+        this->setPalette();
+        front = this->framebuffer.getFrontPage();
+        // every pixel may have changed color
+        all = this->framebuffer.getMode().format == FRAMEBUFFER_INDEXED8;
+        break;
+    default:
+        front = this->framebuffer.getFrontPage();
+        all = false;
+        break;
+    }
+
+    this->trackers[front].collect(this->dirtyRects);
+    if (all)
+    {
+        FramebufferMode mode = this->framebuffer.getMode();
+        DirtyRect rect;
+        rect.x      = 0;
+        rect.y      = 0;
+        rect.width  = mode.width;
+        rect.height = mode.height;
+        this->dirtyRects.assign(1, rect);
+    }
+
+    this->display->flush(this->dirtyRects);
+}
+
+PortMode DisplayDevice::getPortMode(int port) const
+{
+    if (this->display && this->display->isSynchronous())
+        return PORT_SYNCHRONOUS;
+    return PORT_POSTED;
+}
+
+void DisplayDevice::posting(MemAddress what, int port)
+{
+    boost::lock_guard<boost::mutex> lock(this->postedMutex);
+    if (what == DISPLAY_CMD_MODE)
+        this->postedModes.push_back(this->readMode());
+    else if (what == DISPLAY_CMD_PALETTE)
+    {
+        this->postedPalettes.push_back(
+            vector<uint32_t>(FRAMEBUFFER_PALETTE_SIZE));
+        this->readPalette(&this->postedPalettes.back()[0]);
+    }
 }
 
 void DisplayDevice::showDisplay(Motherboard& mb)
@@ -78,6 +162,103 @@ void DisplayDevice::stopThread(boost::thread* thd)
     this->display->destroy();
 }
 
+/* protected DisplayDevice */
+
+void DisplayDevice::setMode()
+{
+    FramebufferMode mode;
+    {
+        // nothing is copied for a synchronous write
+        boost::lock_guard<boost::mutex> lock(this->postedMutex);
+        if (this->postedModes.empty())
+            mode = this->readMode();
+        else
+        {
+            mode = this->postedModes.front();
+            this->postedModes.pop_front();
+        }
+    }
+
+    // A refused mode leaves the current one in the header, which is how the
+    // guest finds out
+    if (mode != this->framebuffer.getMode() && this->framebuffer.setMode(mode))
+    {
+        for (int i = 0; i < FRAMEBUFFER_PAGES; i++)
+            this->trackers[i].setRegion(this->framebuffer.getPageAddress(i),
+                                        mode.width, mode.height,
+                                        mode.getBytesPerPixel());
+    }
+    this->writeSetup();
+}
+
+FramebufferMode DisplayDevice::readMode()
+{
+    const vector<uint8_t>& memory = Device::getMemory(*this->mb);
+    const uint8_t* setup = &memory[this->mappingAddr];
+
+    FramebufferMode mode;
+    mode.width  = setup[0] << 8 | setup[1];
+    mode.height = setup[2] << 8 | setup[3];
+    mode.format = setup[DISPLAY_SETUP_FORMAT];
+    return mode;
+}
+
+void DisplayDevice::writeSetup()
+{
+    vector<uint8_t>& memory = Device::getMemory(*this->mb);
+    uint8_t* setup = &memory[this->mappingAddr];
+
+    FramebufferMode mode = this->framebuffer.getMode();
+    setup[0] = mode.width >> 8;
+    setup[1] = mode.width;
+    setup[2] = mode.height >> 8;
+    setup[3] = mode.height;
+    setup[DISPLAY_SETUP_FORMAT] = mode.format;
+}
+
+void DisplayDevice::setPalette()
+{
+    uint32_t colors[FRAMEBUFFER_PALETTE_SIZE];
+    {
+        // nothing is copied for a synchronous write
+        boost::lock_guard<boost::mutex> lock(this->postedMutex);
+        if (this->postedPalettes.empty())
+            this->readPalette(colors);
+        else
+        {
+            const vector<uint32_t>& posted = this->postedPalettes.front();
+            copy(posted.begin(), posted.end(), colors);
+            this->postedPalettes.pop_front();
+        }
+    }
+    this->framebuffer.setPalette(colors);
+}
+
+void DisplayDevice::readPalette(uint32_t* colors)
+{
+    const vector<uint8_t>& memory = Device::getMemory(*this->mb);
+    const uint8_t* entry = &memory[this->mappingAddr + DISPLAY_SETUP_SIZE];
+
+    for (int i = 0; i < FRAMEBUFFER_PALETTE_SIZE; i++, entry += 4)
+        colors[i] = entry[1] << 16 | entry[2] << 8 | entry[3];
+}
+
+void DisplayDevice::writePalette()
+{
+    vector<uint8_t>& memory = Device::getMemory(*this->mb);
+    uint8_t* entry = &memory[this->mappingAddr + DISPLAY_SETUP_SIZE];
+
+    uint32_t colors[FRAMEBUFFER_PALETTE_SIZE];
+    this->framebuffer.getPalette(colors);
+    for (int i = 0; i < FRAMEBUFFER_PALETTE_SIZE; i++, entry += 4)
+    {
+        entry[0] = 0;
+        entry[1] = colors[i] >> 16;
+        entry[2] = colors[i] >> 8;
+        entry[3] = colors[i];
+    }
+}
+
 void DisplayDevice::showDisplay(Device* dev, Motherboard& mb)
 {
     if (DisplayDevice* dd = dynamic_cast<DisplayDevice*>( dev ))
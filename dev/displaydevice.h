@@ -8,16 +8,35 @@
 #define DISPLAYDEVICE_H
 
 #include <machine/device.h>
+#include <machine/dirtytracker.h>
 #include "displaymanager.h"
+#include "framebuffer.h"
 
-/* 2 bytes for pixels wide + 2 bytes for pixels tall */
-#define DISPLAY_SETUP_SIZE      4
-#define DISPLAY_RESOLUTION      1920*1080
-/* need 3 bytes to encode color */
-#define DISPLAY_BYTES_PER_PIXEL 3
-#define DISPLAY_BUFFER_SIZE     DISPLAY_SETUP_SIZE + DISPLAY_RESOLUTION * DISPLAY_BYTES_PER_PIXEL
+#include <deque>
+#include <boost/thread/mutex.hpp>
+
+/* 2 bytes for pixels wide + 2 bytes for pixels tall + 1 byte for the
+   FRAMEBUFFER_ format, padded; the palette follows */
+#define DISPLAY_SETUP_SIZE      8
+#define DISPLAY_SETUP_FORMAT    4   // offset of the format byte
+/* one 0x00RRGGBB word per color; the pages of pixels follow */
+#define DISPLAY_PALETTE_SIZE    FRAMEBUFFER_PALETTE_SIZE * 4
+#define DISPLAY_PAGES_OFFSET    (DISPLAY_SETUP_SIZE + DISPLAY_PALETTE_SIZE)
+
+/* mode reserved for when the host does not choose one */
+#define DISPLAY_DEFAULT_WIDTH   640
+#define DISPLAY_DEFAULT_HEIGHT  480
+#define DISPLAY_DEFAULT_FORMAT  FRAMEBUFFER_RGB24
 
 #define DEFAULT_DISPLAY_PORT    8
+/* raised when a flush has been drawn, if the device is given the line */
+#define DISPLAY_INT_LINE        2
+
+/* words written to the display port */
+#define DISPLAY_CMD_FLUSH       1   // redraw what changed in the front page
+#define DISPLAY_CMD_FLIP        2   // display the back page
+#define DISPLAY_CMD_MODE        3   // set the mode in the setup header
+#define DISPLAY_CMD_PALETTE     4   // use the colors in the palette
 
 namespace machine
 {
@@ -25,6 +44,16 @@ namespace machine
 struct DisplayDeviceArgs
 {
     DisplayManager* displayManager;
+    int             interruptLine;  //!< Negative for no flush interrupt
+    FramebufferMode maxMode;        //!< Largest mode; memory is reserved for it
+
+    DisplayDeviceArgs()
+    : displayManager(0), interruptLine(-1)
+    {
+        this->maxMode.width  = DISPLAY_DEFAULT_WIDTH;
+        this->maxMode.height = DISPLAY_DEFAULT_HEIGHT;
+        this->maxMode.format = DISPLAY_DEFAULT_FORMAT;
+    }
 };
 
 /**
@@ -35,6 +64,26 @@ struct DisplayDeviceArgs
  * reserves a port, which the consuming code invokes to asynchronously redraw
  * the screen.
  *
+ * The reserved memory starts with a setup header of DISPLAY_SETUP_SIZE bytes,
+ * which holds the current mode:  the width and height (big endian), and the
+ * pixel format.  The guest changes the mode by writing a new one into the
+ * header and writing DISPLAY_CMD_MODE.  Only as much memory is reserved as the
+ * largest mode the host allows needs, and modes that do not fit in it are
+ * refused.  The device writes the mode it is in back to the header.
+ *
+ * In FRAMEBUFFER_INDEXED8 mode, each pixel is an index into a palette of 256
+ * colors, which follows the setup header.  The guest changes colors by
+ * writing them into the palette and writing DISPLAY_CMD_PALETTE.  The palette
+ * starts out as RGB332 (3 bits of red, 3 of green and 2 of blue).
+ *
+ * The pixel buffer has two pages, one after the other, right after the
+ * palette.  Each page is the size of the largest mode, so page addresses do
+ * not change with the mode.  Page 0 is displayed first.  A guest that only
+ * ever draws into page 0 and flushes works as a single-buffered display.  To
+ * avoid tearing, the guest draws into the back page, writes
+ * DISPLAY_CMD_FLIP, and waits for the display interrupt before drawing into
+ * the page that was displayed before.
+ *
  * The emulator passes in an object that does the drawing work.  The
  * DisplayDevice is merely an interface which handles uniform display
  * functionality.  In this way, the emulated code is decoupled from the display
@@ -45,9 +94,21 @@ class DisplayDevice : public Device
 public:
 
     /**
-     * @param[in]   display     DisplayManager to use
+     * @param[in]   display         DisplayManager to use
+     * @param[in]   interruptLine   Line to interrupt on when a flush has been
+     *                              drawn, or negative for none
      */
-    DisplayDevice(DisplayManager* display);
+    DisplayDevice(DisplayManager* display, int interruptLine = -1);
+
+    /**
+     * @param[in]   display         DisplayManager to use
+     * @param[in]   interruptLine   Line to interrupt on when a flush has been
+     *                              drawn, or negative for none
+     * @param[in]   maxMode         Largest mode the guest may set; the
+     *                              initial mode
+     */
+    DisplayDevice(DisplayManager* display, int interruptLine,
+                  const FramebufferMode& maxMode);
 
     /**
      * @return  Name of the device
@@ -57,13 +118,40 @@ public:
     void init(Motherboard& init);
 
     /**
-     * Flush the display device (update the image)
+     * Flush or flip the display device (update the image), or set its mode
+     *
+     * On a flush, only the tiles of the front page that were written since
+     * the last flush are passed on to the DisplayManager.  A flip makes the
+     * back page the front page, and redraws all of it.  Setting a new mode
+     * makes page 0 the front page in that mode, and redraws all of it.  A
+     * new palette redraws all of the front page if it is indexed, and
+     * otherwise flushes.
      *
-     * @param[in]   what    Ignored
+     * When the image has been drawn, the device interrupts on its interrupt
+     * line, after which the guest may draw into the buffer (or the new back
+     * page, or in the new mode) again.
+     *
+     * @param[in]   what    DISPLAY_CMD_FLUSH, DISPLAY_CMD_FLIP,
+     *                      DISPLAY_CMD_MODE or DISPLAY_CMD_PALETTE.  Other
+     *                      values flush.
      * @param[in]   port    Currently ignored
      */
     void write(MemAddress what, int port);
 
+    /**
+     * @param[in]   port    Ignored
+     * @return  PORT_POSTED, so that flushing never blocks the CPU, unless
+     *          the DisplayManager is synchronous
+     */
+    PortMode getPortMode(int port) const;
+
+    /**
+     * Copy a new mode or palette out of guest memory, for write() to set
+     * @param[in]   what    Command written
+     * @param[in]   port    Ignored
+     */
+    void posting(MemAddress what, int port);
+
     /**
      * Show the display
      * @param[in]   mb  Motherboard
@@ -78,6 +166,37 @@ public:
 
 protected:
 
+    /**
+     * Set the mode that the guest wrote into the setup header, or keep the
+     * current one if it is not valid
+     */
+    void setMode();
+
+    /**
+     * @return  The mode in the setup header
+     */
+    FramebufferMode readMode();
+
+    /**
+     * Write the current mode into the setup header
+     */
+    void writeSetup();
+
+    /**
+     * Set the palette to the colors the guest wrote into it
+     */
+    void setPalette();
+
+    /**
+     * @param[out]  colors  The palette in guest memory
+     */
+    void readPalette(uint32_t* colors);
+
+    /**
+     * Write the current palette into guest memory
+     */
+    void writePalette();
+
     /**
      * Callback called by a new thread, starting in the Motherboard
      *
@@ -89,14 +208,25 @@ protected:
 
 private:
 
-    int width;
-    int height;
     DisplayManager* display;
+    int             interruptLine;
+    FramebufferMode maxMode;
 
     Motherboard* mb;
 
     MemAddress mappingAddr; //<! The DMA address of the obtained reserved memory
 
+    Framebuffer             framebuffer;
+
+    // tiles of each page written since the last flush
+    DirtyTracker            trackers[FRAMEBUFFER_PAGES];
+    std::vector<DirtyRect>  dirtyRects;     //<! Scratch space for flushes
+
+    /* modes and palettes copied when their commands were posted, in order */
+    boost::mutex                        postedMutex;
+    std::deque<FramebufferMode>         postedModes;
+    std::deque<std::vector<uint32_t> >  postedPalettes;
+
 };
 
 }   // namespace machine
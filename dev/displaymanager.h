@@ -3,6 +3,10 @@
 
 #include <common.h>
 #include <dev/interruptcontroller.h>
+#include <dev/keyboarddevice.h>
+#include <dev/pointerdevice.h>
+#include <machine/dirtytracker.h>
+#include "framebuffer.h"
 
 #include <vector>
 #include <cstdint>
@@ -11,21 +15,19 @@ class DisplayManager
 {
 public:
 
+    DisplayManager() : flushIc(0), flushLine(-1), keyboard(0), pointer(0) { }
+
+    virtual ~DisplayManager() { }
+
     /**
-     * @param[in]   memory          Motherboard memory
-     * @param[in]   videoAddress    Address in `memory` where video memory is
-     *                              located
-     * @param[in]   ic              Interrupt controller to send keyboard
-     *                              events (or other events)
-     * @param[in]   width           Display width
-     * @param[in]   height          Display height
+     * @param[in]   framebuffer     Guest pixels to display.  Always draw
+     *                              from its front page.
+     * @param[in]   ic              Interrupt controller to send events
+     *                              other than keys
      */
     virtual void init(
-        std::vector<uint8_t>&           memory,
-        MemAddress                      videoAddress,
-        machine::InterruptController*   ic,
-        int                             width,
-        int                             height
+        const machine::Framebuffer&     framebuffer,
+        machine::InterruptController*   ic
         ) = 0;
 
     /**
@@ -35,14 +37,100 @@ public:
 
     /**
      * Flush the display (refresh image from memory)
+     * @param[in]   rects   Areas that changed since the last flush.  May be
+     *                      empty, in which case the flush must still complete.
+     *                      After a flip, this covers the whole front page.
      */
-    virtual void flush() = 0;
+    virtual void flush(const std::vector<machine::DirtyRect>& rects) = 0;
 
     /**
      * Destroy the display
      */
     virtual void destroy() = 0;
 
+    /**
+     * @return  Whether flush() must be called on the CPU thread, so that
+     *          frames are in step with the instructions that drew them.
+     *          Defaults to false, which lets flushes overlap the CPU.
+     */
+    virtual bool isSynchronous() const { return false; }
+
+    /**
+     * Set the interrupt to raise when a flush has been drawn
+     * @param[in]   ic      Interrupt controller; can be null
+     * @param[in]   line    Interrupt line, or negative for no interrupt
+     */
+    void setFlushInterrupt(machine::InterruptController* ic, int line)
+    {
+        this->flushIc   = ic;
+        this->flushLine = line;
+    }
+
+    /**
+     * Set the keyboard to deliver the keys pressed in the display to
+     * @param[in]   keyboard    Keyboard; can be null to drop keys
+     */
+    void setKeyboard(machine::KeyboardDevice* keyboard)
+    {
+        this->keyboard = keyboard;
+    }
+
+    /**
+     * Set the pointer device to report the pointer in the display to
+     * @param[in]   pointer     Pointer device; can be null to ignore the
+     *                          pointer
+     */
+    void setPointer(machine::PointerDevice* pointer)
+    {
+        this->pointer = pointer;
+    }
+
+protected:
+
+    /**
+     * Deliver a key pressed or released in the display to the guest
+     * @param[in]   keycode     X key code
+     * @param[in]   release     Whether the key was released
+     */
+    void keyEvent(int keycode, bool release)
+    {
+        if (this->keyboard)
+            this->keyboard->keyEvent(keycode, release);
+    }
+
+    /**
+     * Report the pointer in the display to the guest
+     * @param[in]   x           Position, in guest pixels
+     * @param[in]   y
+     * @param[in]   buttons     POINTER_BUTTON_ flags of the buttons held
+     * @param[in]   wheel       Wheel clicks since the last report; positive
+     *                          for up
+     */
+    void pointerEvent(int x, int y, int buttons, int wheel = 0)
+    {
+        if (this->pointer)
+            this->pointer->pointerEvent(x, y, buttons, wheel);
+    }
+
+    /**
+     * Tell the guest that a flush has been drawn, so that it can reuse the
+     * display buffer, or the back page after a flip.  Implementations call
+     * this after each flush, once they no longer read the previous front
+     * page.
+     */
+    void flushed()
+    {
+        if (this->flushIc && this->flushLine >= 0)
+            this->flushIc->interrupt(this->flushLine);
+    }
+
+private:
+
+    machine::InterruptController*   flushIc;
+    int                             flushLine;
+    machine::KeyboardDevice*        keyboard;
+    machine::PointerDevice*         pointer;
+
 };
 
 #endif // DISPLAYMANAGER_H
@@ -0,0 +1,240 @@
+/**
+ * @file    framebuffer.h
+ *
+ * Matrix VM
+ */
+
+#ifndef FRAMEBUFFER_H
+#define FRAMEBUFFER_H
+
+#include <common.h>
+
+#include <vector>
+#include <atomic>
+
+/* pages of pixels the guest can draw into */
+#define FRAMEBUFFER_PAGES 2
+
+/* pixel formats */
+#define FRAMEBUFFER_INDEXED8    1   // 1 byte per pixel, index into a palette
+#define FRAMEBUFFER_RGB565      2   // 2 bytes per pixel, big endian
+#define FRAMEBUFFER_RGB24       3   // 3 bytes per pixel:  red, green, blue
+
+/* colors in the palette of FRAMEBUFFER_INDEXED8 */
+#define FRAMEBUFFER_PALETTE_SIZE 256
+
+namespace machine
+{
+
+/**
+ * Resolution and pixel format of a Framebuffer
+ */
+struct FramebufferMode
+{
+    int width;
+    int height;
+    int format;     //!< One of the FRAMEBUFFER_ formats
+
+    /**
+     * @param[in]   format
+     * @return  Bytes per pixel of `format`, or 0 if it is not a format
+     */
+    static int getBytesPerPixel(int format)
+    {
+        switch (format)
+        {
+        case FRAMEBUFFER_INDEXED8:  return 1;
+        case FRAMEBUFFER_RGB565:    return 2;
+        case FRAMEBUFFER_RGB24:     return 3;
+        default:                    return 0;
+        }
+    }
+
+    int getBytesPerPixel() const { return getBytesPerPixel(this->format); }
+    int getPitch()         const { return this->width * getBytesPerPixel(); }
+    int getPageSize()      const { return this->getPitch() * this->height; }
+
+    bool operator==(const FramebufferMode& m) const
+    {
+        return this->width == m.width && this->height == m.height &&
+               this->format == m.format;
+    }
+    bool operator!=(const FramebufferMode& m) const { return !(*this == m); }
+};
+
+/**
+ * @class Framebuffer
+ *
+ * The guest's pixel buffer, as the DisplayDevice shares it with a
+ * DisplayManager.
+ *
+ * The buffer has FRAMEBUFFER_PAGES pages of pixels in guest memory, each
+ * large enough for the largest mode the DisplayDevice allows.  One of them,
+ * the front page, is the one that is displayed.  The guest draws into another
+ * (the back page), then flips, which makes it the front page.  The
+ * DisplayDevice flips and sets the mode and palette; DisplayManagers read the
+ * mode, the palette and whichever page is the front page when they start
+ * drawing.
+ */
+class Framebuffer
+{
+public:
+
+    Framebuffer()
+    : memory(0), pageSize(0), front(0), mode(0), paletteSerial(0)
+    {
+        for (int i = 0; i < FRAMEBUFFER_PAGES; i++)
+            this->pages[i] = 0;
+
+        // RGB332:  3 bits of red, 3 of green and 2 of blue
+        for (int i = 0; i < FRAMEBUFFER_PALETTE_SIZE; i++)
+        {
+            uint32_t r = (i >> 5) * 255 / 7;
+            uint32_t g = ((i >> 2) & 7) * 255 / 7;
+            uint32_t b = (i & 3) * 255 / 3;
+            this->palette[i].store(r << 16 | g << 8 | b,
+                                   std::memory_order_relaxed);
+        }
+    }
+
+    /**
+     * Lay the pages out in guest memory, one after another
+     * @param[in]   memory      Motherboard memory
+     * @param[in]   start       Address of the first page
+     * @param[in]   maxMode     Largest mode; also the initial mode
+     */
+    void setup(
+        std::vector<uint8_t>&   memory,
+        MemAddress              start,
+        const FramebufferMode&  maxMode)
+    {
+        this->memory   = &memory;
+        this->pageSize = maxMode.getPageSize();
+        for (int i = 0; i < FRAMEBUFFER_PAGES; i++)
+            this->pages[i] = start + i * this->pageSize;
+        this->setMode(maxMode);
+    }
+
+    /**
+     * @return  Bytes reserved for each page
+     */
+    int getPageSize() const { return this->pageSize; }
+
+    /**
+     * @return  Current resolution and format
+     */
+    FramebufferMode getMode() const
+    {
+        uint64_t packed = this->mode.load(std::memory_order_acquire);
+        FramebufferMode mode;
+        mode.width  = (packed >>  0) & 0xFFFF;
+        mode.height = (packed >> 16) & 0xFFFF;
+        mode.format = (packed >> 32) & 0xFF;
+        return mode;
+    }
+
+    /**
+     * Change the resolution and format, and display page 0
+     * @param[in]   mode
+     * @return  false if the mode is not valid or does not fit in a page
+     */
+    bool setMode(const FramebufferMode& mode)
+    {
+        if (mode.width <= 0 || mode.width > 0xFFFF ||
+            mode.height <= 0 || mode.height > 0xFFFF ||
+            !mode.getBytesPerPixel() ||
+            static_cast<int64_t>( mode.width ) * mode.height *
+                mode.getBytesPerPixel() > this->pageSize)
+            return false;
+
+        uint64_t packed = static_cast<uint64_t>( mode.width )
+                        | static_cast<uint64_t>( mode.height ) << 16
+                        | static_cast<uint64_t>( mode.format ) << 32;
+        this->front.store(0, std::memory_order_release);
+        this->mode.store(packed, std::memory_order_release);
+        return true;
+    }
+
+    /**
+     * @param[in]   page    Page number
+     * @return  Guest address of the page
+     */
+    MemAddress getPageAddress(int page) const { return this->pages[page]; }
+
+    /**
+     * @return  Number of the page that is displayed
+     */
+    int getFrontPage() const
+    {
+        return this->front.load(std::memory_order_acquire);
+    }
+
+    /**
+     * @param[in]   page    Page number
+     * @return  Host pointer to the first pixel of the page
+     */
+    const uint8_t* getPixels(int page) const
+    {
+        return &(*this->memory)[this->pages[page]];
+    }
+
+    /**
+     * Copy the colors of FRAMEBUFFER_INDEXED8 pixels
+     * @param[out]  colors  FRAMEBUFFER_PALETTE_SIZE XRGB32 colors
+     * @return  Palette serial that the colors are from
+     */
+    unsigned getPalette(uint32_t* colors) const
+    {
+        unsigned serial = this->getPaletteSerial();
+        for (int i = 0; i < FRAMEBUFFER_PALETTE_SIZE; i++)
+            colors[i] = this->palette[i].load(std::memory_order_relaxed);
+        return serial;
+    }
+
+    /**
+     * @return  A number that changes whenever the palette does, so that
+     *          DisplayManagers only copy it after it changed
+     */
+    unsigned getPaletteSerial() const
+    {
+        return this->paletteSerial.load(std::memory_order_acquire);
+    }
+
+    /**
+     * Set the colors of FRAMEBUFFER_INDEXED8 pixels
+     * @param[in]   colors  FRAMEBUFFER_PALETTE_SIZE XRGB32 colors
+     */
+    void setPalette(const uint32_t* colors)
+    {
+        for (int i = 0; i < FRAMEBUFFER_PALETTE_SIZE; i++)
+            this->palette[i].store(colors[i], std::memory_order_relaxed);
+        this->paletteSerial.fetch_add(1, std::memory_order_release);
+    }
+
+    /**
+     * Make the next page the front page
+     * @return  Number of the new front page
+     */
+    int flip()
+    {
+        int page = (this->getFrontPage() + 1) % FRAMEBUFFER_PAGES;
+        this->front.store(page, std::memory_order_release);
+        return page;
+    }
+
+private:
+
+    std::vector<uint8_t>*   memory;
+    MemAddress              pages[FRAMEBUFFER_PAGES];
+    int                     pageSize;
+
+    std::atomic<int>        front;  //!< Page that is displayed
+    std::atomic<uint64_t>   mode;   //!< Packed FramebufferMode
+
+    std::atomic<uint32_t>   palette[FRAMEBUFFER_PALETTE_SIZE];  //!< XRGB32
+    std::atomic<unsigned>   paletteSerial;
+};
+
+}   // namespace machine
+
+#endif // FRAMEBUFFER_H
@@ -0,0 +1,125 @@
+#include "hashdisplaymanager.h"
+#include "crc32c.h"
+
+#include <stdexcept>
+
+using namespace std;
+using namespace machine;
+
+HashDisplayManager::HashDisplayManager(
+    const string&   logPath,
+    const string&   expectPath,
+    const Cpu*      cpu
+    )
+: logPath(logPath), expectPath(expectPath), log(0), cpu(cpu), framebuffer(0),
+  frame(0)
+{ }
+
+HashDisplayManager::~HashDisplayManager()
+{
+    if (this->log && this->log != stdout)
+        fclose(this->log);
+}
+
+void HashDisplayManager::init(
+    const Framebuffer&      framebuffer,
+    InterruptController*    ic
+    )
+{
+    this->framebuffer = &framebuffer;
+    this->frame = 0;
+
+    if (!this->expectPath.empty())
+    {
+        FILE* file = fopen(this->expectPath.c_str(), "r");
+        if (!file)
+        {
+            throw runtime_error("Could not open expected hashes " +
+                                this->expectPath);
+        }
+
+        unsigned long      frame;
+        unsigned long long count;
+        unsigned int       hash;
+        while (fscanf(file, "%lu %llu %x", &frame, &count, &hash) == 3)
+        {
+            if (!frame)
+                continue;
+            if (frame > this->expected.size())
+            {
+                this->expected.resize(frame);
+                this->known.resize(frame);
+            }
+            this->expected[frame - 1] = hash;
+            this->known[frame - 1]    = true;
+        }
+        fclose(file);
+    }
+
+    if (this->logPath == "-")
+        this->log = stdout;
+    else if (!(this->log = fopen(this->logPath.c_str(), "w")))
+        throw runtime_error("Could not open hash log " + this->logPath);
+}
+
+void HashDisplayManager::show()
+{
+}
+
+void HashDisplayManager::flush(const vector<DirtyRect>& rects)
+{
+    FramebufferMode mode  = this->framebuffer->getMode();
+    unsigned long   frame = ++this->frame;
+
+    uint8_t setup[5] = {
+        static_cast<uint8_t>( mode.width >> 8 ),
+        static_cast<uint8_t>( mode.width ),
+        static_cast<uint8_t>( mode.height >> 8 ),
+        static_cast<uint8_t>( mode.height ),
+        static_cast<uint8_t>( mode.format )
+    };
+    uint32_t hash = crc32c(0, setup, sizeof(setup));
+    const uint8_t* pixels =
+        this->framebuffer->getPixels(this->framebuffer->getFrontPage());
+    hash = crc32c(hash, pixels, mode.getPageSize());
+    if (mode.format == FRAMEBUFFER_INDEXED8)
+    {
+        // as bytes, so that hashes do not depend on the host's byte order
+        uint32_t palette[FRAMEBUFFER_PALETTE_SIZE];
+        uint8_t  colors[FRAMEBUFFER_PALETTE_SIZE * 3];
+        this->framebuffer->getPalette(palette);
+        for (int i = 0; i < FRAMEBUFFER_PALETTE_SIZE; i++)
+        {
+            colors[i * 3 + 0] = palette[i] >> 16;
+            colors[i * 3 + 1] = palette[i] >> 8;
+            colors[i * 3 + 2] = palette[i];
+        }
+        hash = crc32c(hash, colors, sizeof(colors));
+    }
+
+    unsigned long long count = this->cpu ? this->cpu->getInstructionCount() : 0;
+    fprintf(this->log, "%lu %llu %08x\n", frame, count, hash);
+
+    if (frame <= this->known.size() && this->known[frame - 1] &&
+        this->expected[frame - 1] != hash)
+    {
+        fflush(this->log);
+        char message[96];
+        snprintf(message, sizeof(message),
+                 "Frame %lu hash %08x does not match expected %08x",
+                 frame, hash, this->expected[frame - 1]);
+        throw runtime_error(message);
+    }
+
+    this->flushed();
+}
+
+void HashDisplayManager::destroy()
+{
+    fflush(this->log);
+}
+
+bool HashDisplayManager::isSynchronous() const
+{
+    return true;
+}
@@ -0,0 +1,86 @@
+#ifndef HASHDISPLAYMANAGER_H
+#define HASHDISPLAYMANAGER_H
+
+#include "displaymanager.h"
+#include <machine/cpu.h>
+
+#include <stdio.h>
+#include <string>
+
+/**
+ * @class HashDisplayManager
+ *
+ * A headless display for golden-image regression runs.  Instead of drawing
+ * frames, it fingerprints each flushed frame with CRC-32C and logs one line
+ * per frame:
+ *
+ *     <frame number> <instructions executed> <hash>
+ *
+ * The hash covers the mode, the pixels of the front page and, in indexed
+ * mode, the palette.  Flushes are synchronous, so each frame is hashed
+ * exactly as the guest had drawn it when it wrote to the display port.
+ *
+ * Given a file of expected hashes, in the same format (a log of a good run
+ * will do), the run is stopped at the first frame whose hash differs.
+ * Frames that the file has no line for are not checked.
+ */
+class HashDisplayManager : public DisplayManager
+{
+public:
+
+    /**
+     * @param[in]   logPath     File to log hashes to, or "-" for stdout
+     * @param[in]   expectPath  File of expected hashes, or empty for none
+     * @param[in]   cpu         CPU whose instructions are counted; can be
+     *                          null
+     */
+    HashDisplayManager(
+        const std::string&      logPath,
+        const std::string&      expectPath,
+        const machine::Cpu*     cpu
+        );
+
+    ~HashDisplayManager();
+
+    /**
+     * Open the log and read the expected hashes
+     * @throw   runtime_error if either file cannot be opened
+     */
+    void init(
+        const machine::Framebuffer&     framebuffer,
+        machine::InterruptController*   ic
+        );
+
+    void show();
+
+    /**
+     * Hash and log the front page
+     * @param[in]   rects   Ignored; the whole frame is hashed
+     * @throw   runtime_error if the hash is not the expected one, which
+     *          stops the CPU
+     */
+    void flush(const std::vector<machine::DirtyRect>& rects);
+
+    void destroy();
+
+    /**
+     * @return  true
+     */
+    bool isSynchronous() const;
+
+private:
+
+    std::string logPath;
+    std::string expectPath;
+    FILE*       log;
+
+    const machine::Cpu*         cpu;
+    const machine::Framebuffer* framebuffer;
+
+    unsigned long               frame;      //<! Number of the last frame
+    std::vector<uint32_t>       expected;   //<! Hash of each frame, from 1
+    std::vector<bool>           known;      //<! Whether `expected` has it
+
+};
+
+#endif // HASHDISPLAYMANAGER_H
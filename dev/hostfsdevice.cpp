@@ -0,0 +1,405 @@
+/**
+ * @file    hostfsdevice.cpp
+ *
+ * Matrix VM
+ */
+
+#include "hostfsdevice.h"
+#include <dev/interruptcontroller.h>
+#include <machine/dirtytracker.h>
+#include <machine/guestmemory.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include <stdexcept>
+
+using namespace std;
+using namespace machine;
+
+// declared, but not defined, in device.h
+SLDECL Device* createDevice(void* args)
+{
+    // there is no default directory to share
+    HostFsDeviceArgs* hfArgs = reinterpret_cast<HostFsDeviceArgs*>( args );
+    if (hfArgs && hfArgs->root)
+        return new HostFsDevice(hfArgs->root, hfArgs->readOnly,
+                                hfArgs->interruptLine);
+    else
+        return 0;
+}
+
+/**
+ * @param[in]   err     errno of a failed call
+ * @return  The HOSTFS_STATUS_ value closest to it
+ */
+static int statusOf(int err)
+{
+    switch (err)
+    {
+    case ENOENT:
+        return HOSTFS_STATUS_NOT_FOUND;
+    case EACCES:
+    case EPERM:
+    case EROFS:
+    case ELOOP:     // the file is a symbolic link
+        return HOSTFS_STATUS_DENIED;
+    case EEXIST:
+        return HOSTFS_STATUS_EXISTS;
+    case ENOTDIR:
+        return HOSTFS_STATUS_NOT_DIRECTORY;
+    case EISDIR:
+        return HOSTFS_STATUS_IS_DIRECTORY;
+    case EMFILE:
+    case ENFILE:
+        return HOSTFS_STATUS_TOO_MANY;
+    default:
+        return HOSTFS_STATUS_IO_ERROR;
+    }
+}
+
+static uint32_t typeOf(mode_t mode)
+{
+    return S_ISREG(mode) ? HOSTFS_TYPE_FILE :
+           S_ISDIR(mode) ? HOSTFS_TYPE_DIRECTORY : HOSTFS_TYPE_OTHER;
+}
+
+/* public HostFsDevice */
+
+HostFsDevice::HostFsDevice(const string& root, bool readOnly /* = false */,
+                           int interruptLine /* = HOSTFS_INT_LINE */)
+: mb(0), root(root), readOnly(readOnly), interruptLine(interruptLine),
+  rootFd(-1), files(HOSTFS_MAX_HANDLES, -1)
+{ }
+
+HostFsDevice::~HostFsDevice()
+{
+    for (vector<int>::size_type i = 0; i < this->files.size(); i++)
+    {
+        if (this->files[i] >= 0)
+            close(this->files[i]);
+    }
+    if (this->rootFd >= 0)
+        close(this->rootFd);
+}
+
+string HostFsDevice::getName() const
+{
+    return "HostFs";
+}
+
+void HostFsDevice::init(Motherboard& mb)
+{
+    this->mb = &mb;
+
+    char real[PATH_MAX];
+    if (!realpath(this->root.c_str(), real))
+        throw runtime_error("Could not find shared directory " + this->root);
+    this->rootFd = open(real, O_PATH | O_DIRECTORY | O_CLOEXEC);
+    if (this->rootFd < 0)
+        throw runtime_error("Could not open shared directory " + this->root);
+    this->root = real;
+
+    if (!Device::requestPort(mb, this, DEFAULT_HOSTFS_PORT))
+        throw runtime_error("Could not initiate device port for host files");
+
+    printf("Sharing %s with the guest%s\n", this->root.c_str(),
+           this->readOnly ? ", read-only" : "");
+}
+
+void HostFsDevice::write(MemAddress what, int port)
+{
+    // without a descriptor to report to, the request is dropped
+    if (!inMemory(what, HOSTFS_DESC_SIZE, this->mb->getMemorySize()))
+        return;
+
+    uint8_t* desc = &Device::getMemory(*this->mb)[what];
+    uint32_t result = 0;
+    int status = this->serve(desc, result);
+    write32(desc + HOSTFS_DESC_RESULT, result);
+    write32(desc + HOSTFS_DESC_STATUS, status);
+
+    InterruptController* ic = this->mb->getInterruptController();
+    if (ic && this->interruptLine >= 0)
+        ic->interrupt(this->interruptLine);
+}
+
+PortMode HostFsDevice::getPortMode(int port) const
+{
+    return PORT_POSTED;
+}
+
+/* protected HostFsDevice */
+
+int HostFsDevice::serve(uint8_t* desc, uint32_t& result)
+{
+    uint32_t   op     = read32(desc + HOSTFS_DESC_OP);
+    uint32_t   handle = read32(desc + HOSTFS_DESC_HANDLE);
+    MemAddress buffer = read32(desc + HOSTFS_DESC_BUFFER);
+    uint32_t   length = read32(desc + HOSTFS_DESC_LENGTH);
+    uint64_t   offset = read64(desc + HOSTFS_DESC_OFFSET);
+    uint8_t*   memory = &Device::getMemory(*this->mb)[0];
+
+    switch (op)
+    {
+    case HOSTFS_OP_OPEN:
+    {
+        uint32_t flags = read32(desc + HOSTFS_DESC_FLAGS);
+        int mode = flags & HOSTFS_OPEN_WRITE ?
+            (flags & HOSTFS_OPEN_READ ? O_RDWR : O_WRONLY) : O_RDONLY;
+        if (flags & HOSTFS_OPEN_CREATE)
+            mode |= O_CREAT;
+        if (flags & HOSTFS_OPEN_TRUNCATE)
+            mode |= O_TRUNC;
+        if (flags & HOSTFS_OPEN_DIRECTORY)
+            mode = O_RDONLY | O_DIRECTORY;
+        if (this->readOnly && (mode & (O_WRONLY | O_RDWR | O_CREAT | O_TRUNC)))
+            return HOSTFS_STATUS_DENIED;
+
+        vector<int>::size_type slot = 0;
+        while (slot < this->files.size() && this->files[slot] >= 0)
+            slot++;
+        if (slot == this->files.size())
+            return HOSTFS_STATUS_TOO_MANY;
+
+        int fd;
+        int status = this->openPath(desc, mode, fd);
+        if (status != HOSTFS_STATUS_DONE)
+            return status;
+        this->files[slot] = fd;
+        write32(desc + HOSTFS_DESC_HANDLE, slot + 1);
+        return HOSTFS_STATUS_DONE;
+    }
+
+    case HOSTFS_OP_CLOSE:
+    {
+        int fd = this->getFile(handle);
+        if (fd < 0)
+            return HOSTFS_STATUS_BAD_HANDLE;
+        close(fd);
+        this->files[handle - 1] = -1;
+        return HOSTFS_STATUS_DONE;
+    }
+
+    case HOSTFS_OP_READ:
+    case HOSTFS_OP_WRITE:
+    {
+        int fd = this->getFile(handle);
+        if (fd < 0)
+            return HOSTFS_STATUS_BAD_HANDLE;
+        if (!inMemory(buffer, length, this->mb->getMemorySize()))
+            return HOSTFS_STATUS_BAD_BUFFER;
+
+        // straight between the file and guest memory
+        ssize_t done;
+        do
+        {
+            done = op == HOSTFS_OP_READ ?
+                pread(fd, memory + buffer, length, offset) :
+                pwrite(fd, memory + buffer, length, offset);
+        } while (done < 0 && errno == EINTR);
+        if (done < 0)
+            return errno == EBADF ? HOSTFS_STATUS_DENIED : statusOf(errno);
+
+        if (op == HOSTFS_OP_READ && done > 0)
+        {
+            const vector<DirtyTracker*>& trackers =
+                this->mb->getDirtyTrackers();
+            for (vector<DirtyTracker*>::size_type i = 0;
+                 i < trackers.size();
+                 i++)
+                trackers[i]->mark(buffer, done);
+        }
+        result = done;
+        return HOSTFS_STATUS_DONE;
+    }
+
+    case HOSTFS_OP_STAT:
+    {
+        if (!inMemory(buffer, HOSTFS_STAT_SIZE, this->mb->getMemorySize()) ||
+            length < HOSTFS_STAT_SIZE)
+        {
+            return HOSTFS_STATUS_BAD_BUFFER;
+        }
+
+        struct stat st;
+        if (read32(desc + HOSTFS_DESC_PATH))
+        {
+            int fd;
+            int status = this->openPath(desc, O_PATH, fd);
+            if (status != HOSTFS_STATUS_DONE)
+                return status;
+            int failed = fstat(fd, &st);
+            close(fd);
+            if (failed)
+                return statusOf(errno);
+        }
+        else
+        {
+            int fd = this->getFile(handle);
+            if (fd < 0)
+                return HOSTFS_STATUS_BAD_HANDLE;
+            if (fstat(fd, &st) < 0)
+                return statusOf(errno);
+        }
+
+        uint8_t* out = memory + buffer;
+        write64(out + 0, st.st_size);
+        write32(out + 8, typeOf(st.st_mode));
+        write32(out + 12, st.st_mode & 07777);
+        write64(out + 16, st.st_mtime);
+        result = HOSTFS_STAT_SIZE;
+        return HOSTFS_STATUS_DONE;
+    }
+
+    case HOSTFS_OP_READDIR:
+    {
+        int fd = this->getFile(handle);
+        if (fd < 0)
+            return HOSTFS_STATUS_BAD_HANDLE;
+        if (!inMemory(buffer, length, this->mb->getMemorySize()))
+            return HOSTFS_STATUS_BAD_BUFFER;
+        return this->readDir(fd, offset, memory + buffer, length, result);
+    }
+
+    default:
+        return HOSTFS_STATUS_BAD_OP;
+    }
+}
+
+int HostFsDevice::openPath(const uint8_t* desc, int flags, int& fd)
+{
+    const vector<uint8_t>& memory = Device::getMemory(*this->mb);
+    MemAddress path = read32(desc + HOSTFS_DESC_PATH);
+    if (!inMemory(path, 1, this->mb->getMemorySize()))
+        return HOSTFS_STATUS_BAD_BUFFER;
+
+    // the path ends in a 0 byte, before the end of memory
+    MemAddress end = path;
+    while (end < static_cast<MemAddress>( memory.size() ) && memory[end] &&
+           end - path < HOSTFS_PATH_MAX)
+        end++;
+    if (end == static_cast<MemAddress>( memory.size() ) || memory[end])
+        return HOSTFS_STATUS_BAD_BUFFER;
+    string name(memory.begin() + path, memory.begin() + end);
+    if (!name.empty() && name[0] == '/')
+        return HOSTFS_STATUS_DENIED;
+
+    /* split into the directory and the file in it; ".." may not be used to
+       climb out */
+    string dir = ".";
+    string leaf = ".";
+    string::size_type start = 0;
+    while (start <= name.size())
+    {
+        string::size_type slash = name.find('/', start);
+        if (slash == string::npos)
+            slash = name.size();
+        string part = name.substr(start, slash - start);
+        start = slash + 1;
+
+        if (part.empty() || part == ".")
+            continue;
+        if (part == "..")
+            return HOSTFS_STATUS_DENIED;
+        if (leaf != ".")
+            dir += "/" + leaf;
+        leaf = part;
+    }
+
+    int dirFd = openat(this->rootFd, dir.c_str(),
+                       O_PATH | O_DIRECTORY | O_CLOEXEC);
+    if (dirFd < 0)
+        return statusOf(errno);
+    // a symbolic link on the way may have led somewhere else
+    if (!this->isInside(dirFd))
+    {
+        close(dirFd);
+        return HOSTFS_STATUS_DENIED;
+    }
+
+    fd = openat(dirFd, leaf.c_str(), flags | O_NOFOLLOW | O_CLOEXEC, 0644);
+    int err = errno;
+    close(dirFd);
+    return fd < 0 ? statusOf(err) : HOSTFS_STATUS_DONE;
+}
+
+bool HostFsDevice::isInside(int fd) const
+{
+    char link[64];
+    char real[PATH_MAX];
+    snprintf(link, sizeof(link), "/proc/self/fd/%d", fd);
+    ssize_t n = readlink(link, real, sizeof(real) - 1);
+    if (n < 0)
+        return false;
+    real[n] = 0;
+
+    // the only root that ends in a slash; everything is inside it
+    if (this->root == "/")
+        return real[0] == '/';
+    return this->root.compare(real) == 0 ||
+           (strncmp(real, this->root.c_str(), this->root.size()) == 0 &&
+            real[this->root.size()] == '/');
+}
+
+int HostFsDevice::readDir(int fd, uint64_t first, uint8_t* buffer,
+                          uint32_t length, uint32_t& listed)
+{
+    // the handle keeps its own descriptor; the listing gets a copy
+    int copy = dup(fd);
+    DIR* dir = copy >= 0 ? fdopendir(copy) : 0;
+    if (!dir)
+    {
+        int err = errno;
+        if (copy >= 0)
+            close(copy);
+        return statusOf(err);
+    }
+    rewinddir(dir);
+
+    uint64_t index = 0;
+    uint32_t used  = 0;
+    listed = 0;
+    while (struct dirent* entry = readdir(dir))
+    {
+        if (!strcmp(entry->d_name, ".") || !strcmp(entry->d_name, ".."))
+            continue;
+        if (index++ < first)
+            continue;
+
+        size_t nameLength = strlen(entry->d_name);
+        if (nameLength > 255)
+            continue;   // longer than an entry can say
+        if (used + 2 + nameLength > length)
+            break;
+
+        uint32_t type = entry->d_type == DT_REG ? HOSTFS_TYPE_FILE :
+                        entry->d_type == DT_DIR ? HOSTFS_TYPE_DIRECTORY :
+                                                  HOSTFS_TYPE_OTHER;
+        struct stat st;
+        if (entry->d_type == DT_UNKNOWN &&
+            fstatat(dirfd(dir), entry->d_name, &st, AT_SYMLINK_NOFOLLOW) == 0)
+            type = typeOf(st.st_mode);
+
+        buffer[used]     = type;
+        buffer[used + 1] = nameLength;
+        memcpy(buffer + used + 2, entry->d_name, nameLength);
+        used += 2 + nameLength;
+        listed++;
+    }
+    closedir(dir);
+    return HOSTFS_STATUS_DONE;
+}
+
+int HostFsDevice::getFile(uint32_t handle) const
+{
+    if (handle < 1 || handle > this->files.size())
+        return -1;
+    return this->files[handle - 1];
+}
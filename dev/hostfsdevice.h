@@ -0,0 +1,204 @@
+/**
+ * @file    hostfsdevice.h
+ *
+ * Matrix VM
+ */
+
+#ifndef HOSTFSDEVICE_H
+#define HOSTFSDEVICE_H
+
+#include <machine/device.h>
+
+#include <string>
+#include <vector>
+
+/* request descriptor, anywhere in guest memory (big endian):
+    0   4   HOSTFS_OP_ value
+    4   4   handle:  written by the device for HOSTFS_OP_OPEN, read for the
+            rest
+    8   4   HOSTFS_OPEN_ flags, for HOSTFS_OP_OPEN
+   12   4   address of the path, relative to the shared directory and ending
+            in a 0 byte; for HOSTFS_OP_OPEN and HOSTFS_OP_STAT
+   16   4   address of the buffer
+   20   4   bytes in the buffer
+   24   8   offset in the file, or number of the first directory entry
+   32   4   result, written by the device:  bytes read or written, or
+            directory entries listed
+   36   4   status, written by the device:  a HOSTFS_STATUS_ value */
+#define HOSTFS_DESC_OP          0
+#define HOSTFS_DESC_HANDLE      4
+#define HOSTFS_DESC_FLAGS       8
+#define HOSTFS_DESC_PATH        12
+#define HOSTFS_DESC_BUFFER      16
+#define HOSTFS_DESC_LENGTH      20
+#define HOSTFS_DESC_OFFSET      24
+#define HOSTFS_DESC_RESULT      32
+#define HOSTFS_DESC_STATUS      36
+#define HOSTFS_DESC_SIZE        40
+
+#define HOSTFS_OP_OPEN          1
+#define HOSTFS_OP_CLOSE         2
+#define HOSTFS_OP_READ          3       // file to buffer, at the offset
+#define HOSTFS_OP_WRITE         4       // buffer to file, at the offset
+#define HOSTFS_OP_STAT          5       // of the path, or of the handle if none
+#define HOSTFS_OP_READDIR       6       // directory entries, from the offset
+
+#define HOSTFS_OPEN_READ        0x01
+#define HOSTFS_OPEN_WRITE       0x02
+#define HOSTFS_OPEN_CREATE      0x04
+#define HOSTFS_OPEN_TRUNCATE    0x08
+#define HOSTFS_OPEN_DIRECTORY   0x10    // for HOSTFS_OP_READDIR
+
+/* stat, written to the buffer (big endian):
+    0   8   size, in bytes
+    8   4   HOSTFS_TYPE_ value
+   12   4   permission bits
+   16   8   time of the last change, in seconds since 1970 */
+#define HOSTFS_STAT_SIZE        24
+
+#define HOSTFS_TYPE_FILE        1
+#define HOSTFS_TYPE_DIRECTORY   2
+#define HOSTFS_TYPE_OTHER       3
+
+/* directory entry, written to the buffer, as many as fit:
+    0   1   HOSTFS_TYPE_ value
+    1   1   length of the name
+    2   n   name, without a 0 byte */
+
+#define HOSTFS_STATUS_DONE          0
+#define HOSTFS_STATUS_BAD_OP        1
+#define HOSTFS_STATUS_BAD_BUFFER    2   // buffer or path is not in memory
+#define HOSTFS_STATUS_BAD_HANDLE    3
+#define HOSTFS_STATUS_NOT_FOUND     4
+#define HOSTFS_STATUS_DENIED        5   // outside the share, or read-only
+#define HOSTFS_STATUS_EXISTS        6
+#define HOSTFS_STATUS_NOT_DIRECTORY 7
+#define HOSTFS_STATUS_IS_DIRECTORY  8
+#define HOSTFS_STATUS_TOO_MANY      9   // no free handle
+#define HOSTFS_STATUS_IO_ERROR      10
+
+#define HOSTFS_MAX_HANDLES      64
+#define HOSTFS_PATH_MAX         1024
+
+#define DEFAULT_HOSTFS_PORT     12
+/* raised when a request has completed */
+#define HOSTFS_INT_LINE         8
+
+namespace machine
+{
+
+struct HostFsDeviceArgs
+{
+    const char* root;   //!< Directory to share
+    bool readOnly;      //!< Whether the guest may only read
+    int interruptLine;  //!< Negative for no completion interrupt
+
+    HostFsDeviceArgs()
+    : root(0), readOnly(false), interruptLine(HOSTFS_INT_LINE)
+    { }
+};
+
+/**
+ * @class HostFsDevice
+ *
+ * Gives the guest the files in one directory on the host.
+ *
+ * The guest fills in a request descriptor and writes its address to the
+ * port.  Requests are served on a host thread, in order, while the CPU keeps
+ * running; when one is done, the device writes the result and status into
+ * the descriptor and interrupts.  Reads and writes go straight between the
+ * host file and the buffer in guest memory.
+ *
+ * Paths may not lead out of the shared directory:  ".." and absolute paths
+ * are refused, the directory that a path names a file in must be inside the
+ * shared one, and the file itself may not be a symbolic link.
+ */
+class HostFsDevice : public Device
+{
+public:
+
+    /**
+     * @param[in]   root            Directory to share
+     * @param[in]   readOnly        Whether the guest may only read
+     * @param[in]   interruptLine   Line to interrupt on when a request has
+     *                              completed, or negative for none
+     */
+    HostFsDevice(const std::string& root, bool readOnly = false,
+                 int interruptLine = HOSTFS_INT_LINE);
+
+    virtual ~HostFsDevice();
+
+    /**
+     * @return  Name of the device
+     */
+    virtual std::string getName() const;
+
+    virtual void init(Motherboard& mb);
+
+    /**
+     * Serve a request
+     * @param[in]   what    Address of the request descriptor
+     * @param[in]   port    Ignored
+     */
+    virtual void write(MemAddress what, int port);
+
+    /**
+     * @param[in]   port    Ignored
+     * @return  PORT_POSTED; requests are served off the CPU thread
+     */
+    virtual PortMode getPortMode(int port) const;
+
+protected:
+
+    /**
+     * Serve the request in a descriptor
+     * @param[in]       desc    The descriptor, in guest memory
+     * @param[out]      result  What to write into the descriptor's result
+     * @return  A HOSTFS_STATUS_ value
+     */
+    int serve(uint8_t* desc, uint32_t& result);
+
+    /**
+     * Open a path in the shared directory
+     * @param[in]   desc    The descriptor, with the path
+     * @param[in]   flags   Flags for open(2)
+     * @param[out]  fd
+     * @return  A HOSTFS_STATUS_ value
+     */
+    int openPath(const uint8_t* desc, int flags, int& fd);
+
+    /**
+     * @param[in]   fd
+     * @return  Whether fd is the shared directory, or inside it
+     */
+    bool isInside(int fd) const;
+
+    /**
+     * List directory entries into the buffer
+     * @return  A HOSTFS_STATUS_ value
+     */
+    int readDir(int fd, uint64_t first, uint8_t* buffer, uint32_t length,
+                uint32_t& listed);
+
+    /**
+     * @param[in]   handle  Handle from the guest
+     * @return  The file, or negative if the handle is not open
+     */
+    int getFile(uint32_t handle) const;
+
+private:
+
+    Motherboard* mb;
+
+    std::string root;   //<! Real path of the shared directory
+    bool readOnly;
+    int interruptLine;
+    int rootFd;
+
+    // file of each handle, less 1; negative if free
+    std::vector<int> files;
+};
+
+}   // namespace machine
+
+#endif // HOSTFSDEVICE_H
@@ -1,17 +1,20 @@
 #include "interruptcontroller.h"
 
+#include <stdexcept>
+
+using namespace std;
 using namespace machine;
 
 InterruptController::InterruptController(Motherboard& mb)
 : mb(mb)
-{ }
-
-MemAddress InterruptController::getPin(unsigned int pin) const
 {
-    return this->pins.at(pin);
+    for (int i = 0; i < INTERRUPT_CONTROLLER_PINS; i++)
+        this->pins[i].store(0, memory_order_relaxed);
 }
 
 void InterruptController::setPin(unsigned int pin, MemAddress word)
 {
-    this->pins[pin] = word;
+    if (pin >= INTERRUPT_CONTROLLER_PINS)
+        throw out_of_range("No such interrupt controller pin");
+    this->pins[pin].store(word, memory_order_release);
 }
@@ -9,6 +9,11 @@
 
 #include <machine/device.h>
 
+#include <atomic>
+
+// pins that a controller has; the others always read as 0
+#define INTERRUPT_CONTROLLER_PINS   256
+
 namespace machine
 {
 
@@ -29,17 +34,24 @@ public:
     virtual MemAddress getInterruptVectorAddress() const = 0;
 
     /**
-     * Get the value of a CPU pin
+     * Get the value of a CPU pin.  This is a single load, so that guests may
+     * poll pins.
      * @param[in]   pin
-     * @return  The value at `pin`
+     * @return  The value at `pin`, or 0 if it was never set
      */
-    MemAddress getPin(unsigned int pin) const;
+    MemAddress getPin(unsigned int pin) const
+    {
+        if (pin >= INTERRUPT_CONTROLLER_PINS)
+            return 0;
+        return this->pins[pin].load(std::memory_order_relaxed);
+    }
 
     /**
-     * Set the value of a CPU pin
+     * Set the value of a CPU pin.  May be called from any thread.
      * To simplify guest code, a pin is word-sized
      * @param[in]   pin     Which pin to set
      * @param[in]   word    What the value should be
+     * @throw   out_of_range if there is no such pin
      */
     void setPin(unsigned int pin, MemAddress word);
 
@@ -55,7 +67,7 @@ protected:
 
 private:
 
-    std::unordered_map<unsigned int,MemAddress> pins;
+    std::atomic<MemAddress> pins[INTERRUPT_CONTROLLER_PINS];
 
 };
 
@@ -0,0 +1,102 @@
+/**
+ * @file    keyboarddevice.cpp
+ *
+ * Matrix VM
+ */
+
+#include "keyboarddevice.h"
+#include <dev/interruptcontroller.h>
+#include <machine/guestmemory.h>
+
+#include <atomic>
+#include <stdexcept>
+
+using namespace std;
+using namespace machine;
+
+/* public KeyboardDevice */
+
+KeyboardDevice::KeyboardDevice(int interruptLine /* = KEYBOARD_INT_LINE */)
+: mb(0), ic(0), interruptLine(interruptLine), ringAddr(0), ringMode(false),
+  armed(false), head(0), tail(0)
+{ }
+
+string KeyboardDevice::getName() const
+{
+    return "Keyboard";
+}
+
+void KeyboardDevice::init(Motherboard& mb)
+{
+    this->ringAddr = Device::reserveMemIO(mb, *this, KEYBOARD_DMA_SIZE);
+    if (this->ringAddr < 0)
+        throw runtime_error("Could not request DMA memory for keyboard");
+
+    if (!Device::requestPort(mb, this, DEFAULT_KEYBOARD_PORT))
+        throw runtime_error("Could not initiate device port for keyboard");
+
+    boost::lock_guard<boost::mutex> lock(this->mutex);
+    this->ic = mb.getInterruptController();
+    this->mb = &mb;
+}
+
+void KeyboardDevice::write(MemAddress what, int port)
+{
+    const uint8_t* ring = &Device::getMemory(*this->mb)[this->ringAddr];
+
+    boost::lock_guard<boost::mutex> lock(this->mutex);
+    // the guest stored its tail before writing, on this thread
+    this->tail = read32(ring + KEYBOARD_RING_TAIL);
+    this->ringMode = true;
+    this->armed = true;
+    this->deliver();
+}
+
+void KeyboardDevice::keyEvent(int keycode, bool release)
+{
+    uint32_t event = keycode | (release ? KEYBOARD_RELEASE : 0);
+
+    boost::lock_guard<boost::mutex> lock(this->mutex);
+    if (!this->mb || !this->ic)
+        return;     // not plugged in yet
+
+    this->ic->setPin(KEYBOARD_DATA_PIN, event);
+    if (!this->ringMode)
+    {
+        this->ic->interrupt(this->interruptLine);
+        return;
+    }
+
+    if (this->backlog.size() >= KEYBOARD_BACKLOG)
+        return;     // the guest has stopped taking keys
+    this->backlog.push_back(event);
+    this->deliver();
+}
+
+/* protected KeyboardDevice */
+
+void KeyboardDevice::deliver()
+{
+    uint8_t* ring = &Device::getMemory(*this->mb)[this->ringAddr];
+
+    // the guest is done with the slots before the tail it last gave us
+    while (!this->backlog.empty() &&
+           this->head - this->tail < KEYBOARD_RING_SIZE)
+    {
+        int slot = this->head % KEYBOARD_RING_SIZE;
+        write32(ring + KEYBOARD_RING_EVENTS + 4 * slot,
+                  this->backlog.front());
+        this->backlog.pop_front();
+        this->head++;
+    }
+
+    // the events must be in place before the guest sees the head
+    atomic_thread_fence(memory_order_release);
+    write32(ring + KEYBOARD_RING_HEAD, this->head);
+
+    if (this->armed && this->head != this->tail)
+    {
+        this->armed = false;
+        this->ic->interrupt(this->interruptLine);
+    }
+}
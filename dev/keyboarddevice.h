@@ -0,0 +1,120 @@
+/**
+ * @file    keyboarddevice.h
+ *
+ * Matrix VM
+ */
+
+#ifndef KEYBOARDDEVICE_H
+#define KEYBOARDDEVICE_H
+
+#include <machine/device.h>
+
+#include <string>
+#include <deque>
+#include <boost/thread/mutex.hpp>
+
+/* A key event is an X key code, plus KEYBOARD_RELEASE for a release */
+#define KEYBOARD_RELEASE    0x100
+
+#define KEYBOARD_INT_LINE   1
+#define KEYBOARD_DATA_PIN 0x8
+// Allow 8 pins for timer interrupt
+
+/* ring, at the start of the reserved memory (big endian):
+    0   4   head:  events added so far, written by the device
+    4   4   tail:  events taken so far, written by the guest
+    8   4n  events; event i is in slot i % KEYBOARD_RING_SIZE */
+#define KEYBOARD_RING_HEAD      0
+#define KEYBOARD_RING_TAIL      4
+#define KEYBOARD_RING_EVENTS    8
+#define KEYBOARD_RING_SIZE      64
+#define KEYBOARD_DMA_SIZE       (KEYBOARD_RING_EVENTS + 4 * KEYBOARD_RING_SIZE)
+
+// events held on the host while the ring is full; past this, keys are dropped
+#define KEYBOARD_BACKLOG        1024
+
+#define DEFAULT_KEYBOARD_PORT   3
+
+namespace machine
+{
+
+/**
+ * @class KeyboardDevice
+ *
+ * Delivers the keys pressed in the display to the guest through a ring in
+ * guest memory, so that keys typed faster than the guest takes interrupts
+ * are not lost.
+ *
+ * The device starts out as the keyboard always worked:  each key is set on
+ * KEYBOARD_DATA_PIN and interrupts, and replaces a key that the guest has not
+ * read yet.  The first write to the port switches it to the ring.  From then
+ * on, keys are added at `head`, and the device interrupts once for a batch of
+ * them:  the guest takes the events from `tail` up to `head`, stores the new
+ * `tail`, and writes to the port to ask for the next interrupt.  Keys that
+ * come meanwhile wait in the ring, and interrupt as soon as the guest asks.
+ * The device reads `tail` only on those writes, so slots freed since the last
+ * one are not reused until the next.  While the ring is full, keys wait on
+ * the host, up to KEYBOARD_BACKLOG of them.
+ *
+ * The pin is always set to the latest key, for guests that only look at it.
+ */
+class KeyboardDevice : public Device
+{
+public:
+
+    /**
+     * @param[in]   interruptLine   Line to interrupt on when there are keys
+     */
+    KeyboardDevice(int interruptLine = KEYBOARD_INT_LINE);
+
+    /**
+     * @return  Name of the device
+     */
+    std::string getName() const;
+
+    void init(Motherboard& mb);
+
+    /**
+     * Switch to the ring if not yet, take the guest's tail, and ask for an
+     * interrupt when there are events in it
+     * @param[in]   what    Ignored
+     * @param[in]   port    Ignored
+     */
+    void write(MemAddress what, int port);
+
+    /**
+     * Deliver a key to the guest.  May be called from any thread.
+     * @param[in]   keycode     X key code
+     * @param[in]   release     Whether the key was released, rather than
+     *                          pressed
+     */
+    void keyEvent(int keycode, bool release);
+
+protected:
+
+    /**
+     * Move waiting keys into the ring, and interrupt if the guest asked to be
+     * told of them
+     * @pre `mutex` is held, and the device is in ring mode
+     */
+    void deliver();
+
+private:
+
+    Motherboard*            mb;
+    InterruptController*    ic;
+    int                     interruptLine;
+    MemAddress              ringAddr;
+
+    boost::mutex            mutex;
+    bool                    ringMode;   //<! Whether the guest uses the ring
+    bool                    armed;      //<! Whether the next key interrupts
+    uint32_t                head;
+    uint32_t                tail;       //<! As of the guest's last write
+    std::deque<uint32_t>    backlog;    //<! Keys waiting for room in the ring
+
+};
+
+}   // namespace machine
+
+#endif // KEYBOARDDEVICE_H
@@ -7,11 +7,8 @@
 using namespace std;
 
 void NullDisplayManager::init(
-    std::vector<uint8_t>&           memory,
-    MemAddress                      videoAddress,
-    machine::InterruptController*   ic,
-    int                             width,
-    int                             height
+    const machine::Framebuffer&     framebuffer,
+    machine::InterruptController*   ic
     )
 { }
 
@@ -19,8 +16,9 @@ void NullDisplayManager::show()
 {
 }
 
-void NullDisplayManager::flush()
+void NullDisplayManager::flush(const std::vector<machine::DirtyRect>& rects)
 {
+    this->flushed();
 }
 
 void NullDisplayManager::destroy()
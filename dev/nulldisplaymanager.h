@@ -8,16 +8,13 @@ class NullDisplayManager : public DisplayManager
 public:
 
     void init(
-        std::vector<uint8_t>&           memory,
-        MemAddress                      videoAddress,
-        machine::InterruptController*   ic,
-        int                             width,
-        int                             height
+        const machine::Framebuffer&     framebuffer,
+        machine::InterruptController*   ic
         );
 
     void show();
 
-    void flush();
+    void flush(const std::vector<machine::DirtyRect>& rects);
 
     void destroy();
 
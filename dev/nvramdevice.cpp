@@ -0,0 +1,152 @@
+/**
+ * @file    nvramdevice.cpp
+ *
+ * Matrix VM
+ */
+
+#include "nvramdevice.h"
+#include <dev/interruptcontroller.h>
+#include <machine/guestmemory.h>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <stdexcept>
+
+using namespace std;
+using namespace machine;
+
+// declared, but not defined, in device.h
+SLDECL Device* createDevice(void* args)
+{
+    // there is no default NVRAM file
+    NvramDeviceArgs* nvArgs = reinterpret_cast<NvramDeviceArgs*>( args );
+    if (nvArgs && nvArgs->path)
+        return new NvramDevice(nvArgs->path, nvArgs->interruptLine);
+    else
+        return 0;
+}
+
+/* public NvramDevice */
+
+NvramDevice::NvramDevice(const string& path,
+                         int interruptLine /* = NVRAM_INT_LINE */)
+: mb(0), path(path), interruptLine(interruptLine), fd(-1), nvram(0), size(0),
+  pageSize(sysconf(_SC_PAGESIZE))
+{
+}
+
+NvramDevice::~NvramDevice()
+{
+    if (this->nvram)
+    {
+        msync(this->nvram, this->size, MS_SYNC);
+        /* the pages still belong to guest memory, which is freed after the
+           devices are; give them back as plain memory, not the file */
+        mmap(this->nvram, this->size, PROT_READ | PROT_WRITE,
+             MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED, -1, 0);
+    }
+    if (this->fd >= 0)
+        close(this->fd);
+}
+
+string NvramDevice::getName() const
+{
+    return "NvramDevice";
+}
+
+void NvramDevice::init(Motherboard& mb)
+{
+    this->mb = &mb;
+
+    this->fd = open(this->path.c_str(), O_RDWR | O_CREAT, 0644);
+    struct stat st;
+    if (this->fd < 0 || fstat(this->fd, &st) < 0)
+        throw runtime_error("Could not open NVRAM file " + this->path);
+
+    // only whole pages can be mapped
+    uint64_t size = st.st_size ? st.st_size : NVRAM_DEFAULT_SIZE;
+    size = (size + this->pageSize - 1) &
+           ~static_cast<uint64_t>( this->pageSize - 1 );
+    if (size > static_cast<uint64_t>( mb.getMemorySize() ))
+    {
+        throw runtime_error("NVRAM file " + this->path +
+                            " is larger than memory");
+    }
+    if (static_cast<uint64_t>( st.st_size ) != size &&
+        ftruncate(this->fd, size) < 0)
+    {
+        throw runtime_error("Could not size NVRAM file " + this->path);
+    }
+    this->size = size;
+
+    /* the NVRAM starts on the first host page boundary after the info, so
+       reserve enough to find one */
+    MemAddress dmaLoc = Device::reserveMemIO(
+        mb, *this, NVRAM_INFO_SIZE + this->pageSize - 1 + this->size);
+    if (dmaLoc < 0)
+        throw runtime_error("Could not request DMA memory for NVRAM device");
+
+    uint8_t* memory = &Device::getMemory(mb)[0];
+    uintptr_t start =
+        reinterpret_cast<uintptr_t>( memory + dmaLoc + NVRAM_INFO_SIZE );
+    start = (start + this->pageSize - 1) &
+            ~static_cast<uintptr_t>( this->pageSize - 1 );
+
+    // guest stores go straight to the file's pages
+    void* nvram = mmap(reinterpret_cast<void*>( start ), this->size,
+                       PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED,
+                       this->fd, 0);
+    if (nvram == MAP_FAILED)
+        throw runtime_error("Could not map NVRAM file " + this->path);
+    this->nvram = static_cast<uint8_t*>( nvram );
+
+    uint8_t* info = memory + dmaLoc;
+    write32(info + NVRAM_INFO_ADDRESS, this->nvram - memory);
+    write32(info + NVRAM_INFO_SIZE_BYTES, this->size);
+
+    if (!Device::requestPort(mb, this, DEFAULT_NVRAM_PORT))
+        throw runtime_error("Could not initiate device port for NVRAM device");
+}
+
+void NvramDevice::write(MemAddress what, int port)
+{
+    // without a descriptor to report to, the flush is dropped
+    if (!inMemory(what, NVRAM_DESC_SIZE, this->mb->getMemorySize()))
+        return;
+
+    uint8_t* desc = &Device::getMemory(*this->mb)[what];
+    int status = this->flush(read32(desc + NVRAM_DESC_OFFSET),
+                             read32(desc + NVRAM_DESC_LENGTH));
+    write32(desc + NVRAM_DESC_STATUS, status);
+
+    InterruptController* ic = this->mb->getInterruptController();
+    if (ic && this->interruptLine >= 0)
+        ic->interrupt(this->interruptLine);
+}
+
+PortMode NvramDevice::getPortMode(int port) const
+{
+    return PORT_POSTED;
+}
+
+/* protected NvramDevice */
+
+int NvramDevice::flush(uint32_t offset, uint32_t length)
+{
+    if (offset > this->size)
+        return NVRAM_STATUS_BAD_RANGE;
+    if (length == 0)
+        length = this->size - offset;
+    if (length > this->size - offset)
+        return NVRAM_STATUS_BAD_RANGE;
+    if (length == 0)
+        return NVRAM_STATUS_DONE;
+
+    // msync takes whole pages
+    uint32_t first = offset & ~(this->pageSize - 1);
+    if (msync(this->nvram + first, offset + length - first, MS_SYNC) < 0)
+        return NVRAM_STATUS_IO_ERROR;
+    return NVRAM_STATUS_DONE;
+}
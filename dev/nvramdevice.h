@@ -0,0 +1,131 @@
+/**
+ * @file    nvramdevice.h
+ *
+ * Matrix VM
+ */
+
+#ifndef NVRAMDEVICE_H
+#define NVRAMDEVICE_H
+
+#include <machine/device.h>
+
+#include <string>
+
+/* info, at the start of the reserved memory (big endian), written by the
+   device:
+    0   4   address of the NVRAM; on a page boundary of the host, so somewhere
+            after the info
+    4   4   bytes of NVRAM */
+#define NVRAM_INFO_ADDRESS      0
+#define NVRAM_INFO_SIZE_BYTES   4
+#define NVRAM_INFO_SIZE         8
+
+/* flush descriptor, anywhere in guest memory (big endian):
+    0   4   offset in the NVRAM of the first byte to flush
+    4   4   bytes to flush; 0 for the rest of the NVRAM
+    8   4   status, written by the device:  an NVRAM_STATUS_ value */
+#define NVRAM_DESC_OFFSET       0
+#define NVRAM_DESC_LENGTH       4
+#define NVRAM_DESC_STATUS       8
+#define NVRAM_DESC_SIZE         12
+
+#define NVRAM_STATUS_DONE       0
+#define NVRAM_STATUS_BAD_RANGE  1       // past the end of the NVRAM
+#define NVRAM_STATUS_IO_ERROR   2
+
+// bytes of NVRAM in a new file
+#define NVRAM_DEFAULT_SIZE      (64 * 1024)
+
+#define DEFAULT_NVRAM_PORT      13
+/* raised when a flush has completed */
+#define NVRAM_INT_LINE          9
+
+namespace machine
+{
+
+struct NvramDeviceArgs
+{
+    const char* path;   //!< File that keeps the NVRAM
+    int interruptLine;  //!< Negative for no completion interrupt
+
+    NvramDeviceArgs()
+    : path(0), interruptLine(NVRAM_INT_LINE)
+    { }
+};
+
+/**
+ * @class NvramDevice
+ *
+ * Memory that outlives the machine, kept in a file on the host.
+ *
+ * The file is mapped shared over part of the device's reserved memory, so the
+ * guest reads and writes the NVRAM with plain loads and stores, and what it
+ * stores is already in the file's pages:  nothing is copied.  The pages reach
+ * the disk whenever the host writes them back; to make a range durable, the
+ * guest fills in a flush descriptor and writes its address to the port.  The
+ * flush is done on a host thread, while the CPU keeps running, and when it is
+ * done the device writes the status into the descriptor and interrupts.
+ *
+ * A new file is NVRAM_DEFAULT_SIZE bytes of zeros; an existing one keeps its
+ * size, rounded up to whole pages.
+ */
+class NvramDevice : public Device
+{
+public:
+
+    /**
+     * @param[in]   path            File that keeps the NVRAM, created if
+     *                              there is none
+     * @param[in]   interruptLine   Line to interrupt on when a flush has
+     *                              completed, or negative for none
+     */
+    NvramDevice(const std::string& path, int interruptLine = NVRAM_INT_LINE);
+
+    virtual ~NvramDevice();
+
+    /**
+     * @return  Name of the device
+     */
+    virtual std::string getName() const;
+
+    virtual void init(Motherboard& mb);
+
+    /**
+     * Flush a range of the NVRAM to the file
+     * @param[in]   what    Address of the flush descriptor
+     * @param[in]   port    Ignored
+     */
+    virtual void write(MemAddress what, int port);
+
+    /**
+     * @param[in]   port    Ignored
+     * @return  PORT_POSTED; flushes are done off the CPU thread
+     */
+    virtual PortMode getPortMode(int port) const;
+
+protected:
+
+    /**
+     * Make part of the NVRAM durable
+     * @param[in]   offset  First byte to flush
+     * @param[in]   length  Bytes to flush; 0 for the rest
+     * @return  An NVRAM_STATUS_ value
+     */
+    int flush(uint32_t offset, uint32_t length);
+
+private:
+
+    Motherboard* mb;
+
+    std::string path;
+    int interruptLine;
+
+    int         fd;
+    uint8_t*    nvram;      //<! The file, mapped over guest memory
+    uint32_t    size;       //<! Bytes mapped; whole pages
+    long        pageSize;
+};
+
+}   // namespace machine
+
+#endif // NVRAMDEVICE_H
@@ -0,0 +1,355 @@
+/**
+ * @file    pixelconvert.cpp
+ *
+ * Matrix VM
+ */
+
+#include "pixelconvert.h"
+#include "framebuffer.h"
+
+#include <string.h>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#  define PIXEL_X86 1
+#  include <immintrin.h>
+#else
+#  define PIXEL_X86 0
+#endif
+
+typedef void (*ConvertFunc)(const uint8_t* src, uint32_t* dst, int count);
+typedef void (*LookupFunc)(const uint8_t* src, uint32_t* dst, int count,
+                           const uint32_t* palette);
+typedef void (*ScaleRowFunc)(const uint32_t* src, uint32_t* dst, int width);
+
+/* Portable implementations */
+
+static void convertScalar(const uint8_t* src, uint32_t* dst, int count)
+{
+    for (int i = 0; i < count; i++, src += 3)
+        dst[i] = src[0] << 16 | src[1] << 8 | src[2];
+}
+
+static void convertRgb565Scalar(const uint8_t* src, uint32_t* dst, int count)
+{
+    for (int i = 0; i < count; i++, src += 2)
+    {
+        uint32_t p = src[0] << 8 | src[1];
+        uint32_t r = p >> 11, g = (p >> 5) & 0x3F, b = p & 0x1F;
+        // widen each channel by repeating its top bits
+        dst[i] = (r << 3 | r >> 2) << 16 | (g << 2 | g >> 4) << 8 |
+                 (b << 3 | b >> 2);
+    }
+}
+
+static void convertIndexed8Scalar(
+    const uint8_t*  src,
+    uint32_t*       dst,
+    int             count,
+    const uint32_t* palette)
+{
+    for (int i = 0; i < count; i++)
+        dst[i] = palette[src[i]];
+}
+
+static void scaleRow2Scalar(const uint32_t* src, uint32_t* dst, int width)
+{
+    for (int x = 0; x < width; x++, dst += 2)
+        dst[0] = dst[1] = src[x];
+}
+
+static void scaleRow3Scalar(const uint32_t* src, uint32_t* dst, int width)
+{
+    for (int x = 0; x < width; x++, dst += 3)
+        dst[0] = dst[1] = dst[2] = src[x];
+}
+
+#if PIXEL_X86
+
+/* x86 implementations */
+
+// Moves the 4 RGB pixels at the bottom of a register into 4 XRGB dwords
+#define RGB24_TO_XRGB32_MASK \
+    _mm_setr_epi8(2, 1, 0, -1, 5, 4, 3, -1, 8, 7, 6, -1, 11, 10, 9, -1)
+
+__attribute__((target("ssse3")))
+static void convertSsse3(const uint8_t* src, uint32_t* dst, int count)
+{
+    const __m128i mask = RGB24_TO_XRGB32_MASK;
+
+    // 16 pixels (48 bytes) at a time
+    int i = 0;
+    for (; i + 16 <= count; i += 16, src += 48)
+    {
+        const __m128i* in = reinterpret_cast<const __m128i*>( src );
+        __m128i a = _mm_loadu_si128(in + 0);
+        __m128i b = _mm_loadu_si128(in + 1);
+        __m128i c = _mm_loadu_si128(in + 2);
+
+        __m128i p0 = a;                         // bytes  0-11
+        __m128i p1 = _mm_alignr_epi8(b, a, 12); // bytes 12-23
+        __m128i p2 = _mm_alignr_epi8(c, b,  8); // bytes 24-35
+        __m128i p3 = _mm_srli_si128(c, 4);      // bytes 36-47
+
+        __m128i* out = reinterpret_cast<__m128i*>( dst + i );
+        _mm_storeu_si128(out + 0, _mm_shuffle_epi8(p0, mask));
+        _mm_storeu_si128(out + 1, _mm_shuffle_epi8(p1, mask));
+        _mm_storeu_si128(out + 2, _mm_shuffle_epi8(p2, mask));
+        _mm_storeu_si128(out + 3, _mm_shuffle_epi8(p3, mask));
+    }
+
+    convertScalar(src, dst + i, count - i);
+}
+
+__attribute__((target("avx2")))
+static void convertAvx2(const uint8_t* src, uint32_t* dst, int count)
+{
+    const __m256i mask = _mm256_broadcastsi128_si256(RGB24_TO_XRGB32_MASK);
+    // put bytes 0-11 in the low lane and bytes 12-23 in the high lane
+    const __m256i split = _mm256_setr_epi32(0, 1, 2, 0, 3, 4, 5, 0);
+
+    // 8 pixels (24 bytes) at a time; each load reads 32 bytes, so stop while
+    // there are still 8 spare bytes
+    int i = 0;
+    for (; i + 11 <= count; i += 8, src += 24)
+    {
+        __m256i v = _mm256_loadu_si256(reinterpret_cast<const __m256i*>( src ));
+        v = _mm256_permutevar8x32_epi32(v, split);
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>( dst + i ),
+                            _mm256_shuffle_epi8(v, mask));
+    }
+
+    convertSsse3(src, dst + i, count - i);
+}
+
+__attribute__((target("sse2")))
+static void convertRgb565Sse2(const uint8_t* src, uint32_t* dst, int count)
+{
+    const __m128i mask5 = _mm_set1_epi16(0x1F);
+    const __m128i mask6 = _mm_set1_epi16(0x3F);
+
+    // 8 pixels (16 bytes) at a time, in 16-bit lanes
+    int i = 0;
+    for (; i + 8 <= count; i += 8, src += 16)
+    {
+        __m128i p = _mm_loadu_si128(reinterpret_cast<const __m128i*>( src ));
+        // big endian
+        p = _mm_or_si128(_mm_slli_epi16(p, 8), _mm_srli_epi16(p, 8));
+
+        __m128i r = _mm_srli_epi16(p, 11);
+        __m128i g = _mm_and_si128(_mm_srli_epi16(p, 5), mask6);
+        __m128i b = _mm_and_si128(p, mask5);
+        r = _mm_or_si128(_mm_slli_epi16(r, 3), _mm_srli_epi16(r, 2));
+        g = _mm_or_si128(_mm_slli_epi16(g, 2), _mm_srli_epi16(g, 4));
+        b = _mm_or_si128(_mm_slli_epi16(b, 3), _mm_srli_epi16(b, 2));
+
+        // low halves are 0xGGBB, high halves 0x00RR
+        __m128i gb = _mm_or_si128(_mm_slli_epi16(g, 8), b);
+        __m128i* out = reinterpret_cast<__m128i*>( dst + i );
+        _mm_storeu_si128(out + 0, _mm_unpacklo_epi16(gb, r));
+        _mm_storeu_si128(out + 1, _mm_unpackhi_epi16(gb, r));
+    }
+
+    convertRgb565Scalar(src, dst + i, count - i);
+}
+
+__attribute__((target("avx2")))
+static void convertIndexed8Avx2(
+    const uint8_t*  src,
+    uint32_t*       dst,
+    int             count,
+    const uint32_t* palette)
+{
+    const int* colors = reinterpret_cast<const int*>( palette );
+
+    // 16 pixels at a time, 8 per gather
+    int i = 0;
+    for (; i + 16 <= count; i += 16)
+    {
+        const __m128i* in = reinterpret_cast<const __m128i*>( src + i );
+        __m128i p = _mm_loadu_si128(in);
+        __m256i lo = _mm256_cvtepu8_epi32(p);
+        __m256i hi = _mm256_cvtepu8_epi32(_mm_srli_si128(p, 8));
+
+        __m256i* out = reinterpret_cast<__m256i*>( dst + i );
+        _mm256_storeu_si256(out + 0, _mm256_i32gather_epi32(colors, lo, 4));
+        _mm256_storeu_si256(out + 1, _mm256_i32gather_epi32(colors, hi, 4));
+    }
+
+    convertIndexed8Scalar(src + i, dst + i, count - i, palette);
+}
+
+__attribute__((target("sse2")))
+static void scaleRow2Sse2(const uint32_t* src, uint32_t* dst, int width)
+{
+    int x = 0;
+    for (; x + 4 <= width; x += 4, dst += 8)
+    {
+        const __m128i* in = reinterpret_cast<const __m128i*>( src + x );
+        __m128i* out = reinterpret_cast<__m128i*>( dst );
+        __m128i v = _mm_loadu_si128(in);
+        _mm_storeu_si128(out + 0, _mm_unpacklo_epi32(v, v));
+        _mm_storeu_si128(out + 1, _mm_unpackhi_epi32(v, v));
+    }
+
+    scaleRow2Scalar(src + x, dst, width - x);
+}
+
+__attribute__((target("sse2")))
+static void scaleRow3Sse2(const uint32_t* src, uint32_t* dst, int width)
+{
+    int x = 0;
+    for (; x + 4 <= width; x += 4, dst += 12)
+    {
+        const __m128i* in = reinterpret_cast<const __m128i*>( src + x );
+        __m128i* out = reinterpret_cast<__m128i*>( dst );
+        __m128i v = _mm_loadu_si128(in);
+        _mm_storeu_si128(out + 0,
+                         _mm_shuffle_epi32(v, _MM_SHUFFLE(1, 0, 0, 0)));
+        _mm_storeu_si128(out + 1,
+                         _mm_shuffle_epi32(v, _MM_SHUFFLE(2, 2, 1, 1)));
+        _mm_storeu_si128(out + 2,
+                         _mm_shuffle_epi32(v, _MM_SHUFFLE(3, 3, 3, 2)));
+    }
+
+    scaleRow3Scalar(src + x, dst, width - x);
+}
+
+__attribute__((target("avx2")))
+static void scaleRow2Avx2(const uint32_t* src, uint32_t* dst, int width)
+{
+    const __m256i twice = _mm256_setr_epi32(0, 0, 1, 1, 2, 2, 3, 3);
+
+    int x = 0;
+    for (; x + 4 <= width; x += 4, dst += 8)
+    {
+        const __m128i* in = reinterpret_cast<const __m128i*>( src + x );
+        __m128i v = _mm_loadu_si128(in);
+        __m256i w = _mm256_permutevar8x32_epi32(_mm256_castsi128_si256(v),
+                                                twice);
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>( dst ), w);
+    }
+
+    scaleRow2Scalar(src + x, dst, width - x);
+}
+
+#endif  // PIXEL_X86
+
+/**
+ * The implementations picked for this host
+ */
+struct PixelFuncs
+{
+    ConvertFunc     convert;
+    ConvertFunc     convertRgb565;
+    LookupFunc      convertIndexed8;
+    ScaleRowFunc    scaleRow2;
+    ScaleRowFunc    scaleRow3;
+
+    PixelFuncs()
+    : convert(convertScalar), convertRgb565(convertRgb565Scalar),
+      convertIndexed8(convertIndexed8Scalar),
+      scaleRow2(scaleRow2Scalar), scaleRow3(scaleRow3Scalar)
+    {
+        #if PIXEL_X86
+        __builtin_cpu_init();
+        if (__builtin_cpu_supports("sse2"))
+        {
+            this->convertRgb565 = convertRgb565Sse2;
+            this->scaleRow2     = scaleRow2Sse2;
+            this->scaleRow3     = scaleRow3Sse2;
+        }
+        if (__builtin_cpu_supports("ssse3"))
+            this->convert = convertSsse3;
+        if (__builtin_cpu_supports("avx2"))
+        {
+            this->convert         = convertAvx2;
+            this->convertIndexed8 = convertIndexed8Avx2;
+            this->scaleRow2       = scaleRow2Avx2;
+        }
+        #endif
+    }
+};
+
+static const PixelFuncs& getPixelFuncs()
+{
+    static const PixelFuncs funcs;
+    return funcs;
+}
+
+void convertRgb24ToXrgb32(const uint8_t* src, uint32_t* dst, int count)
+{
+    getPixelFuncs().convert(src, dst, count);
+}
+
+void convertRgb565ToXrgb32(const uint8_t* src, uint32_t* dst, int count)
+{
+    getPixelFuncs().convertRgb565(src, dst, count);
+}
+
+void convertIndexed8ToXrgb32(
+    const uint8_t*  src,
+    uint32_t*       dst,
+    int             count,
+    const uint32_t* palette)
+{
+    getPixelFuncs().convertIndexed8(src, dst, count, palette);
+}
+
+void convertToXrgb32(
+    int             format,
+    const uint8_t*  src,
+    uint32_t*       dst,
+    int             count,
+    const uint32_t* palette)
+{
+    switch (format)
+    {
+    case FRAMEBUFFER_INDEXED8:
+        convertIndexed8ToXrgb32(src, dst, count, palette);
+        break;
+    case FRAMEBUFFER_RGB565:
+        convertRgb565ToXrgb32(src, dst, count);
+        break;
+    case FRAMEBUFFER_RGB24:
+        convertRgb24ToXrgb32(src, dst, count);
+        break;
+    }
+}
+
+void scaleXrgb32(
+    const uint32_t* src,
+    int             width,
+    int             height,
+    int             srcPitch,
+    uint32_t*       dst,
+    int             dstPitch,
+    int             factor)
+{
+    const PixelFuncs& funcs = getPixelFuncs();
+
+    const uint8_t* srcRow = reinterpret_cast<const uint8_t*>( src );
+    uint8_t*       dstRow = reinterpret_cast<uint8_t*>( dst );
+    for (int y = 0; y < height; y++, srcRow += srcPitch)
+    {
+        const uint32_t* in  = reinterpret_cast<const uint32_t*>( srcRow );
+        uint32_t*       out = reinterpret_cast<uint32_t*>( dstRow );
+
+        // scale the row once...
+        if (factor == 2)
+            funcs.scaleRow2(in, out, width);
+        else if (factor == 3)
+            funcs.scaleRow3(in, out, width);
+        else
+        {
+            for (int x = 0; x < width; x++)
+                for (int i = 0; i < factor; i++)
+                    *out++ = in[x];
+        }
+
+        // ...then copy it to the rest of its rows
+        for (int i = 1; i < factor; i++)
+            memcpy(dstRow + i * dstPitch, dstRow,
+                   width * factor * sizeof(uint32_t));
+        dstRow += factor * dstPitch;
+    }
+}
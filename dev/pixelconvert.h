@@ -0,0 +1,80 @@
+/**
+ * @file    pixelconvert.h
+ *
+ * Matrix VM
+ *
+ * Pixel format conversion and scaling shared by the display managers.  The
+ * fastest implementation that the host CPU supports is picked at runtime.
+ */
+
+#ifndef PIXELCONVERT_H
+#define PIXELCONVERT_H
+
+#include <stdint.h>
+
+/**
+ * Convert packed 3-byte guest pixels (R, G, B) to host XRGB32 pixels
+ * (0x00RRGGBB in host byte order)
+ * @param[in]   src     Guest pixels
+ * @param[out]  dst     Host pixels
+ * @param[in]   count   Number of pixels
+ */
+void convertRgb24ToXrgb32(const uint8_t* src, uint32_t* dst, int count);
+
+/**
+ * Convert big-endian RGB565 guest pixels to host XRGB32 pixels
+ * @param[in]   src     Guest pixels
+ * @param[out]  dst     Host pixels
+ * @param[in]   count   Number of pixels
+ */
+void convertRgb565ToXrgb32(const uint8_t* src, uint32_t* dst, int count);
+
+/**
+ * Look 8-bit indexed guest pixels up in a palette
+ * @param[in]   src     Guest pixels
+ * @param[out]  dst     Host pixels
+ * @param[in]   count   Number of pixels
+ * @param[in]   palette 256 XRGB32 colors; may be read past the entries
+ *                      that are used, but no further than 256
+ */
+void convertIndexed8ToXrgb32(
+    const uint8_t*  src,
+    uint32_t*       dst,
+    int             count,
+    const uint32_t* palette);
+
+/**
+ * Convert guest pixels of any Framebuffer format to host XRGB32 pixels
+ * @param[in]   format  One of the FRAMEBUFFER_ formats
+ * @param[in]   src     Guest pixels
+ * @param[out]  dst     Host pixels
+ * @param[in]   count   Number of pixels
+ * @param[in]   palette 256 XRGB32 colors, for FRAMEBUFFER_INDEXED8
+ */
+void convertToXrgb32(
+    int             format,
+    const uint8_t*  src,
+    uint32_t*       dst,
+    int             count,
+    const uint32_t* palette);
+
+/**
+ * Scale XRGB32 pixels up by an integer factor (nearest neighbor)
+ * @param[in]   src         First source pixel
+ * @param[in]   width       Source width, in pixels
+ * @param[in]   height      Source height, in pixels
+ * @param[in]   srcPitch    Bytes between source rows
+ * @param[out]  dst         First destination pixel
+ * @param[in]   dstPitch    Bytes between destination rows
+ * @param[in]   factor      Scale factor; 2 and 3 are vectorized
+ */
+void scaleXrgb32(
+    const uint32_t* src,
+    int             width,
+    int             height,
+    int             srcPitch,
+    uint32_t*       dst,
+    int             dstPitch,
+    int             factor);
+
+#endif // PIXELCONVERT_H
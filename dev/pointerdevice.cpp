@@ -0,0 +1,138 @@
+/**
+ * @file    pointerdevice.cpp
+ *
+ * Matrix VM
+ */
+
+#include "pointerdevice.h"
+#include <dev/interruptcontroller.h>
+#include <machine/guestmemory.h>
+
+#include <atomic>
+#include <stdexcept>
+
+using namespace std;
+using namespace machine;
+
+/* public PointerDevice */
+
+PointerDevice::PointerDevice(int interruptLine /* = POINTER_INT_LINE */)
+: mb(0), interruptLine(interruptLine), recordAddr(0), run(false),
+  pending(false), interval(POINTER_DEFAULT_INTERVAL), interrupting(false),
+  x(0), y(0), buttons(0), pressed(0), wheel(0), sequence(0)
+{ }
+
+string PointerDevice::getName() const
+{
+    return "Pointer";
+}
+
+void PointerDevice::init(Motherboard& mb)
+{
+    this->recordAddr = Device::reserveMemIO(mb, *this, POINTER_DMA_SIZE);
+    if (this->recordAddr < 0)
+        throw runtime_error("Could not request DMA memory for pointer");
+
+    if (!Device::requestPort(mb, this, DEFAULT_POINTER_PORT))
+        throw runtime_error("Could not initiate device port for pointer");
+
+    {
+        boost::lock_guard<boost::mutex> lock(this->mutex);
+        this->mb  = &mb;
+        this->run = true;
+    }
+    mb.requestThread(this, &PointerDevice::runPublisher);
+}
+
+void PointerDevice::write(MemAddress what, int port)
+{
+    boost::lock_guard<boost::mutex> lock(this->mutex);
+    this->interval = what > 0 ? min(what, POINTER_MAX_INTERVAL)
+                              : POINTER_DEFAULT_INTERVAL;
+    this->interrupting = true;
+}
+
+void PointerDevice::stopThread(boost::thread* thd)
+{
+    boost::lock_guard<boost::mutex> lock(this->mutex);
+    this->run = false;
+    this->changed.notify_one();
+}
+
+void PointerDevice::pointerEvent(int x, int y, int buttons, int wheel /* = 0 */)
+{
+    boost::lock_guard<boost::mutex> lock(this->mutex);
+    if (!this->mb)
+        return;     // not plugged in yet
+
+    this->x = x;
+    this->y = y;
+    this->pressed |= buttons & ~this->buttons;
+    this->buttons = buttons;
+    this->wheel  += wheel;
+
+    if (!this->pending)
+    {
+        this->pending = true;
+        this->changed.notify_one();
+    }
+}
+
+/* protected PointerDevice */
+
+void PointerDevice::runPublisher(Device* dev, Motherboard& mb)
+{
+    PointerDevice* pointer = dynamic_cast<PointerDevice*>( dev );
+    assert(pointer);
+
+    pointer->runPublisher();
+}
+
+void PointerDevice::runPublisher()
+{
+    boost::unique_lock<boost::mutex> lock(this->mutex);
+    while (this->run)
+    {
+        if (!this->pending)
+        {
+            this->changed.wait(lock);
+            continue;
+        }
+
+        this->publish();
+
+        // events until the interval is up go into the next record; stopping
+        // cuts it short
+        boost::system_time until =
+            boost::get_system_time() +
+            boost::posix_time::microseconds(this->interval);
+        while (this->run && boost::get_system_time() < until)
+            this->changed.timed_wait(lock, until);
+    }
+}
+
+void PointerDevice::publish()
+{
+    uint8_t* record = &Device::getMemory(*this->mb)[this->recordAddr];
+
+    /* odd sequence, fields, even sequence */
+    write32(record + POINTER_RECORD_SEQUENCE, ++this->sequence);
+    atomic_thread_fence(memory_order_release);
+
+    write16(record + POINTER_RECORD_X, this->x);
+    write16(record + POINTER_RECORD_Y, this->y);
+    record[POINTER_RECORD_BUTTONS] = this->buttons;
+    record[POINTER_RECORD_PRESSED] = this->pressed;
+    write16(record + POINTER_RECORD_WHEEL, this->wheel);
+    atomic_thread_fence(memory_order_release);
+
+    write32(record + POINTER_RECORD_SEQUENCE, ++this->sequence);
+
+    this->pressed = 0;
+    this->pending = false;
+
+    if (!this->interrupting)
+        return;
+    if (InterruptController* ic = this->mb->getInterruptController())
+        ic->interrupt(this->interruptLine);
+}
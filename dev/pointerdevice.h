@@ -0,0 +1,151 @@
+/**
+ * @file    pointerdevice.h
+ *
+ * Matrix VM
+ */
+
+#ifndef POINTERDEVICE_H
+#define POINTERDEVICE_H
+
+#include <machine/device.h>
+
+#include <string>
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/condition_variable.hpp>
+
+/* record, at the start of the reserved memory (big endian):
+    0   4   sequence:  odd while the device writes the record
+    4   2   x, in display pixels
+    6   2   y, in display pixels
+    8   1   POINTER_BUTTON_ flags of the buttons held down
+    9   1   POINTER_BUTTON_ flags of the buttons pressed since the last
+            record, even if they were released again
+   10   2   wheel position:  +1 for a click up, -1 for a click down; wraps */
+#define POINTER_RECORD_SEQUENCE 0
+#define POINTER_RECORD_X        4
+#define POINTER_RECORD_Y        6
+#define POINTER_RECORD_BUTTONS  8
+#define POINTER_RECORD_PRESSED  9
+#define POINTER_RECORD_WHEEL    10
+#define POINTER_DMA_SIZE        12
+
+#define POINTER_BUTTON_LEFT     0x1
+#define POINTER_BUTTON_MIDDLE   0x2
+#define POINTER_BUTTON_RIGHT    0x4
+
+// microseconds between records, unless the guest sets it; 60 per second
+#define POINTER_DEFAULT_INTERVAL    16667
+// longest interval the guest may set
+#define POINTER_MAX_INTERVAL        1000000
+
+#define DEFAULT_POINTER_PORT    4
+/* raised when there is a new record */
+#define POINTER_INT_LINE        5
+
+namespace machine
+{
+
+/**
+ * @class PointerDevice
+ *
+ * Reports the position and buttons of the pointer in the display through a
+ * record in guest memory.
+ *
+ * Display managers report every motion and button event, and the device
+ * publishes the latest state at most once per interval, with one interrupt;
+ * the guest reads the record when it likes.  A click that starts and ends
+ * within one interval still shows in the `pressed` flags of the next record.
+ * The guest writes the interval, in microseconds, to the port; 0 restores
+ * the default, and longer than POINTER_MAX_INTERVAL is cut to it.  Records
+ * interrupt only once the guest has written the port, so that a guest that
+ * never looks at the pointer is not interrupted for it.
+ *
+ * The record is written under a sequence lock:  read `sequence`, the fields,
+ * and `sequence` again, and read again if it changed or was odd.
+ */
+class PointerDevice : public Device
+{
+public:
+
+    /**
+     * @param[in]   interruptLine   Line to interrupt on when there is a new
+     *                              record
+     */
+    PointerDevice(int interruptLine = POINTER_INT_LINE);
+
+    /**
+     * @return  Name of the device
+     */
+    std::string getName() const;
+
+    void init(Motherboard& mb);
+
+    /**
+     * Change the interval between records, and start interrupting for them
+     * @param[in]   what    Microseconds between records, or 0 for the default
+     * @param[in]   port    Ignored
+     */
+    void write(MemAddress what, int port);
+
+    /**
+     * Stops the thread that publishes records
+     * @param[in]   thd     Thread to stop; ignored
+     */
+    void stopThread(boost::thread* thd);
+
+    /**
+     * Report the state of the pointer.  May be called from any thread.
+     * @param[in]   x           Position, in display pixels
+     * @param[in]   y
+     * @param[in]   buttons     POINTER_BUTTON_ flags of the buttons held
+     * @param[in]   wheel       Wheel clicks since the last report; positive
+     *                          for up
+     */
+    void pointerEvent(int x, int y, int buttons, int wheel = 0);
+
+protected:
+
+    /**
+     * Delegate callback to call runPublisher()
+     */
+    static void runPublisher(Device* dev, Motherboard& mb);
+
+    /**
+     * Publishes a record whenever the state changed, then waits out the
+     * interval
+     */
+    void runPublisher();
+
+    /**
+     * Write the state into the record, and interrupt if the guest asked to
+     * be
+     * @pre `mutex` is held
+     */
+    void publish();
+
+private:
+
+    Motherboard*            mb;
+    int                     interruptLine;
+    MemAddress              recordAddr;
+
+    boost::mutex                mutex;
+    boost::condition_variable   changed;
+    bool                        run;
+    bool                        pending;    //<! Changed since the last record
+    MemAddress                  interval;
+    bool                        interrupting;   //<! Port has been written
+
+    /* state, as of the last report */
+    int         x;
+    int         y;
+    int         buttons;
+    int         pressed;    //<! Pressed since the last record
+    uint16_t    wheel;
+    uint32_t    sequence;
+
+};
+
+}   // namespace machine
+
+#endif // POINTERDEVICE_H
@@ -0,0 +1,1107 @@
+#include "rfbdisplaymanager.h"
+#include "pixelconvert.h"
+#include <machine/dirtytracker.h>
+
+#include <string.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <poll.h>
+#include <netdb.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <stdexcept>
+#include <algorithm>
+
+using namespace std;
+using namespace machine;
+
+static const int TILE = DirtyTracker::TILE_SIZE;
+
+#define HEXTILE_SIZE                16
+#define HEXTILE_RAW                 1
+#define HEXTILE_BACKGROUND          2
+#define HEXTILE_FOREGROUND          4
+#define HEXTILE_ANY_SUBRECTS        8
+#define HEXTILE_SUBRECTS_COLOURED   16
+
+/* RFB is big-endian */
+
+static void put8(vector<uint8_t>& out, uint8_t value)
+{
+    out.push_back(value);
+}
+
+static void put16(vector<uint8_t>& out, uint16_t value)
+{
+    out.push_back(value >> 8);
+    out.push_back(value);
+}
+
+static void put32(vector<uint8_t>& out, uint32_t value)
+{
+    out.push_back(value >> 24);
+    out.push_back(value >> 16);
+    out.push_back(value >> 8);
+    out.push_back(value);
+}
+
+static uint16_t get16(const uint8_t* data)
+{
+    return data[0] << 8 | data[1];
+}
+
+static uint32_t get32(const uint8_t* data)
+{
+    return static_cast<uint32_t>( data[0] ) << 24 | data[1] << 16 |
+           data[2] << 8 | data[3];
+}
+
+static bool isHostBigEndian()
+{
+    const uint16_t one = 1;
+    return *reinterpret_cast<const uint8_t*>( &one ) == 0;
+}
+
+/**
+ * Find the key that types a keysym on a US keyboard
+ * @return  X key code of the key, or 0 if there is none
+ */
+static int keysymToKeycode(uint32_t keysym)
+{
+    // X key codes are evdev codes plus 8; these are evdev codes
+    static const struct { const char* keys; int first; } rows[] =
+    {
+        { "1234567890-=",    2 },
+        { "!@#$%^&*()_+",    2 },
+        { "qwertyuiop[]",   16 },
+        { "QWERTYUIOP{}",   16 },
+        { "asdfghjkl;'`",   30 },
+        { "ASDFGHJKL:\"~",  30 },
+        { "\\",             43 },
+        { "|",              43 },
+        { "zxcvbnm,./",     44 },
+        { "ZXCVBNM<>?",     44 },
+        { " ",              57 },
+    };
+    static const struct { uint32_t keysym; int code; } keys[] =
+    {
+        { 0xff08,  14 },    // BackSpace
+        { 0xff09,  15 },    // Tab
+        { 0xff0d,  28 },    // Return
+        { 0xff1b,   1 },    // Escape
+        { 0xff50, 102 },    // Home
+        { 0xff51, 105 },    // Left
+        { 0xff52, 103 },    // Up
+        { 0xff53, 106 },    // Right
+        { 0xff54, 108 },    // Down
+        { 0xff55, 104 },    // Page_Up
+        { 0xff56, 109 },    // Page_Down
+        { 0xff57, 107 },    // End
+        { 0xff63, 110 },    // Insert
+        { 0xff8d,  96 },    // KP_Enter
+        { 0xffe1,  42 },    // Shift_L
+        { 0xffe2,  54 },    // Shift_R
+        { 0xffe3,  29 },    // Control_L
+        { 0xffe4,  97 },    // Control_R
+        { 0xffe5,  58 },    // Caps_Lock
+        { 0xffe7, 125 },    // Meta_L
+        { 0xffe8, 126 },    // Meta_R
+        { 0xffe9,  56 },    // Alt_L
+        { 0xffea, 100 },    // Alt_R
+        { 0xffeb, 125 },    // Super_L
+        { 0xffec, 126 },    // Super_R
+        { 0xffff, 111 },    // Delete
+    };
+
+    if (keysym >= 0x20 && keysym < 0x7f)
+    {
+        for (size_t i = 0; i < sizeof(rows) / sizeof(rows[0]); i++)
+        {
+            const char* key = strchr(rows[i].keys, static_cast<int>( keysym ));
+            if (key)
+                return rows[i].first + (key - rows[i].keys) + 8;
+        }
+        return 0;
+    }
+
+    // F1 to F10, then F11 and F12
+    if (keysym >= 0xffbe && keysym <= 0xffc7)
+        return 59 + (keysym - 0xffbe) + 8;
+    if (keysym == 0xffc8 || keysym == 0xffc9)
+        return 87 + (keysym - 0xffc8) + 8;
+
+    for (size_t i = 0; i < sizeof(keys) / sizeof(keys[0]); i++)
+    {
+        if (keys[i].keysym == keysym)
+            return keys[i].code + 8;
+    }
+    return 0;
+}
+
+RfbDisplayManager::RfbDisplayManager(const string& address)
+: address(address), listenFd(-1), framebuffer(0), ic(0), width(0), height(0),
+  tilesWide(0), tilesHigh(0), paletteSerial(0), toFlush(false), toDestroy(false)
+{
+    this->wakeFds[0] = -1;
+    this->wakeFds[1] = -1;
+}
+
+RfbDisplayManager::~RfbDisplayManager()
+{
+    for (vector<Client*>::size_type i = 0; i < this->clients.size(); i++)
+        this->closeClient(this->clients[i]);
+
+    if (this->listenFd >= 0)
+        close(this->listenFd);
+    if (!this->socketPath.empty())
+        unlink(this->socketPath.c_str());
+    if (this->wakeFds[0] >= 0)
+        close(this->wakeFds[0]);
+    if (this->wakeFds[1] >= 0)
+        close(this->wakeFds[1]);
+}
+
+void RfbDisplayManager::init(
+    const Framebuffer&      framebuffer,
+    InterruptController*    ic
+    )
+{
+    this->framebuffer = &framebuffer;
+    this->ic = ic;
+
+    this->mode      = framebuffer.getMode();
+    this->width     = this->mode.width;
+    this->height    = this->mode.height;
+    this->tilesWide = (this->width  + TILE - 1) / TILE;
+    this->tilesHigh = (this->height + TILE - 1) / TILE;
+    this->canvas.assign(this->width * this->height, 0);
+    this->pending.assign(this->tilesWide * this->tilesHigh, 0);
+    this->palette.resize(FRAMEBUFFER_PALETTE_SIZE);
+    this->paletteSerial = framebuffer.getPalette(&this->palette[0]);
+
+    this->toFlush = false;
+    this->toDestroy = false;
+
+    if (pipe(this->wakeFds) < 0)
+        throw runtime_error("Could not create display event pipe");
+    // a full pipe already wakes the loop, so writers never have to wait
+    fcntl(this->wakeFds[0], F_SETFL, O_NONBLOCK);
+    fcntl(this->wakeFds[1], F_SETFL, O_NONBLOCK);
+
+    this->openSocket();
+}
+
+void RfbDisplayManager::show()
+{
+    vector<struct pollfd> fds;
+
+    while (!this->toDestroy)
+    {
+        fds.resize(2 + this->clients.size());
+        fds[0].fd     = this->wakeFds[0];
+        fds[0].events = POLLIN;
+        fds[1].fd     = this->listenFd;
+        fds[1].events = POLLIN;
+        for (vector<Client*>::size_type i = 0; i < this->clients.size(); i++)
+        {
+            const Client* client = this->clients[i];
+            fds[2 + i].fd     = client->fd;
+            fds[2 + i].events = POLLIN | (client->out.empty() ? 0 : POLLOUT);
+        }
+
+        if (poll(&fds[0], fds.size(), -1) < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            throw runtime_error("Could not wait for RFB viewers");
+        }
+
+        if (fds[0].revents & POLLIN)
+        {
+            char buf[64];
+            while (read(this->wakeFds[0], buf, sizeof(buf)) > 0);
+        }
+        if (this->toDestroy)
+            break;
+
+        /* hand the tiles flushed since the last look to every viewer */
+        if (this->toFlush.exchange(false))
+        {
+            boost::lock_guard<boost::mutex> lock(this->canvasMutex);
+            for (vector<Client*>::size_type i = 0;
+                 i < this->clients.size();
+                 i++)
+            {
+                vector<uint8_t>& dirty = this->clients[i]->dirty;
+                for (vector<uint8_t>::size_type t = 0; t < dirty.size(); t++)
+                    dirty[t] |= this->pending[t];
+            }
+            fill(this->pending.begin(), this->pending.end(), 0);
+        }
+
+        for (vector<Client*>::size_type i = 0; i < this->clients.size(); i++)
+        {
+            Client* client = this->clients[i];
+            bool ok = true;
+            if (fds[2 + i].revents & (POLLIN | POLLHUP | POLLERR))
+                ok = this->readClient(*client);
+            // an update goes out only once the last one has
+            if (ok)
+                ok = this->writeClient(*client);
+            if (ok)
+            {
+                this->sendUpdate(*client);
+                ok = this->writeClient(*client);
+            }
+            if (!ok)
+            {
+                this->closeClient(client);
+                this->clients[i] = 0;
+            }
+        }
+        this->clients.erase(remove(this->clients.begin(), this->clients.end(),
+                                   static_cast<Client*>( 0 )),
+                            this->clients.end());
+
+        if (fds[1].revents & POLLIN)
+            this->acceptClient();
+    }
+
+    while (!this->clients.empty())
+    {
+        this->closeClient(this->clients.back());
+        this->clients.pop_back();
+    }
+}
+
+void RfbDisplayManager::flush(const vector<DirtyRect>& rects)
+{
+    const vector<DirtyRect>* draw = &rects;
+
+    {
+        boost::lock_guard<boost::mutex> lock(this->canvasMutex);
+
+        // a new mode is sent from scratch
+        vector<DirtyRect> all;
+        FramebufferMode mode = this->framebuffer->getMode();
+        if (mode != this->mode)
+        {
+            this->mode = mode;
+            fill(this->canvas.begin(), this->canvas.end(), 0);
+
+            DirtyRect rect;
+            rect.x      = 0;
+            rect.y      = 0;
+            rect.width  = this->width;
+            rect.height = this->height;
+            all.assign(1, rect);
+            draw = &all;
+        }
+        if (this->framebuffer->getPaletteSerial() != this->paletteSerial)
+        {
+            this->paletteSerial =
+                this->framebuffer->getPalette(&this->palette[0]);
+        }
+
+        const uint8_t* pixels =
+            this->framebuffer->getPixels(this->framebuffer->getFrontPage());
+        const int pitch = mode.getPitch();
+        const int bpp   = mode.getBytesPerPixel();
+        for (vector<DirtyRect>::size_type i = 0; i < draw->size(); i++)
+        {
+            const DirtyRect& rect = (*draw)[i];
+            this->markTiles(this->pending,
+                            rect.x, rect.y, rect.width, rect.height);
+
+            int right  = min(rect.x + rect.width,
+                             min(mode.width,  this->width));
+            int bottom = min(rect.y + rect.height,
+                             min(mode.height, this->height));
+            for (int y = rect.y; y < bottom; y++)
+            {
+                if (rect.x >= right)
+                    break;
+                convertToXrgb32(mode.format, pixels + y * pitch + rect.x * bpp,
+                                &this->canvas[y * this->width + rect.x],
+                                right - rect.x, &this->palette[0]);
+            }
+        }
+    }
+
+    // only the first of many flushes needs to wake the loop
+    if (!this->toFlush.exchange(true))
+        this->wake();
+
+    // the frame is copied, so the guest may draw again
+    this->flushed();
+}
+
+void RfbDisplayManager::destroy()
+{
+    this->toDestroy = true; // tell event loop it's time to quit
+    this->wake();
+}
+
+void RfbDisplayManager::openSocket()
+{
+    if (this->address.find('/') != string::npos)
+    {
+        struct sockaddr_un addr;
+        memset(&addr, 0, sizeof(addr));
+        addr.sun_family = AF_UNIX;
+        if (this->address.size() >= sizeof(addr.sun_path))
+        {
+            throw runtime_error("RFB socket path is too long:  " +
+                                this->address);
+        }
+        strcpy(addr.sun_path, this->address.c_str());
+
+        this->listenFd = socket(AF_UNIX, SOCK_STREAM, 0);
+        if (this->listenFd < 0)
+            throw runtime_error("Could not create RFB socket");
+        // a socket left by a VM that crashed is replaced
+        unlink(addr.sun_path);
+        if (bind(this->listenFd, reinterpret_cast<struct sockaddr*>( &addr ),
+                 sizeof(addr)) < 0)
+            throw runtime_error("Could not bind RFB socket " + this->address);
+        this->socketPath = this->address;
+    }
+    else
+    {
+        // PORT, HOST:PORT or [HOST]:PORT; only local viewers, unless asked
+        string host = "127.0.0.1";
+        string port = this->address;
+        string::size_type colon = this->address.rfind(':');
+        if (colon != string::npos)
+        {
+            host = this->address.substr(0, colon);
+            port = this->address.substr(colon + 1);
+            if (host.size() >= 2 &&
+                host[0] == '[' && host[host.size() - 1] == ']')
+                host = host.substr(1, host.size() - 2);
+        }
+
+        struct addrinfo hints;
+        struct addrinfo* info;
+        memset(&hints, 0, sizeof(hints));
+        hints.ai_family   = AF_UNSPEC;
+        hints.ai_socktype = SOCK_STREAM;
+        hints.ai_flags    = AI_PASSIVE | AI_NUMERICSERV;
+        if (getaddrinfo(host.c_str(), port.c_str(), &hints, &info) != 0)
+            throw runtime_error("Invalid RFB address " + this->address);
+
+        for (struct addrinfo* ai = info;
+             ai && this->listenFd < 0;
+             ai = ai->ai_next)
+        {
+            int fd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+            if (fd < 0)
+                continue;
+            int on = 1;
+            setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+            if (bind(fd, ai->ai_addr, ai->ai_addrlen) < 0)
+            {
+                close(fd);
+                continue;
+            }
+            this->listenFd = fd;
+        }
+        freeaddrinfo(info);
+        if (this->listenFd < 0)
+            throw runtime_error("Could not bind RFB address " + this->address);
+    }
+
+    if (listen(this->listenFd, 4) < 0)
+        throw runtime_error("Could not listen on RFB address " + this->address);
+    fcntl(this->listenFd, F_SETFL, O_NONBLOCK);
+
+    if (!this->socketPath.empty())
+    {
+        printf("Serving display over RFB on %s\n", this->socketPath.c_str());
+        return;
+    }
+
+    // say which port was picked, if it was 0
+    struct sockaddr_storage addr;
+    socklen_t length = sizeof(addr);
+    char host[NI_MAXHOST];
+    char port[NI_MAXSERV];
+    struct sockaddr* sa = reinterpret_cast<struct sockaddr*>( &addr );
+    if (getsockname(this->listenFd, sa, &length) == 0 &&
+        getnameinfo(sa, length, host, sizeof(host), port, sizeof(port),
+                    NI_NUMERICHOST | NI_NUMERICSERV) == 0)
+        printf("Serving display over RFB on %s port %s\n", host, port);
+}
+
+void RfbDisplayManager::acceptClient()
+{
+    int fd = accept(this->listenFd, 0, 0);
+    if (fd < 0)
+        return;
+    fcntl(fd, F_SETFL, O_NONBLOCK);
+    // updates are written whole, so don't hold back their last segment
+    int on = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+
+    Client* client = new Client;
+    client->fd       = fd;
+    client->state    = CLIENT_VERSION;
+    client->minor    = 8;
+    client->encoding = RFB_ENCODING_RAW;
+    client->updateRequested = false;
+    client->buttonMask      = 0;
+    client->dirty.assign(this->tilesWide * this->tilesHigh, 1);
+    client->outPos   = 0;
+
+    // viewers start with the format of the canvas
+    PixelFormat& format = client->format;
+    format.bitsPerPixel = 32;
+    format.depth        = 24;
+    format.bigEndian    = isHostBigEndian();
+    format.trueColor    = 1;
+    format.redMax       = 255;
+    format.greenMax     = 255;
+    format.blueMax      = 255;
+    format.redShift     = 16;
+    format.greenShift   = 8;
+    format.blueShift    = 0;
+    client->native      = true;
+
+    static const char version[] = "RFB 003.008\n";
+    client->out.assign(version, version + 12);
+    this->clients.push_back(client);
+}
+
+void RfbDisplayManager::closeClient(Client* client)
+{
+    close(client->fd);
+    delete client;
+}
+
+bool RfbDisplayManager::readClient(Client& client)
+{
+    uint8_t buf[4096];
+    ssize_t n = recv(client.fd, buf, sizeof(buf), 0);
+    if (n == 0)
+        return false;
+    if (n < 0)
+        return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR;
+    client.in.insert(client.in.end(), buf, buf + n);
+
+    vector<uint8_t>::size_type used = 0;
+    while (used < client.in.size())
+    {
+        int length = this->handleMessage(client, &client.in[used],
+                                         client.in.size() - used);
+        if (length < 0)
+            return false;
+        if (length == 0)
+            break;
+        used += length;
+    }
+    client.in.erase(client.in.begin(), client.in.begin() + used);
+    return true;
+}
+
+int RfbDisplayManager::handleMessage(Client& client, const uint8_t* data,
+                                     size_t size)
+{
+    switch (client.state)
+    {
+    case CLIENT_VERSION:
+    {
+        if (size < 12)
+            return 0;
+        char version[13];
+        memcpy(version, data, 12);
+        version[12] = 0;
+        int major, minor;
+        if (sscanf(version, "RFB %3d.%3d\n", &major, &minor) != 2 || major != 3)
+            return -1;
+
+        client.minor = minor >= 8 ? 8 : minor == 7 ? 7 : 3;
+        if (client.minor == 3)
+        {
+            // the server picks the security type
+            put32(client.out, 1);   // None
+            client.state = CLIENT_INIT;
+        }
+        else
+        {
+            put8(client.out, 1);    // number of security types
+            put8(client.out, 1);    // None
+            client.state = CLIENT_SECURITY;
+        }
+        return 12;
+    }
+
+    case CLIENT_SECURITY:
+        if (data[0] != 1)
+            return -1;
+        if (client.minor == 8)
+            put32(client.out, 0);   // SecurityResult:  OK
+        client.state = CLIENT_INIT;
+        return 1;
+
+    case CLIENT_INIT:
+    {
+        // the shared flag does not matter, since every viewer is served
+        static const char name[] = "Matrix VM";
+        const PixelFormat& format = client.format;
+        put16(client.out, this->width);
+        put16(client.out, this->height);
+        put8(client.out, format.bitsPerPixel);
+        put8(client.out, format.depth);
+        put8(client.out, format.bigEndian);
+        put8(client.out, format.trueColor);
+        put16(client.out, format.redMax);
+        put16(client.out, format.greenMax);
+        put16(client.out, format.blueMax);
+        put8(client.out, format.redShift);
+        put8(client.out, format.greenShift);
+        put8(client.out, format.blueShift);
+        put8(client.out, 0);
+        put16(client.out, 0);
+        put32(client.out, sizeof(name) - 1);
+        client.out.insert(client.out.end(), name, name + sizeof(name) - 1);
+        client.state = CLIENT_NORMAL;
+        return 1;
+    }
+
+    case CLIENT_NORMAL:
+        break;
+    }
+
+    switch (data[0])
+    {
+    case 0:     // SetPixelFormat
+        if (size < 20)
+            return 0;
+        return this->setPixelFormat(client, data + 4) ? 20 : -1;
+
+    case 2:     // SetEncodings
+    {
+        if (size < 4)
+            return 0;
+        int count = get16(data + 2);
+        if (size < 4 + 4 * static_cast<size_t>( count ))
+            return 0;
+        this->setEncodings(client, data + 4, count);
+        return 4 + 4 * count;
+    }
+
+    case 3:     // FramebufferUpdateRequest
+        if (size < 10)
+            return 0;
+        // anything but an incremental request wants the area again
+        if (!data[1])
+            this->markTiles(client.dirty, get16(data + 2), get16(data + 4),
+                            get16(data + 6), get16(data + 8));
+        client.updateRequested = true;
+        return 10;
+
+    case 4:     // KeyEvent
+        if (size < 8)
+            return 0;
+        this->sendKey(data[1] != 0, get32(data + 4));
+        return 8;
+
+    case 5:     // PointerEvent
+        if (size < 6)
+            return 0;
+        this->sendPointer(client, data[1], get16(data + 2), get16(data + 4));
+        return 6;
+
+    case 6:     // ClientCutText; the guest has no clipboard
+    {
+        if (size < 8)
+            return 0;
+        uint32_t length = get32(data + 4);
+        if (length > RFB_MAX_MESSAGE)
+            return -1;
+        return size < 8 + length ? 0 : 8 + length;
+    }
+
+    default:
+        return -1;
+    }
+}
+
+bool RfbDisplayManager::writeClient(Client& client)
+{
+    while (client.outPos < client.out.size())
+    {
+        ssize_t n = send(client.fd, &client.out[client.outPos],
+                         client.out.size() - client.outPos, MSG_NOSIGNAL);
+        if (n < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            // the rest goes when poll() says there is room
+            return errno == EAGAIN || errno == EWOULDBLOCK;
+        }
+        client.outPos += n;
+    }
+    client.out.clear();
+    client.outPos = 0;
+    return true;
+}
+
+void RfbDisplayManager::sendUpdate(Client& client)
+{
+    if (client.state != CLIENT_NORMAL || !client.updateRequested ||
+        !client.out.empty())
+        return;
+
+    /* join dirty tiles along each row of tiles into rectangles */
+    this->updateRects.clear();
+    for (int ty = 0;
+         ty < this->tilesHigh && this->updateRects.size() < 0xFFFF;
+         ty++)
+    {
+        uint8_t* row = &client.dirty[ty * this->tilesWide];
+        for (int tx = 0;
+             tx < this->tilesWide && this->updateRects.size() < 0xFFFF;
+             tx++)
+        {
+            if (!row[tx])
+                continue;
+
+            int start = tx;
+            for (; tx < this->tilesWide && row[tx]; tx++)
+                row[tx] = 0;
+
+            DirtyRect rect;
+            rect.x      = start * TILE;
+            rect.y      = ty * TILE;
+            rect.width  = min(tx * TILE, this->width) - rect.x;
+            rect.height = min((ty + 1) * TILE, this->height) - rect.y;
+            this->updateRects.push_back(rect);
+        }
+    }
+    if (this->updateRects.empty())
+        return;
+
+    client.updateRequested = false;
+    put8(client.out, 0);    // FramebufferUpdate
+    put8(client.out, 0);
+    put16(client.out, this->updateRects.size());
+
+    boost::lock_guard<boost::mutex> lock(this->canvasMutex);
+    for (vector<DirtyRect>::size_type i = 0; i < this->updateRects.size(); i++)
+    {
+        const DirtyRect& rect = this->updateRects[i];
+        switch (client.encoding)
+        {
+        case RFB_ENCODING_HEXTILE:
+            this->encodeHextile(client,
+                                rect.x, rect.y, rect.width, rect.height);
+            break;
+        case RFB_ENCODING_RRE:
+            this->encodeRre(client, rect.x, rect.y, rect.width, rect.height);
+            break;
+        default:
+            this->encodeRaw(client, rect.x, rect.y, rect.width, rect.height);
+            break;
+        }
+    }
+}
+
+bool RfbDisplayManager::setPixelFormat(Client& client, const uint8_t* data)
+{
+    PixelFormat format;
+    format.bitsPerPixel = data[0];
+    format.depth        = data[1];
+    format.bigEndian    = data[2] != 0;
+    format.trueColor    = data[3] != 0;
+    format.redMax       = get16(data + 4);
+    format.greenMax     = get16(data + 6);
+    format.blueMax      = get16(data + 8);
+    format.redShift     = data[10];
+    format.greenShift   = data[11];
+    format.blueShift    = data[12];
+
+    if (format.bitsPerPixel != 8 && format.bitsPerPixel != 16 &&
+        format.bitsPerPixel != 32)
+        return false;
+    if (!format.trueColor)
+    {
+        // only 8-bit color maps, which get a fixed RGB332 map
+        if (format.bitsPerPixel != 8)
+            return false;
+        format.redMax     = 7;
+        format.greenMax   = 7;
+        format.blueMax    = 3;
+        format.redShift   = 5;
+        format.greenShift = 2;
+        format.blueShift  = 0;
+
+        put8(client.out, 1);    // SetColourMapEntries
+        put8(client.out, 0);
+        put16(client.out, 0);
+        put16(client.out, 256);
+        for (int i = 0; i < 256; i++)
+        {
+            put16(client.out, (i >> 5) * 0xFFFF / 7);
+            put16(client.out, (i >> 2 & 7) * 0xFFFF / 7);
+            put16(client.out, (i & 3) * 0xFFFF / 3);
+        }
+    }
+    else if (format.redShift > 31 || format.greenShift > 31 ||
+             format.blueShift > 31)
+        return false;
+
+    client.format = format;
+    client.native = format.bitsPerPixel == 32 && format.trueColor &&
+                    (format.bigEndian != 0) == isHostBigEndian() &&
+                    format.redMax == 255 && format.greenMax == 255 &&
+                    format.blueMax == 255 && format.redShift == 16 &&
+                    format.greenShift == 8 && format.blueShift == 0;
+    return true;
+}
+
+void RfbDisplayManager::setEncodings(Client& client, const uint8_t* data,
+                                     int count)
+{
+    // the first encoding in the viewer's list that we have; raw otherwise
+    client.encoding = RFB_ENCODING_RAW;
+    for (int i = 0; i < count; i++)
+    {
+        int32_t encoding = static_cast<int32_t>( get32(data + 4 * i) );
+        if (encoding == RFB_ENCODING_RAW || encoding == RFB_ENCODING_RRE ||
+            encoding == RFB_ENCODING_HEXTILE)
+        {
+            client.encoding = encoding;
+            break;
+        }
+    }
+}
+
+void RfbDisplayManager::markTiles(vector<uint8_t>& dirty, int x, int y,
+                                  int width, int height) const
+{
+    int right  = min(x + width,  this->width);
+    int bottom = min(y + height, this->height);
+    if (x >= right || y >= bottom)
+        return;
+
+    for (int ty = y / TILE; ty <= (bottom - 1) / TILE; ty++)
+    {
+        for (int tx = x / TILE; tx <= (right - 1) / TILE; tx++)
+            dirty[ty * this->tilesWide + tx] = 1;
+    }
+}
+
+void RfbDisplayManager::sendKey(bool down, uint32_t keysym)
+{
+    int keycode = keysymToKeycode(keysym);
+    if (keycode)
+        this->keyEvent(keycode, !down);
+}
+
+void RfbDisplayManager::sendPointer(Client& client, int mask, int x, int y)
+{
+    // buttons 4 and 5 are the wheel; count the presses
+    int wheel = 0;
+    int pressed = mask & ~client.buttonMask;
+    if (pressed & 0x08)
+        wheel++;
+    if (pressed & 0x10)
+        wheel--;
+    client.buttonMask = mask;
+
+    // RFB buttons 1 to 3 are left, middle and right, as ours are
+    this->pointerEvent(min(x, this->width - 1), min(y, this->height - 1),
+                       mask & 0x7, wheel);
+}
+
+void RfbDisplayManager::putRect(Client& client, int x, int y,
+                                int width, int height, int encoding)
+{
+    put16(client.out, x);
+    put16(client.out, y);
+    put16(client.out, width);
+    put16(client.out, height);
+    put32(client.out, encoding);
+}
+
+void RfbDisplayManager::putPixels(Client& client, int x, int y,
+                                  int width, int height)
+{
+    for (int row = y; row < y + height; row++)
+    {
+        const uint32_t* pixels = &this->canvas[row * this->width + x];
+        if (client.native)
+        {
+            const uint8_t* bytes = reinterpret_cast<const uint8_t*>( pixels );
+            client.out.insert(client.out.end(), bytes, bytes + width * 4);
+            continue;
+        }
+        for (int col = 0; col < width; col++)
+            this->putPixel(client, pixels[col]);
+    }
+}
+
+void RfbDisplayManager::putPixel(Client& client, uint32_t color)
+{
+    const PixelFormat& format = client.format;
+    uint32_t r = (color >> 16) & 0xFF;
+    uint32_t g = (color >> 8) & 0xFF;
+    uint32_t b = color & 0xFF;
+    uint32_t pixel = (r * format.redMax   + 127) / 255 << format.redShift   |
+                     (g * format.greenMax + 127) / 255 << format.greenShift |
+                     (b * format.blueMax  + 127) / 255 << format.blueShift;
+
+    switch (format.bitsPerPixel)
+    {
+    case 8:
+        put8(client.out, pixel);
+        break;
+    case 16:
+        if (format.bigEndian)
+            put16(client.out, pixel);
+        else
+        {
+            put8(client.out, pixel);
+            put8(client.out, pixel >> 8);
+        }
+        break;
+    default:
+        if (format.bigEndian)
+            put32(client.out, pixel);
+        else
+        {
+            put8(client.out, pixel);
+            put8(client.out, pixel >> 8);
+            put8(client.out, pixel >> 16);
+            put8(client.out, pixel >> 24);
+        }
+        break;
+    }
+}
+
+void RfbDisplayManager::encodeRaw(Client& client, int x, int y,
+                                  int width, int height)
+{
+    this->putRect(client, x, y, width, height, RFB_ENCODING_RAW);
+    this->putPixels(client, x, y, width, height);
+}
+
+void RfbDisplayManager::encodeRre(Client& client, int x, int y,
+                                  int width, int height)
+{
+    int colors;
+    uint32_t background = this->findRuns(x, y, width, height, colors);
+
+    int subrects = 0;
+    for (vector<Run>::size_type i = 0; i < this->runs.size(); i++)
+        subrects += this->runs[i].color != background;
+
+    // busy areas are smaller raw
+    const int bpp = client.format.bitsPerPixel / 8;
+    if (4 + bpp + subrects * (bpp + 8) >= width * height * bpp)
+    {
+        this->encodeRaw(client, x, y, width, height);
+        return;
+    }
+
+    this->putRect(client, x, y, width, height, RFB_ENCODING_RRE);
+    put32(client.out, subrects);
+    this->putPixel(client, background);
+    for (vector<Run>::size_type i = 0; i < this->runs.size(); i++)
+    {
+        const Run& run = this->runs[i];
+        if (run.color == background)
+            continue;
+        this->putPixel(client, run.color);
+        put16(client.out, run.x);
+        put16(client.out, run.y);
+        put16(client.out, run.width);
+        put16(client.out, run.height);
+    }
+}
+
+void RfbDisplayManager::encodeHextile(Client& client, int x, int y,
+                                      int width, int height)
+{
+    this->putRect(client, x, y, width, height, RFB_ENCODING_HEXTILE);
+
+    // colors carried from tile to tile, if the last tile left them defined
+    bool     haveBackground = false;
+    bool     haveForeground = false;
+    uint32_t lastBackground = 0;
+    uint32_t lastForeground = 0;
+
+    const int bpp = client.format.bitsPerPixel / 8;
+    for (int ty = y; ty < y + height; ty += HEXTILE_SIZE)
+    {
+        for (int tx = x; tx < x + width; tx += HEXTILE_SIZE)
+        {
+            int tw = min(HEXTILE_SIZE, x + width  - tx);
+            int th = min(HEXTILE_SIZE, y + height - ty);
+
+            int colors;
+            uint32_t background = this->findRuns(tx, ty, tw, th, colors);
+            uint32_t foreground = 0;
+            int subrects = 0;
+            for (vector<Run>::size_type i = 0; i < this->runs.size(); i++)
+            {
+                if (this->runs[i].color != background)
+                {
+                    foreground = this->runs[i].color;
+                    subrects++;
+                }
+            }
+
+            /* work out the subencoding, and how big it comes out */
+            int flags = 0;
+            int size  = 1;
+            if (!haveBackground || background != lastBackground)
+            {
+                flags |= HEXTILE_BACKGROUND;
+                size  += bpp;
+            }
+            if (colors == 2)
+            {
+                flags |= HEXTILE_ANY_SUBRECTS;
+                size  += 1 + 2 * subrects;
+                if (!haveForeground || foreground != lastForeground)
+                {
+                    flags |= HEXTILE_FOREGROUND;
+                    size  += bpp;
+                }
+            }
+            else if (colors > 2)
+            {
+                flags |= HEXTILE_ANY_SUBRECTS | HEXTILE_SUBRECTS_COLOURED;
+                size  += 1 + (bpp + 2) * subrects;
+            }
+
+            if (subrects > 255 || size >= 1 + tw * th * bpp)
+            {
+                put8(client.out, HEXTILE_RAW);
+                this->putPixels(client, tx, ty, tw, th);
+                // the next tile must give its colors again
+                haveBackground = false;
+                haveForeground = false;
+                continue;
+            }
+
+            put8(client.out, flags);
+            if (flags & HEXTILE_BACKGROUND)
+            {
+                this->putPixel(client, background);
+                lastBackground = background;
+                haveBackground = true;
+            }
+            if (flags & HEXTILE_FOREGROUND)
+            {
+                this->putPixel(client, foreground);
+                lastForeground = foreground;
+                haveForeground = true;
+            }
+            if (flags & HEXTILE_ANY_SUBRECTS)
+            {
+                put8(client.out, subrects);
+                for (vector<Run>::size_type i = 0; i < this->runs.size(); i++)
+                {
+                    const Run& run = this->runs[i];
+                    if (run.color == background)
+                        continue;
+                    if (flags & HEXTILE_SUBRECTS_COLOURED)
+                        this->putPixel(client, run.color);
+                    put8(client.out, run.x << 4 | run.y);
+                    put8(client.out, (run.width - 1) << 4 | (run.height - 1));
+                }
+            }
+            if (flags & HEXTILE_SUBRECTS_COLOURED)
+                haveForeground = false;
+        }
+    }
+}
+
+uint32_t RfbDisplayManager::findRuns(int x, int y, int width, int height,
+                                     int& colors)
+{
+    this->runs.clear();
+    this->lastRuns.clear();
+
+    for (int row = 0; row < height; row++)
+    {
+        const uint32_t* pixels = &this->canvas[(y + row) * this->width + x];
+        vector<int>::size_type above = 0;
+        this->rowRuns.clear();
+
+        for (int col = 0; col < width; )
+        {
+            uint32_t color = pixels[col];
+            int start = col;
+            while (col < width && pixels[col] == color)
+                col++;
+
+            // grow the run on the row above if it is the same
+            while (above < this->lastRuns.size() &&
+                   this->runs[this->lastRuns[above]].x < start)
+                above++;
+            if (above < this->lastRuns.size())
+            {
+                Run& run = this->runs[this->lastRuns[above]];
+                if (run.x == start && run.width == col - start &&
+                    run.color == color)
+                {
+                    run.height++;
+                    this->rowRuns.push_back(this->lastRuns[above]);
+                    continue;
+                }
+            }
+
+            Run run = { color, start, row, col - start, 1 };
+            this->rowRuns.push_back(this->runs.size());
+            this->runs.push_back(run);
+        }
+        this->lastRuns.swap(this->rowRuns);
+    }
+
+    /* the background is the color that covers the most */
+    this->colorAreas.clear();
+    for (vector<Run>::size_type i = 0; i < this->runs.size(); i++)
+    {
+        const Run& run = this->runs[i];
+        this->colorAreas.push_back(make_pair(run.color,
+                                             run.width * run.height));
+    }
+    sort(this->colorAreas.begin(), this->colorAreas.end());
+
+    uint32_t background = 0;
+    int      most       = 0;
+    colors = 0;
+    for (vector<pair<uint32_t, int> >::size_type i = 0;
+         i < this->colorAreas.size(); )
+    {
+        uint32_t color = this->colorAreas[i].first;
+        int      area  = 0;
+        for (; i < this->colorAreas.size() &&
+               this->colorAreas[i].first == color; i++)
+            area += this->colorAreas[i].second;
+        colors++;
+        if (area > most)
+        {
+            background = color;
+            most       = area;
+        }
+    }
+    return background;
+}
+
+void RfbDisplayManager::wake()
+{
+    char c = 0;
+    if (write(this->wakeFds[1], &c, 1) < 0)
+    {
+        // the pipe is full, so the loop is already awake
+    }
+}
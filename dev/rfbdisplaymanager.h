@@ -0,0 +1,261 @@
+#ifndef RFBDISPLAYMANAGER_H
+#define RFBDISPLAYMANAGER_H
+
+#include "displaymanager.h"
+
+#include <string>
+#include <atomic>
+#include <boost/thread/mutex.hpp>
+
+#define RFB_ENCODING_RAW        0
+#define RFB_ENCODING_RRE        2
+#define RFB_ENCODING_HEXTILE    5
+
+// largest message a client may send; cut text past this closes the client
+#define RFB_MAX_MESSAGE         (1 << 20)
+
+/**
+ * @class RfbDisplayManager
+ *
+ * A display that serves the guest screen to VNC viewers over RFB 3.8 (3.3 and
+ * 3.7 viewers are also accepted), without security.  It listens on a local
+ * TCP port or a UNIX socket, so that a viewer can watch the VM from elsewhere
+ * without forwarding X.
+ *
+ * flush() copies the dirty areas of the front page into a canvas and
+ * completes at once; the thread that the DisplayDevice gives to show() sends
+ * each viewer the 16x16 tiles that changed since its last update, encoded as
+ * the viewer prefers:  hextile, RRE or raw.  A viewer that falls behind gets
+ * the changes of several flushes in one update, so the guest never waits on
+ * the network.  Frames are the size of the mode the display starts in; later
+ * modes are cropped or padded with black to fit.
+ *
+ * Keys that viewers press are mapped from keysyms to the X key codes of a US
+ * keyboard, and delivered to the keyboard as X11DisplayManager's are; the
+ * pointer goes to the pointer device.
+ */
+class RfbDisplayManager : public DisplayManager
+{
+public:
+
+    /**
+     * @param[in]   address     Where to listen:  "PORT" or "HOST:PORT" for TCP
+     *                          (HOST defaults to 127.0.0.1, and port 0 picks
+     *                          a free one), or the path of a UNIX socket, which
+     *                          must contain a '/'
+     */
+    RfbDisplayManager(const std::string& address);
+
+    ~RfbDisplayManager();
+
+    /**
+     * Start listening
+     * @throw   runtime_error if the socket cannot be opened
+     */
+    void init(
+        const machine::Framebuffer&     framebuffer,
+        machine::InterruptController*   ic
+        );
+
+    /**
+     * Serve viewers until the display is destroyed
+     */
+    void show();
+
+    /**
+     * Copy the changed areas of the front page for viewers.  Does not block
+     * on the network.
+     * @param[in]   rects   Areas that changed since the last flush
+     */
+    void flush(const std::vector<machine::DirtyRect>& rects);
+
+    /**
+     * Ask show() to disconnect viewers and return.  Does not block.
+     */
+    void destroy();
+
+protected:
+
+    /** Pixel format of a viewer, as in the RFB PIXEL_FORMAT */
+    struct PixelFormat
+    {
+        uint8_t     bitsPerPixel;
+        uint8_t     depth;
+        uint8_t     bigEndian;
+        uint8_t     trueColor;
+        uint16_t    redMax;
+        uint16_t    greenMax;
+        uint16_t    blueMax;
+        uint8_t     redShift;
+        uint8_t     greenShift;
+        uint8_t     blueShift;
+    };
+
+    enum ClientState
+    {
+        CLIENT_VERSION,     //<! Waiting for the ProtocolVersion
+        CLIENT_SECURITY,    //<! Waiting for the security type
+        CLIENT_INIT,        //<! Waiting for the ClientInit
+        CLIENT_NORMAL       //<! Exchanging messages
+    };
+
+    struct Client
+    {
+        int                     fd;
+        ClientState             state;
+        int                     minor;      //<! Minor protocol version
+        PixelFormat             format;
+        bool                    native;     //<! Format is that of the canvas
+        int                     encoding;   //<! Preferred encoding
+        bool                    updateRequested;
+        int                     buttonMask; //<! Buttons held, as last sent
+        std::vector<uint8_t>    dirty;      //<! 1 per tile not yet sent
+        std::vector<uint8_t>    in;         //<! Received, not yet handled
+        std::vector<uint8_t>    out;        //<! Waiting to be sent
+        std::vector<uint8_t>::size_type outPos;
+    };
+
+    /** A run of one color found in an area, grown downwards where it can be */
+    struct Run
+    {
+        uint32_t    color;
+        int         x;
+        int         y;
+        int         width;
+        int         height;
+    };
+
+    /**
+     * Open the listening socket
+     * @throw   runtime_error if it cannot be opened
+     */
+    void openSocket();
+
+    void acceptClient();
+
+    void closeClient(Client* client);
+
+    /**
+     * Read what a client sent and handle the whole messages in it
+     * @return  false if the client hung up or broke the protocol
+     */
+    bool readClient(Client& client);
+
+    /**
+     * Handle the first message in what a client sent
+     * @param[in]   data    Received bytes, from the start of a message
+     * @param[in]   size    Bytes received
+     * @return  Bytes the message took, 0 if it is not all here yet, or
+     *          negative if the client broke the protocol
+     */
+    int handleMessage(Client& client, const uint8_t* data, size_t size);
+
+    /**
+     * Send a client what is waiting to be sent
+     * @return  false if the client hung up
+     */
+    bool writeClient(Client& client);
+
+    /**
+     * Queue an update of the client's dirty tiles
+     */
+    void sendUpdate(Client& client);
+
+    /**
+     * @param[in]   data    PIXEL_FORMAT the client sent
+     * @return  false if the format cannot be served
+     */
+    bool setPixelFormat(Client& client, const uint8_t* data);
+
+    void setEncodings(Client& client, const uint8_t* data, int count);
+
+    /**
+     * Mark the tiles that an area of the canvas touches
+     * @param[in]   dirty   Tiles to mark in, 1 byte per tile
+     */
+    void markTiles(std::vector<uint8_t>& dirty,
+                   int x, int y, int width, int height) const;
+
+    /**
+     * Deliver a key to the guest
+     * @param[in]   down    Whether the key was pressed, rather than released
+     * @param[in]   keysym  X keysym of the key
+     */
+    void sendKey(bool down, uint32_t keysym);
+
+    /**
+     * Deliver a viewer's pointer to the guest
+     * @param[in]   mask    RFB button mask
+     * @param[in]   x       Position, in pixels
+     * @param[in]   y
+     */
+    void sendPointer(Client& client, int mask, int x, int y);
+
+    /**
+     * Queue the header of a rectangle of an update
+     */
+    void putRect(Client& client, int x, int y, int width, int height,
+                 int encoding);
+
+    /**
+     * Queue an area of the canvas as raw pixels in the client's format
+     */
+    void putPixels(Client& client, int x, int y, int width, int height);
+
+    void putPixel(Client& client, uint32_t color);
+
+    void encodeRaw(Client& client, int x, int y, int width, int height);
+
+    void encodeRre(Client& client, int x, int y, int width, int height);
+
+    void encodeHextile(Client& client, int x, int y, int width, int height);
+
+    /**
+     * Split an area of the canvas into runs of one color, in `runs`
+     * @param[out]  colors  Number of different colors in the area
+     * @return  The color that covers the most of the area
+     */
+    uint32_t findRuns(int x, int y, int width, int height, int& colors);
+
+    /**
+     * Wake the event loop from poll()
+     */
+    void wake();
+
+private:
+
+    std::string address;
+    std::string socketPath;     //<! Path of the UNIX socket, if there is one
+    int         listenFd;
+    int         wakeFds[2];     //<! Pipe that wakes the event loop
+
+    const machine::Framebuffer*     framebuffer;
+    machine::InterruptController*   ic;
+    machine::FramebufferMode        mode;       //<! Mode `canvas` is in
+    int                             width;      //<! Size of served frames
+    int                             height;
+    int                             tilesWide;
+    int                             tilesHigh;
+
+    /* used by flush() only */
+    std::vector<uint32_t>   palette;
+    unsigned                paletteSerial;
+
+    /* shared between flush() and show() */
+    boost::mutex            canvasMutex;
+    std::vector<uint32_t>   canvas;     //<! Front page, as of the last flush
+    std::vector<uint8_t>    pending;    //<! Tiles flushed since show() looked
+    std::atomic<bool>       toFlush;
+    std::atomic<bool>       toDestroy;
+
+    /* used by show() only */
+    std::vector<Client*>    clients;
+    std::vector<machine::DirtyRect>         updateRects;
+    std::vector<Run>                        runs;
+    std::vector<std::pair<uint32_t, int> >  colorAreas;
+    std::vector<int>                        rowRuns;    //<! Runs ending on row
+    std::vector<int>                        lastRuns;   //<! ...on the row above
+
+};
+
+#endif // RFBDISPLAYMANAGER_H
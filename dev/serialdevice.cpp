@@ -0,0 +1,394 @@
+/**
+ * @file    serialdevice.cpp
+ *
+ * Matrix VM
+ */
+
+#include "serialdevice.h"
+#include <dev/interruptcontroller.h>
+#include <machine/guestmemory.h>
+
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+#include <algorithm>
+#include <stdexcept>
+#include <cassert>
+
+using namespace std;
+using namespace machine;
+
+static int64_t milliseconds()
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return static_cast<int64_t>( now.tv_sec ) * 1000 + now.tv_nsec / 1000000;
+}
+
+/**
+ * Describe the bytes from index `from` to `to` of a ring as up to two pieces
+ * @return  Number of pieces
+ */
+static int ringPieces(uint8_t* ring, uint32_t size, uint32_t from, uint32_t to,
+                      struct iovec* iov)
+{
+    uint32_t begin  = from & (size - 1);
+    uint32_t length = to - from;
+    iov[0].iov_base = ring + begin;
+    iov[0].iov_len  = min(length, size - begin);
+    iov[1].iov_base = ring;
+    iov[1].iov_len  = length - iov[0].iov_len;
+    return iov[1].iov_len ? 2 : 1;
+}
+
+/* public SerialDevice */
+
+SerialDevice::SerialDevice(const string& address,
+                           MemAddress ringSize /* = SERIAL_DEFAULT_RING_SIZE */,
+                           int interruptLine /* = SERIAL_INT_LINE */)
+: mb(0), interruptLine(interruptLine), address(address), ringSize(ringSize),
+  ringAddr(0), listenFd(-1), inFd(-1), outFd(-1), isSocket(false), run(false),
+  kicked(false), txHead(0), rxTail(0), txThreshold(0),
+  rxThreshold(ringSize / 2), txTail(0), rxHead(0), rxNotified(0)
+{
+    if (ringSize <= 0 || (ringSize & (ringSize - 1)))
+        throw runtime_error("Serial ring size must be a power of 2");
+
+    this->wakeFds[0] = -1;
+    this->wakeFds[1] = -1;
+}
+
+SerialDevice::~SerialDevice()
+{
+    if (this->isSocket && this->inFd >= 0)
+        close(this->inFd);
+    if (this->listenFd >= 0)
+    {
+        close(this->listenFd);
+        unlink(this->address.c_str());
+    }
+    if (this->wakeFds[0] >= 0)
+        close(this->wakeFds[0]);
+    if (this->wakeFds[1] >= 0)
+        close(this->wakeFds[1]);
+}
+
+string SerialDevice::getName() const
+{
+    return "Serial";
+}
+
+void SerialDevice::init(Motherboard& mb)
+{
+    this->ringAddr = Device::reserveMemIO(mb, *this,
+                                          SERIAL_RINGS + 2 * this->ringSize);
+    if (this->ringAddr < 0)
+        throw runtime_error("Could not request DMA memory for serial");
+
+    if (!Device::requestPort(mb, this, DEFAULT_SERIAL_PORT))
+        throw runtime_error("Could not initiate device port for serial");
+
+    uint8_t* control = &Device::getMemory(mb)[this->ringAddr];
+    write32(control + SERIAL_RX_THRESHOLD, this->rxThreshold);
+    write32(control + SERIAL_RING_SIZE, this->ringSize);
+
+    if (pipe(this->wakeFds) < 0)
+        throw runtime_error("Could not create serial event pipe");
+    // a full pipe already wakes the thread, so the CPU never has to wait
+    fcntl(this->wakeFds[0], F_SETFL, O_NONBLOCK);
+    fcntl(this->wakeFds[1], F_SETFL, O_NONBLOCK);
+
+    this->openHost();
+
+    this->mb  = &mb;
+    this->run = true;
+    mb.requestThread(this, &SerialDevice::runIo);
+}
+
+void SerialDevice::write(MemAddress what, int port)
+{
+    // the guest stores a word a byte at a time, so its indexes are only
+    // read here, on the thread that stored them
+    const uint8_t* control = &Device::getMemory(*this->mb)[this->ringAddr];
+    this->txThreshold.store(read32(control + SERIAL_TX_THRESHOLD),
+                            memory_order_relaxed);
+    this->rxThreshold.store(read32(control + SERIAL_RX_THRESHOLD),
+                            memory_order_relaxed);
+    // release, so that the thread sees the bytes the indexes cover
+    this->txHead.store(read32(control + SERIAL_TX_HEAD), memory_order_release);
+    this->rxTail.store(read32(control + SERIAL_RX_TAIL), memory_order_release);
+
+    if (!this->kicked.exchange(true))
+        this->wake();
+}
+
+void SerialDevice::stopThread(boost::thread* thd)
+{
+    this->run = false;
+    this->wake();
+}
+
+/* protected SerialDevice */
+
+void SerialDevice::runIo(Device* dev, Motherboard& mb)
+{
+    SerialDevice* serial = dynamic_cast<SerialDevice*>( dev );
+    assert(serial);
+
+    serial->runIo();
+}
+
+void SerialDevice::runIo()
+{
+    int64_t rxDeadline = 0;
+
+    while (this->run)
+    {
+        uint32_t txHead = this->txHead.load(memory_order_acquire);
+        uint32_t rxTail = this->rxTail.load(memory_order_acquire);
+
+        struct pollfd fds[4];
+        int nfds = 0;
+        int inIndex = -1, outIndex = -1, listenIndex = -1;
+        fds[nfds].fd     = this->wakeFds[0];
+        fds[nfds].events = POLLIN;
+        nfds++;
+        if (this->inFd >= 0 && this->rxHead - rxTail < this->ringSize)
+        {
+            fds[nfds].fd     = this->inFd;
+            fds[nfds].events = POLLIN;
+            inIndex = nfds++;
+        }
+        if (this->outFd >= 0 && txHead != this->txTail)
+        {
+            fds[nfds].fd     = this->outFd;
+            fds[nfds].events = POLLOUT;
+            outIndex = nfds++;
+        }
+        if (this->listenFd >= 0 && this->inFd < 0)
+        {
+            fds[nfds].fd     = this->listenFd;
+            fds[nfds].events = POLLIN;
+            listenIndex = nfds++;
+        }
+
+        // received bytes short of the threshold wait only so long
+        bool waiting = this->rxHead != this->rxNotified;
+        int timeout = -1;
+        if (waiting)
+            timeout = max<int64_t>(rxDeadline - milliseconds(), 0);
+        int ready = poll(fds, nfds, timeout);
+        if (ready < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            throw runtime_error("Could not wait for serial I/O");
+        }
+
+        bool kicked = false;
+        if (fds[0].revents & POLLIN)
+        {
+            char buf[64];
+            while (read(this->wakeFds[0], buf, sizeof(buf)) > 0);
+            // clear before looking at the rings, so a later write wakes again
+            this->kicked = false;
+            kicked = true;
+        }
+
+        if (listenIndex >= 0 && (fds[listenIndex].revents & POLLIN))
+        {
+            int fd = accept(this->listenFd, 0, 0);
+            if (fd >= 0)
+            {
+                fcntl(fd, F_SETFL, O_NONBLOCK);
+                this->inFd  = fd;
+                this->outFd = fd;
+            }
+        }
+
+        if (inIndex >= 0 && fds[inIndex].revents)
+        {
+            uint32_t received = this->rxHead;
+            this->receive();
+            if (this->rxHead != received)
+                rxDeadline = milliseconds() + SERIAL_RX_TIMEOUT;
+        }
+
+        bool sent = false;
+        bool writable = outIndex >= 0 && fds[outIndex].revents;
+        if (this->outFd >= 0 && (kicked || writable))
+            sent = this->transmit();
+
+        /* one interrupt for everything that crossed a threshold */
+        bool notify = false;
+        if (this->rxHead != this->rxNotified)
+        {
+            rxTail = this->rxTail.load(memory_order_acquire);
+            uint32_t rxThreshold =
+                max<uint32_t>(this->rxThreshold.load(memory_order_relaxed), 1);
+            if (this->rxHead - rxTail >= rxThreshold ||
+                milliseconds() >= rxDeadline)
+                notify = true;
+        }
+        if (sent)
+        {
+            txHead = this->txHead.load(memory_order_acquire);
+            uint32_t txThreshold =
+                this->txThreshold.load(memory_order_relaxed);
+            if (txHead - this->txTail <= txThreshold)
+                notify = true;
+        }
+        if (notify)
+        {
+            this->rxNotified = this->rxHead;
+            if (InterruptController* ic = this->mb->getInterruptController())
+                ic->interrupt(this->interruptLine);
+        }
+    }
+
+    // the machine stopped; send what is left, if the host takes it now
+    while (this->outFd >= 0 && this->transmit());
+}
+
+void SerialDevice::openHost()
+{
+    if (this->address == "-")
+    {
+        this->inFd  = STDIN_FILENO;
+        this->outFd = STDOUT_FILENO;
+        return;
+    }
+
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (this->address.size() >= sizeof(addr.sun_path))
+    {
+        throw runtime_error("Serial socket path is too long:  " +
+                            this->address);
+    }
+    strcpy(addr.sun_path, this->address.c_str());
+
+    this->listenFd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (this->listenFd < 0)
+        throw runtime_error("Could not create serial socket");
+    // a socket left by a VM that crashed is replaced
+    unlink(addr.sun_path);
+    if (bind(this->listenFd, reinterpret_cast<struct sockaddr*>( &addr ),
+             sizeof(addr)) < 0 ||
+        listen(this->listenFd, 1) < 0)
+    {
+        close(this->listenFd);
+        this->listenFd = -1;
+        throw runtime_error("Could not listen on serial socket " +
+                            this->address);
+    }
+    fcntl(this->listenFd, F_SETFL, O_NONBLOCK);
+    this->isSocket = true;
+
+    printf("Serial console on %s\n", this->address.c_str());
+}
+
+bool SerialDevice::transmit()
+{
+    uint8_t* control = &Device::getMemory(*this->mb)[this->ringAddr];
+    // acquire; the bytes must be read after the head that covers them
+    uint32_t txHead = this->txHead.load(memory_order_acquire);
+
+    if (txHead == this->txTail)
+        return false;
+    if (txHead - this->txTail > this->ringSize)
+        this->txTail = txHead - this->ringSize;    // the guest overran its ring
+
+    struct iovec iov[2];
+    int pieces = ringPieces(control + SERIAL_RINGS, this->ringSize,
+                            this->txTail, txHead, iov);
+
+    ssize_t sent;
+    if (this->isSocket)
+    {
+        struct msghdr msg;
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov    = iov;
+        msg.msg_iovlen = pieces;
+        sent = sendmsg(this->outFd, &msg, MSG_NOSIGNAL);
+    }
+    else
+        sent = writev(this->outFd, iov, pieces);
+
+    if (sent < 0)
+    {
+        if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)
+            return false;
+        if (this->isSocket)
+            this->disconnect();
+        else
+            this->outFd = -1;   // output is gone; stop sending
+        return false;
+    }
+
+    this->txTail += sent;
+    // the guest may reuse the bytes once it sees the tail
+    atomic_thread_fence(memory_order_release);
+    write32(control + SERIAL_TX_TAIL, this->txTail);
+    return sent > 0;
+}
+
+void SerialDevice::receive()
+{
+    uint8_t* control = &Device::getMemory(*this->mb)[this->ringAddr];
+    // acquire; the guest is done with the bytes before its tail
+    uint32_t rxTail = this->rxTail.load(memory_order_acquire);
+
+    if (this->rxHead - rxTail >= this->ringSize)
+        return;
+
+    struct iovec iov[2];
+    int pieces = ringPieces(control + SERIAL_RINGS + this->ringSize,
+                            this->ringSize,
+                            this->rxHead, rxTail + this->ringSize, iov);
+
+    ssize_t received = readv(this->inFd, iov, pieces);
+    if (received < 0)
+    {
+        if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)
+            return;
+    }
+    if (received <= 0)
+    {   // end of input
+        if (this->isSocket)
+            this->disconnect();
+        else
+            this->inFd = -1;
+        return;
+    }
+
+    this->rxHead += received;
+    // the bytes must be in place before the guest sees the head
+    atomic_thread_fence(memory_order_release);
+    write32(control + SERIAL_RX_HEAD, this->rxHead);
+}
+
+void SerialDevice::disconnect()
+{
+    close(this->inFd);
+    this->inFd  = -1;
+    this->outFd = -1;
+}
+
+void SerialDevice::wake()
+{
+    if (this->wakeFds[1] >= 0)
+    {
+        char c = 0;
+        if (::write(this->wakeFds[1], &c, 1) < 0)
+            ;   // the pipe is full, so the thread wakes anyway
+    }
+}
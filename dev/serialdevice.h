@@ -0,0 +1,170 @@
+/**
+ * @file    serialdevice.h
+ *
+ * Matrix VM
+ */
+
+#ifndef SERIALDEVICE_H
+#define SERIALDEVICE_H
+
+#include <machine/device.h>
+
+#include <string>
+#include <atomic>
+
+/* rings, at the start of the reserved memory (big endian):
+    0   4   tx head:  bytes queued so far, written by the guest
+    4   4   tx tail:  bytes sent so far, written by the device
+    8   4   rx head:  bytes received so far, written by the device
+   12   4   rx tail:  bytes taken so far, written by the guest
+   16   4   tx threshold:  interrupt once sending leaves this many bytes
+            queued, or fewer; written by the guest
+   20   4   rx threshold:  interrupt once this many bytes are waiting;
+            written by the guest
+   24   4   size of each ring, in bytes; written by the device
+   32   n   tx ring; byte i is at i % size
+   32+n n   rx ring */
+#define SERIAL_TX_HEAD          0
+#define SERIAL_TX_TAIL          4
+#define SERIAL_RX_HEAD          8
+#define SERIAL_RX_TAIL          12
+#define SERIAL_TX_THRESHOLD     16
+#define SERIAL_RX_THRESHOLD     20
+#define SERIAL_RING_SIZE        24
+#define SERIAL_RINGS            32
+
+#define SERIAL_DEFAULT_RING_SIZE    (64 * 1024)
+
+// milliseconds that received bytes short of the threshold wait for more
+#define SERIAL_RX_TIMEOUT       2
+
+#define DEFAULT_SERIAL_PORT     5
+/* raised when a threshold is crossed, or received bytes time out */
+#define SERIAL_INT_LINE         6
+
+namespace machine
+{
+
+/**
+ * @class SerialDevice
+ *
+ * A console that streams bytes between rings in guest memory and the host's
+ * stdin and stdout, or a client of a UNIX socket.
+ *
+ * The guest queues output at the tx head, and takes input from the rx tail
+ * up to the rx head, storing its new indexes; after either, it writes to the
+ * port so the device looks at the rings again.  The device reads the guest's
+ * indexes and thresholds only on those writes.  The device moves bytes
+ * straight between the rings and the host, as many at a time as there are,
+ * and interrupts only when the bytes queued for sending drop to the tx
+ * threshold, or the bytes received reach the rx threshold.  Received bytes
+ * short of the threshold interrupt once no more arrive for
+ * SERIAL_RX_TIMEOUT.
+ *
+ * While the rx ring is full, the device stops reading from the host.  Output
+ * queued while no client is connected to the socket waits for one.
+ */
+class SerialDevice : public Device
+{
+public:
+
+    /**
+     * @param[in]   address         "-" for stdin and stdout, or the path of a
+     *                              UNIX socket to listen on
+     * @param[in]   ringSize        Bytes in each ring; a power of 2
+     * @param[in]   interruptLine   Line to interrupt on
+     */
+    SerialDevice(const std::string& address,
+                 MemAddress ringSize = SERIAL_DEFAULT_RING_SIZE,
+                 int interruptLine = SERIAL_INT_LINE);
+
+    virtual ~SerialDevice();
+
+    /**
+     * @return  Name of the device
+     */
+    std::string getName() const;
+
+    void init(Motherboard& mb);
+
+    /**
+     * Tell the device that the guest has queued output or taken input
+     * @param[in]   what    Ignored
+     * @param[in]   port    Ignored
+     */
+    void write(MemAddress what, int port);
+
+    /**
+     * Stops the thread that moves bytes, once it has sent what it can
+     * @param[in]   thd     Thread to stop; ignored
+     */
+    void stopThread(boost::thread* thd);
+
+protected:
+
+    /**
+     * Delegate callback to call runIo()
+     */
+    static void runIo(Device* dev, Motherboard& mb);
+
+    /**
+     * Moves bytes between the rings and the host until stopped
+     */
+    void runIo();
+
+    /**
+     * Listen on the socket, or use stdin and stdout
+     */
+    void openHost();
+
+    /**
+     * Send what the guest queued, as far as the host takes it
+     * @return  Whether any bytes were sent
+     */
+    bool transmit();
+
+    /**
+     * Read what the host has into the rx ring, as far as there is room
+     */
+    void receive();
+
+    /**
+     * Stop talking to the current client of the socket, and wait for another
+     */
+    void disconnect();
+
+    void wake();
+
+private:
+
+    Motherboard*    mb;
+    int             interruptLine;
+    std::string     address;
+    uint32_t        ringSize;
+    MemAddress      ringAddr;
+
+    int             listenFd;
+    int             inFd;       //<! Negative while there is nothing to read
+    int             outFd;      //<! Negative while there is nowhere to write
+    bool            isSocket;
+    int             wakeFds[2];
+
+    std::atomic<bool>   run;
+    std::atomic<bool>   kicked;     //<! Port written since rings were read
+
+    /* the guest's words, as of its last write to the port */
+    std::atomic<uint32_t>   txHead;
+    std::atomic<uint32_t>   rxTail;
+    std::atomic<uint32_t>   txThreshold;
+    std::atomic<uint32_t>   rxThreshold;
+
+    /* owned by the I/O thread */
+    uint32_t        txTail;
+    uint32_t        rxHead;
+    uint32_t        rxNotified; //<! rxHead as of the last interrupt
+
+};
+
+}   // namespace machine
+
+#endif // SERIALDEVICE_H
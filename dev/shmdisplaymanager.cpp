@@ -0,0 +1,193 @@
+#include "shmdisplaymanager.h"
+#include "pixelconvert.h"
+#include <machine/dirtytracker.h>
+
+#include <string.h>
+#include <limits.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+#include <stdexcept>
+#include <algorithm>
+
+using namespace std;
+using namespace machine;
+
+ShmDisplayManager::ShmDisplayManager(const string& name)
+: name(name), framebuffer(0), paletteSerial(0), segment(0), header(0), dirty(0),
+  pixels(0)
+{ }
+
+ShmDisplayManager::~ShmDisplayManager()
+{
+    if (this->segment)
+    {
+        munmap(this->segment, this->header->size);
+        shm_unlink(this->name.c_str());
+    }
+}
+
+void ShmDisplayManager::init(
+    const Framebuffer&      framebuffer,
+    InterruptController*    ic
+    )
+{
+    this->framebuffer = &framebuffer;
+    this->mode = framebuffer.getMode();
+    this->palette.resize(FRAMEBUFFER_PALETTE_SIZE);
+    this->paletteSerial = framebuffer.getPalette(&this->palette[0]);
+
+    const uint32_t tile      = DirtyTracker::TILE_SIZE;
+    const uint32_t width     = this->mode.width;
+    const uint32_t height    = this->mode.height;
+    const uint32_t tilesWide = (width  + tile - 1) / tile;
+    const uint32_t tilesHigh = (height + tile - 1) / tile;
+    const uint32_t words     = (tilesWide * tilesHigh + 31) / 32;
+
+    // pixels start on a page, so that viewers may map just them
+    const uint32_t page        = sysconf(_SC_PAGESIZE);
+    const uint32_t dirtyOffset = sizeof(ShmFramebufferHeader);
+    const uint32_t pixOffset   = (dirtyOffset + words * 4 + page - 1) /
+                                 page * page;
+    const uint32_t size        = pixOffset + width * height * 4;
+
+    // a segment left by a VM that crashed is replaced
+    shm_unlink(this->name.c_str());
+    int fd = shm_open(this->name.c_str(), O_RDWR | O_CREAT | O_EXCL, 0644);
+    if (fd < 0)
+        throw runtime_error("Could not create shared memory " + this->name);
+    if (ftruncate(fd, size) < 0)
+    {
+        close(fd);
+        shm_unlink(this->name.c_str());
+        throw runtime_error("Could not size shared memory " + this->name);
+    }
+    void* segment = mmap(0, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (segment == MAP_FAILED)
+    {
+        shm_unlink(this->name.c_str());
+        throw runtime_error("Could not map shared memory " + this->name);
+    }
+
+    uint8_t* bytes = static_cast<uint8_t*>( segment );
+    this->segment = segment;
+    this->header  = static_cast<ShmFramebufferHeader*>( segment );
+    this->dirty   = reinterpret_cast<uint32_t*>( bytes + dirtyOffset );
+    this->pixels  = reinterpret_cast<uint32_t*>( bytes + pixOffset );
+
+    // the segment is zeroed, so the sequence starts out even
+    ShmFramebufferHeader* h = this->header;
+    h->width        = width;
+    h->height       = height;
+    h->maxWidth     = width;
+    h->maxHeight    = height;
+    h->pitch        = width * 4;
+    h->tileSize     = tile;
+    h->tilesWide    = tilesWide;
+    h->tilesHigh    = tilesHigh;
+    h->dirtyOffset  = dirtyOffset;
+    h->pixelsOffset = pixOffset;
+    h->size         = size;
+    h->version      = SHMFB_VERSION;
+    // publish the magic last; viewers check it first
+    atomic_thread_fence(memory_order_release);
+    h->magic        = SHMFB_MAGIC;
+
+    printf("Publishing display in shared memory %s\n", this->name.c_str());
+}
+
+void ShmDisplayManager::show()
+{
+}
+
+void ShmDisplayManager::flush(const vector<DirtyRect>& rects)
+{
+    ShmFramebufferHeader* h = this->header;
+    const vector<DirtyRect>* draw = &rects;
+
+    // a new mode is published from scratch
+    vector<DirtyRect> all;
+    FramebufferMode mode = this->framebuffer->getMode();
+    bool newMode = mode != this->mode;
+    if (newMode)
+    {
+        this->mode = mode;
+
+        DirtyRect rect;
+        rect.x      = 0;
+        rect.y      = 0;
+        rect.width  = mode.width;
+        rect.height = mode.height;
+        all.assign(1, rect);
+        draw = &all;
+    }
+    if (this->framebuffer->getPaletteSerial() != this->paletteSerial)
+        this->paletteSerial = this->framebuffer->getPalette(&this->palette[0]);
+
+    const int width  = min<int>(mode.width,  h->maxWidth);
+    const int height = min<int>(mode.height, h->maxHeight);
+    const int tile   = h->tileSize;
+
+    /* write the frame under the sequence lock */
+    uint32_t seq = h->sequence.load(memory_order_relaxed);
+    h->sequence.store(seq + 1, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+
+    memset(this->dirty, 0, (h->tilesWide * h->tilesHigh + 31) / 32 * 4);
+    if (newMode)
+        memset(this->pixels, 0, h->pitch * h->maxHeight);
+    h->width  = width;
+    h->height = height;
+
+    const uint8_t* src   =
+        this->framebuffer->getPixels(this->framebuffer->getFrontPage());
+    const int      pitch = mode.getPitch();
+    const int      bpp   = mode.getBytesPerPixel();
+    for (vector<DirtyRect>::size_type i = 0; i < draw->size(); i++)
+    {
+        const DirtyRect& rect = (*draw)[i];
+        int right  = min(rect.x + rect.width,  width);
+        int bottom = min(rect.y + rect.height, height);
+        if (rect.x >= right || rect.y >= bottom)
+            continue;
+
+        for (int y = rect.y; y < bottom; y++)
+            convertToXrgb32(mode.format, src + y * pitch + rect.x * bpp,
+                            this->pixels + y * h->maxWidth + rect.x,
+                            right - rect.x, &this->palette[0]);
+
+        for (int ty = rect.y / tile; ty <= (bottom - 1) / tile; ty++)
+        {
+            for (int tx = rect.x / tile; tx <= (right - 1) / tile; tx++)
+            {
+                int bit = ty * h->tilesWide + tx;
+                this->dirty[bit / 32] |= 1u << (bit % 32);
+            }
+        }
+    }
+
+    h->frame++;
+    h->sequence.store(seq + 2, memory_order_release);
+    this->wakeViewers();
+
+    this->flushed();
+}
+
+void ShmDisplayManager::destroy()
+{
+    if (!this->header)
+        return;
+    this->header->closed.store(1, memory_order_release);
+    // bump the sequence too, so that waiting viewers see the change
+    this->header->sequence.fetch_add(2, memory_order_release);
+    this->wakeViewers();
+}
+
+void ShmDisplayManager::wakeViewers()
+{
+    // viewers are other processes, so this cannot be a private futex
+    syscall(SYS_futex, &this->header->sequence, FUTEX_WAKE, INT_MAX, 0, 0, 0);
+}
@@ -0,0 +1,80 @@
+#ifndef SHMDISPLAYMANAGER_H
+#define SHMDISPLAYMANAGER_H
+
+#include "displaymanager.h"
+#include "shmframebuffer.h"
+
+#include <string>
+
+/**
+ * @class ShmDisplayManager
+ *
+ * A headless display that publishes frames in POSIX shared memory, so that a
+ * viewer process on the same host can show them without the VM talking to a
+ * display server.  See shmframebuffer.h for the layout.
+ *
+ * Each flush converts the dirty areas of the front page into the segment and
+ * wakes waiting viewers; nothing blocks on a viewer.  The segment is the size
+ * of the mode the display starts in; later modes are cropped to fit.  It is
+ * unlinked when the display is destroyed.
+ */
+class ShmDisplayManager : public DisplayManager
+{
+public:
+
+    /**
+     * @param[in]   name    Name of the segment, as for shm_open(), e.g.
+     *                      "/matrixvm"
+     */
+    ShmDisplayManager(const std::string& name);
+
+    ~ShmDisplayManager();
+
+    /**
+     * Create and map the segment
+     * @throw   runtime_error if it cannot be created
+     */
+    void init(
+        const machine::Framebuffer&     framebuffer,
+        machine::InterruptController*   ic
+        );
+
+    void show();
+
+    /**
+     * Publish the changed areas of the front page as a new frame
+     * @param[in]   rects   Areas that changed since the last flush
+     */
+    void flush(const std::vector<machine::DirtyRect>& rects);
+
+    /**
+     * Tell viewers that the VM is gone
+     */
+    void destroy();
+
+protected:
+
+    /**
+     * Wake viewers that wait on the sequence
+     */
+    void wakeViewers();
+
+private:
+
+    std::string name;
+
+    const machine::Framebuffer* framebuffer;
+    machine::FramebufferMode    mode;       //<! Mode of the published frame
+
+    std::vector<uint32_t>       palette;
+    unsigned                    paletteSerial;
+
+    /* the segment */
+    void*                   segment;
+    ShmFramebufferHeader*   header;
+    uint32_t*               dirty;
+    uint32_t*               pixels;
+
+};
+
+#endif // SHMDISPLAYMANAGER_H
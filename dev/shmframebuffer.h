@@ -0,0 +1,57 @@
+/**
+ * @file    shmframebuffer.h
+ *
+ * Matrix VM
+ *
+ * Layout of the shared memory that ShmDisplayManager publishes frames in.
+ * Viewers include this header, shm_open() the segment read-only and map it.
+ */
+
+#ifndef SHMFRAMEBUFFER_H
+#define SHMFRAMEBUFFER_H
+
+#include <stdint.h>
+#include <atomic>
+
+#define SHMFB_MAGIC     0x4246564D  // "MVFB"
+#define SHMFB_VERSION   1
+
+/**
+ * Start of the segment.  Offsets are from the start of the segment, and all
+ * values are in host byte order.
+ *
+ * The frame is published under a sequence lock:  `sequence` is odd while a
+ * frame is being written, and is bumped to the next even number when it is
+ * done.  A viewer reads `sequence`, waits while it is odd, copies what it
+ * needs, and tries again if `sequence` changed meanwhile.  To sleep until the
+ * next frame, wait on `sequence` with FUTEX_WAIT (not FUTEX_WAIT_PRIVATE);
+ * each frame is woken with FUTEX_WAKE.
+ *
+ * The dirty bitmap has the tiles that changed in frame `frame` only.  A
+ * viewer that missed a frame should redraw everything.
+ */
+struct ShmFramebufferHeader
+{
+    uint32_t                magic;          //!< SHMFB_MAGIC
+    uint32_t                version;        //!< SHMFB_VERSION
+    std::atomic<uint32_t>   sequence;       //!< Sequence lock and futex word
+    std::atomic<uint32_t>   closed;         //!< Nonzero once the VM is gone
+    uint64_t                frame;          //!< Frames published so far
+
+    uint32_t    width;          //!< Pixels wide of the current frame
+    uint32_t    height;         //!< Pixels tall of the current frame
+    uint32_t    maxWidth;       //!< Pixels wide that the segment has room for
+    uint32_t    maxHeight;      //!< Pixels tall that the segment has room for
+    uint32_t    pitch;          //!< Bytes between rows of pixels
+
+    uint32_t    tileSize;       //!< Pixels wide and tall of a dirty tile
+    uint32_t    tilesWide;      //!< Tiles per row of the bitmap
+    uint32_t    tilesHigh;      //!< Rows of tiles in the bitmap
+
+    uint32_t    dirtyOffset;    //!< Bitmap:  1 bit per tile, row by row, in
+                                //!< 32-bit words, lowest bit first
+    uint32_t    pixelsOffset;   //!< Pixels:  XRGB32 (0x00RRGGBB)
+    uint32_t    size;           //!< Bytes in the segment
+};
+
+#endif // SHMFRAMEBUFFER_H
@@ -0,0 +1,243 @@
+/**
+ * @file    tileengine.cpp
+ *
+ * Matrix VM
+ */
+
+#include "tileengine.h"
+#include <dev/interruptcontroller.h>
+#include <machine/dirtytracker.h>
+#include <machine/guestmemory.h>
+
+#include <string.h>
+#include <stdexcept>
+
+using namespace std;
+using namespace machine;
+
+// declared, but not defined, in device.h
+SLDECL Device* createDevice(void* args)
+{
+    if (TileEngineArgs* teArgs = reinterpret_cast<TileEngineArgs*>( args ))
+        return new TileEngine(teArgs->interruptLine);
+    else
+        return new TileEngine;
+}
+
+/* public TileEngine */
+
+TileEngine::TileEngine(int interruptLine /* = TILE_INT_LINE */)
+: mb(0), interruptLine(interruptLine), memory(0)
+{ }
+
+string TileEngine::getName() const
+{
+    return "TileEngine";
+}
+
+void TileEngine::init(Motherboard& mb)
+{
+    this->mb = &mb;
+
+    MemAddress dmaLoc = Device::reserveMemIO(mb, *this, TILE_CTRL_SIZE);
+    if (dmaLoc < 0)
+        throw runtime_error("Could not request DMA memory for tile engine");
+    else
+        this->mappingAddr = dmaLoc;
+
+    if (!Device::requestPort(mb, this, DEFAULT_TILE_PORT))
+        throw runtime_error("Could not initiate device port for tile engine");
+}
+
+void TileEngine::write(MemAddress what, int port)
+{
+    int status = this->render();
+
+    uint8_t* ctrl = &Device::getMemory(*this->mb)[this->mappingAddr];
+    ctrl[TILE_CTRL_STATUS + 0] = 0;
+    ctrl[TILE_CTRL_STATUS + 1] = 0;
+    ctrl[TILE_CTRL_STATUS + 2] = 0;
+    ctrl[TILE_CTRL_STATUS + 3] = status;
+
+    InterruptController* ic = this->mb->getInterruptController();
+    if (ic && this->interruptLine >= 0)
+        ic->interrupt(this->interruptLine);
+}
+
+PortMode TileEngine::getPortMode(int port) const
+{
+    return PORT_POSTED;
+}
+
+/* protected TileEngine */
+
+int TileEngine::render()
+{
+    this->memory = &Device::getMemory(*this->mb)[0];
+    const uint8_t* ctrl = this->memory + this->mappingAddr;
+
+    this->target       = read32(ctrl + TILE_CTRL_TARGET);
+    this->targetWidth  = read16(ctrl + TILE_CTRL_TARGET_WIDTH);
+    this->targetHeight = read16(ctrl + TILE_CTRL_TARGET_HEIGHT);
+    this->bpp          = ctrl[TILE_CTRL_BPP];
+    this->tileSize     = ctrl[TILE_CTRL_TILE_SIZE];
+    // the transparent color is in the low bytes of its word
+    if (this->bpp >= 1 && this->bpp <= 3)
+    {
+        memcpy(this->colorKey, ctrl + TILE_CTRL_COLOR_KEY + 4 - this->bpp,
+               this->bpp);
+    }
+
+    int64_t targetBytes = static_cast<int64_t>( this->targetWidth ) *
+                          this->targetHeight * this->bpp;
+    if (this->bpp < 1 || this->bpp > 3 ||
+        !inMemory(this->target, targetBytes, this->mb->getMemorySize()))
+        return TILE_STATUS_BAD_TARGET;
+
+    if (read32(ctrl + TILE_CTRL_MAP))
+    {
+        int status = this->renderMap();
+        if (status != TILE_STATUS_DONE)
+            return status;
+    }
+
+    MemAddress sprites = read32(ctrl + TILE_CTRL_SPRITES);
+    int        count   = read16(ctrl + TILE_CTRL_SPRITE_COUNT);
+    if (!inMemory(sprites, count * TILE_SPRITE_SIZE,
+                  this->mb->getMemorySize()))
+        return TILE_STATUS_BAD_SPRITE;
+    for (int i = 0; i < count; i++)
+    {
+        int status = this->renderSprite(sprites + i * TILE_SPRITE_SIZE);
+        if (status != TILE_STATUS_DONE)
+            return status;
+    }
+
+    return TILE_STATUS_DONE;
+}
+
+int TileEngine::renderMap()
+{
+    const uint8_t* ctrl = this->memory + this->mappingAddr;
+
+    MemAddress map       = read32(ctrl + TILE_CTRL_MAP);
+    MemAddress tiles     = read32(ctrl + TILE_CTRL_TILES);
+    int        mapWidth  = read16(ctrl + TILE_CTRL_MAP_WIDTH);
+    int        mapHeight = read16(ctrl + TILE_CTRL_MAP_HEIGHT);
+    int        scrollX   =
+        static_cast<int16_t>( read16(ctrl + TILE_CTRL_SCROLL_X) );
+    int        scrollY   =
+        static_cast<int16_t>( read16(ctrl + TILE_CTRL_SCROLL_Y) );
+
+    const int ts        = this->tileSize;
+    const int tileBytes = ts * ts * this->bpp;
+    if (!ts || !mapWidth || !mapHeight ||
+        !inMemory(map, static_cast<int64_t>( mapWidth ) * mapHeight * 2,
+                  this->mb->getMemorySize()) ||
+        !inMemory(tiles, tileBytes, this->mb->getMemorySize()))
+        return TILE_STATUS_BAD_MAP;
+
+    // tile numbers at or past this would read outside of memory
+    int64_t numTiles = (this->mb->getMemorySize() -
+                        static_cast<int64_t>( tiles )) / tileBytes;
+
+    const int pixelsWide = mapWidth  * ts;
+    const int pixelsHigh = mapHeight * ts;
+    const int startX     = ((scrollX % pixelsWide) + pixelsWide) % pixelsWide;
+    int       my         = ((scrollY % pixelsHigh) + pixelsHigh) % pixelsHigh;
+
+    uint8_t* dst = this->memory + this->target;
+    for (int y = 0; y < this->targetHeight; y++, my = (my + 1) % pixelsHigh)
+    {
+        const uint8_t* mapRow  = this->memory + map + (my / ts) * mapWidth * 2;
+        const int      tileRow = (my % ts) * ts;
+
+        // copy each tile's part of the row at once
+        int mx = startX;
+        int x  = 0;
+        while (x < this->targetWidth)
+        {
+            int tile = read16(mapRow + (mx / ts) * 2);
+            if (tile >= numTiles)
+                return TILE_STATUS_BAD_MAP;
+
+            int col  = mx % ts;
+            int span = min(ts - col, this->targetWidth - x);
+            const uint8_t* src = this->memory + tiles + tile * tileBytes +
+                                 (tileRow + col) * this->bpp;
+            memcpy(dst, src, span * this->bpp);
+
+            dst += span * this->bpp;
+            x   += span;
+            mx   = (mx + span) % pixelsWide;
+        }
+    }
+
+    this->markDirty(this->target,
+                    this->targetWidth * this->targetHeight * this->bpp);
+    return TILE_STATUS_DONE;
+}
+
+int TileEngine::renderSprite(MemAddress sprite)
+{
+    const uint8_t* desc = this->memory + sprite;
+
+    int        x      = static_cast<int16_t>( read16(desc + 0) );
+    int        y      = static_cast<int16_t>( read16(desc + 2) );
+    int        width  = read16(desc + 4);
+    int        height = read16(desc + 6);
+    MemAddress pixels = read32(desc + 8);
+    int        flags  = desc[12];
+
+    if (!(flags & TILE_SPRITE_VISIBLE))
+        return TILE_STATUS_DONE;
+    if (!inMemory(pixels, static_cast<int64_t>( width ) * height * this->bpp,
+                  this->mb->getMemorySize()))
+        return TILE_STATUS_BAD_SPRITE;
+
+    // clip to the target
+    int left   = max(x, 0);
+    int right  = min(x + width, this->targetWidth);
+    int top    = max(y, 0);
+    int bottom = min(y + height, this->targetHeight);
+    if (left >= right || top >= bottom)
+        return TILE_STATUS_DONE;
+
+    const int  bpp    = this->bpp;
+    const bool keyed  = flags & TILE_SPRITE_KEYED;
+    const bool flipX  = flags & TILE_SPRITE_FLIP_X;
+    for (int ty = top; ty < bottom; ty++)
+    {
+        int sy = flags & TILE_SPRITE_FLIP_Y ? height - 1 - (ty - y) : ty - y;
+        const uint8_t* src = this->memory + pixels + sy * width * bpp;
+        uint8_t*       dst = this->memory + this->target +
+                             (ty * this->targetWidth + left) * bpp;
+
+        if (!keyed && !flipX)
+        {
+            memcpy(dst, src + (left - x) * bpp, (right - left) * bpp);
+        }
+        else
+        {
+            for (int tx = left; tx < right; tx++, dst += bpp)
+            {
+                int sx = flipX ? width - 1 - (tx - x) : tx - x;
+                const uint8_t* p = src + sx * bpp;
+                if (!keyed || memcmp(p, this->colorKey, bpp))
+                    memcpy(dst, p, bpp);
+            }
+        }
+
+        this->markDirty(this->target + (ty * this->targetWidth + left) * bpp,
+                        (right - left) * bpp);
+    }
+
+    return TILE_STATUS_DONE;
+}
+
+void TileEngine::markDirty(MemAddress addr, MemAddress len)
+{
+    const vector<DirtyTracker*>& trackers = this->mb->getDirtyTrackers();
+    for (vector<DirtyTracker*>::size_type i = 0; i < trackers.size(); i++)
+        trackers[i]->mark(addr, len);
+}
@@ -0,0 +1,183 @@
+/**
+ * @file    tileengine.h
+ *
+ * Matrix VM
+ */
+
+#ifndef TILEENGINE_H
+#define TILEENGINE_H
+
+#include <machine/device.h>
+
+#include <string>
+
+/* control block, at the start of the reserved memory (big endian):
+    0   4   address of the first pixel to render into
+    4   2   target width, in pixels
+    6   2   target height, in pixels
+    8   1   bytes per pixel:  1, 2 or 3
+    9   1   tile size, in pixels; tiles are square
+   10   2   map width, in tiles
+   12   2   map height, in tiles
+   14   2   horizontal scroll, in pixels (signed)
+   16   2   vertical scroll, in pixels (signed)
+   18   2   number of sprites
+   20   4   address of the map:  a 2-byte tile number per tile, row by row;
+            0 for no background
+   24   4   address of the tiles:  the pixels of each tile, row by row
+   28   4   address of the sprite table
+   32   4   transparent color, in the low bytes
+   36   4   status, written by the device:  a TILE_STATUS_ value */
+#define TILE_CTRL_TARGET        0
+#define TILE_CTRL_TARGET_WIDTH  4
+#define TILE_CTRL_TARGET_HEIGHT 6
+#define TILE_CTRL_BPP           8
+#define TILE_CTRL_TILE_SIZE     9
+#define TILE_CTRL_MAP_WIDTH     10
+#define TILE_CTRL_MAP_HEIGHT    12
+#define TILE_CTRL_SCROLL_X      14
+#define TILE_CTRL_SCROLL_Y      16
+#define TILE_CTRL_SPRITE_COUNT  18
+#define TILE_CTRL_MAP           20
+#define TILE_CTRL_TILES         24
+#define TILE_CTRL_SPRITES       28
+#define TILE_CTRL_COLOR_KEY     32
+#define TILE_CTRL_STATUS        36
+#define TILE_CTRL_SIZE          40
+
+/* sprite, in the sprite table (big endian):
+    0   2   x (signed)
+    2   2   y (signed)
+    4   2   width, in pixels
+    6   2   height, in pixels
+    8   4   address of the pixels, row by row
+   12   1   TILE_SPRITE_ flags
+   13   3   padding */
+#define TILE_SPRITE_SIZE        16
+
+#define TILE_SPRITE_VISIBLE     0x1
+#define TILE_SPRITE_KEYED       0x2     // skip pixels of the transparent color
+#define TILE_SPRITE_FLIP_X      0x4
+#define TILE_SPRITE_FLIP_Y      0x8
+
+#define TILE_STATUS_DONE        0
+#define TILE_STATUS_BAD_TARGET  1       // target is not in memory
+#define TILE_STATUS_BAD_MAP     2       // map or tiles are not in memory
+#define TILE_STATUS_BAD_SPRITE  3       // a sprite is not in memory
+
+#define DEFAULT_TILE_PORT       9
+/* raised when a frame has been rendered */
+#define TILE_INT_LINE           4
+
+namespace machine
+{
+
+struct TileEngineArgs
+{
+    int interruptLine;  //!< Negative for no completion interrupt
+
+    TileEngineArgs()
+    : interruptLine(TILE_INT_LINE)
+    { }
+};
+
+/**
+ * @class TileEngine
+ *
+ * A device that renders a scrolling tile map and sprites into a pixel buffer
+ * in guest memory, so that the guest does not have to compose frames pixel by
+ * pixel.
+ *
+ * The guest fills in the control block, the map, the tiles and the sprite
+ * table, then writes to the port.  The frame is rendered on a host thread,
+ * while the CPU keeps running.  When it is done, the device writes the status
+ * into the control block and interrupts, after which the guest may change
+ * the descriptors again.  The rendered pixels are marked dirty, so a flush of
+ * the DisplayDevice draws them when the target is one of its pages.
+ *
+ * Tiles, sprites and the target are all in the same pixel format; the engine
+ * only needs to know how many bytes a pixel has.  The map wraps around when
+ * scrolled.  Sprites are drawn over the map in table order, and clipped to
+ * the target.
+ */
+class TileEngine : public Device
+{
+public:
+
+    /**
+     * @param[in]   interruptLine   Line to interrupt on when a frame has been
+     *                              rendered, or negative for none
+     */
+    TileEngine(int interruptLine = TILE_INT_LINE);
+
+    virtual ~TileEngine() { }
+
+    /**
+     * @return  Name of the device
+     */
+    virtual std::string getName() const;
+
+    virtual void init(Motherboard& mb);
+
+    /**
+     * Render a frame as the control block describes it
+     * @param[in]   what    Ignored
+     * @param[in]   port    Ignored
+     */
+    virtual void write(MemAddress what, int port);
+
+    /**
+     * @param[in]   port    Ignored
+     * @return  PORT_POSTED; frames are rendered off the CPU thread
+     */
+    virtual PortMode getPortMode(int port) const;
+
+protected:
+
+    /**
+     * Render a frame
+     * @return  A TILE_STATUS_ value
+     */
+    int render();
+
+    /**
+     * Draw the map over the whole target
+     * @return  A TILE_STATUS_ value
+     */
+    int renderMap();
+
+    /**
+     * Draw one sprite
+     * @param[in]   sprite  Address of the sprite in the sprite table
+     * @return  A TILE_STATUS_ value
+     */
+    int renderSprite(MemAddress sprite);
+
+    /**
+     * Mark rendered pixels as dirty
+     * @param[in]   addr
+     * @param[in]   len
+     */
+    void markDirty(MemAddress addr, MemAddress len);
+
+private:
+
+    Motherboard* mb;
+
+    int interruptLine;
+
+    MemAddress mappingAddr; //<! The DMA address of the obtained reserved memory
+
+    /* the frame being rendered, read from the control block */
+    uint8_t*    memory;
+    MemAddress  target;
+    int         targetWidth;
+    int         targetHeight;
+    int         bpp;
+    int         tileSize;
+    uint8_t     colorKey[4];
+};
+
+}   // namespace machine
+
+#endif // TILEENGINE_H
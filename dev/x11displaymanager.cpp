@@ -1,48 +1,126 @@
 #include "x11displaymanager.h"
+#include "pixelconvert.h"
 
 #include <string.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
 #include <stdexcept>
+#include <algorithm>
+#if HAVE_XSHM
+#  include <sys/ipc.h>
+#  include <sys/shm.h>
+#endif
 
 using namespace std;
+using namespace machine;
+
+#if HAVE_XSHM
+static bool shmAttachFailed;
+
+/**
+ * Catches the error generated when the X server cannot attach to our shared
+ * memory, which happens when the display is remote
+ */
+static int shmErrorHandler(Display* display, XErrorEvent* error)
+{
+    shmAttachFailed = true;
+    return 0;
+}
+#endif
+
+/**
+ * Place an 8-bit color channel in the bits of a visual's mask
+ */
+static unsigned long toMask(unsigned long channel, unsigned long mask)
+{
+    if (!mask)
+        return 0;
+
+    int shift = 0;
+    while (!((mask >> shift) & 1))
+        shift++;
+    int bits = 0;
+    while ((mask >> (shift + bits)) & 1)
+        bits++;
+
+    channel = bits >= 8 ? channel << (bits - 8) : channel >> (8 - bits);
+    return (channel << shift) & mask;
+}
+
+X11DisplayManager::X11DisplayManager(int scale /* = 1 */)
+: scale(scale < 1 ? 1 : scale), buttons(0), toFlush(false), toDestroy(false),
+  dirtyAll(false)
+{
+    this->wakeFds[0] = -1;
+    this->wakeFds[1] = -1;
+}
+
+X11DisplayManager::~X11DisplayManager()
+{
+    if (this->wakeFds[0] >= 0)
+        close(this->wakeFds[0]);
+    if (this->wakeFds[1] >= 0)
+        close(this->wakeFds[1]);
+}
 
 void X11DisplayManager::init(
-    std::vector<uint8_t>&           memory,
-    MemAddress                      videoAddress,
-    machine::InterruptController*   ic,
-    int                             width,
-    int                             height
+    const Framebuffer&              framebuffer,
+    machine::InterruptController*   ic
     )
 {
-    this->memory = &memory;
-    this->videoAddress = videoAddress;
+    this->framebuffer = &framebuffer;
     this->ic = ic;
 
-    this->width  = width;
-    this->height = height;
+    this->mode = framebuffer.getMode();
+    this->rowBuffer.resize(this->mode.width);
+    this->paletteSerial = framebuffer.getPalette(this->palette);
 
-    this->toFlush = true;
+    this->toFlush = false;  // the event loop draws once when it starts
     this->toDestroy = false;
 
+    if (pipe(this->wakeFds) < 0)
+        throw runtime_error("Could not create display event pipe");
+    // a full pipe already wakes the loop, so writers never have to wait
+    fcntl(this->wakeFds[0], F_SETFL, O_NONBLOCK);
+    fcntl(this->wakeFds[1], F_SETFL, O_NONBLOCK);
+
     this->display = 0;
     this->screen = 0;
+    this->image = 0;
+    this->useShm = false;
 }
 
 void X11DisplayManager::show()
 {
-    this->createWindow(this->width, this->height);
+    this->createWindow(this->mode.width * this->scale,
+                       this->mode.height * this->scale);
+    this->createImage();
     this->eventListen();
 }
 
-void X11DisplayManager::flush()
+void X11DisplayManager::flush(const vector<DirtyRect>& rects)
 {
-    if (!this->toFlush)
-        this->toFlush = true;
+    {
+        boost::lock_guard<boost::mutex> lock(this->dirtyMutex);
+        if (this->dirtyRects.size() + rects.size() > X11_MAX_DIRTY_RECTS)
+            this->dirtyAll = true;
+        else
+            this->dirtyRects.insert(this->dirtyRects.end(),
+                                    rects.begin(), rects.end());
+    }
+
+    // only the first of many flushes needs to wake the loop
+    if (!this->toFlush.exchange(true))
+        this->wake();
 }
 
 void X11DisplayManager::destroy()
 {
     this->toDestroy = true; // tell event loop it's time to quit
+    this->wake();
 }
 
 void X11DisplayManager::createWindow(int width, int height)
@@ -84,7 +162,8 @@ void X11DisplayManager::createWindow(int width, int height)
     XSelectInput(
         this->display,
         this->win,
-        ExposureMask | StructureNotifyMask | ButtonPressMask | KeyPressMask   // event mask
+        ExposureMask | StructureNotifyMask | KeyPressMask |
+        ButtonPressMask | ButtonReleaseMask | PointerMotionMask // event mask
         );
 
     this->gc = XCreateGC(
@@ -99,13 +178,100 @@ void X11DisplayManager::createWindow(int width, int height)
     XMapRaised(this->display, this->win);   // maps window, puts it top of stack
 }
 
+void X11DisplayManager::createImage()
+{
+    Visual* visual = DefaultVisual(this->display, this->screen);
+    int     depth  = DefaultDepth(this->display, this->screen);
+
+    #if HAVE_XSHM
+    if (XShmQueryExtension(this->display))
+    {
+        this->image = XShmCreateImage(this->display, visual, depth, ZPixmap, 0,
+                                      &this->shmInfo,
+                                      this->mode.width * this->scale,
+                                      this->mode.height * this->scale);
+        if (this->image)
+        {
+            int size = this->image->bytes_per_line * this->image->height;
+            this->shmInfo.shmid = shmget(IPC_PRIVATE, size, IPC_CREAT | 0600);
+            void* addr = 0;
+            if (this->shmInfo.shmid >= 0)
+                addr = shmat(this->shmInfo.shmid, 0, 0);
+            if (addr && addr != reinterpret_cast<void*>( -1 ))
+            {
+                this->image->data      = static_cast<char*>( addr );
+                this->shmInfo.shmaddr  = this->image->data;
+                this->shmInfo.readOnly = False;
+
+                // Attaching fails asynchronously (e.g. on a remote display),
+                // so sync while our error handler is installed
+                shmAttachFailed = false;
+                XErrorHandler oldHandler = XSetErrorHandler(shmErrorHandler);
+                XShmAttach(this->display, &this->shmInfo);
+                XSync(this->display, False);
+                XSetErrorHandler(oldHandler);
+
+                // The segment is freed once both sides have detached
+                shmctl(this->shmInfo.shmid, IPC_RMID, 0);
+
+                if (shmAttachFailed)
+                    shmdt(addr);
+                else
+                    this->useShm = true;
+            }
+            else if (this->shmInfo.shmid >= 0)
+            {
+                shmctl(this->shmInfo.shmid, IPC_RMID, 0);
+            }
+
+            if (!this->useShm)
+            {
+                this->image->data = 0;  // don't let Xlib free shared memory
+                XDestroyImage(this->image);
+                this->image = 0;
+            }
+        }
+    }
+    #endif
+
+    if (!this->image)
+    {
+        this->image = XCreateImage(this->display, visual, depth, ZPixmap, 0, 0,
+                                   this->mode.width * this->scale,
+                                   this->mode.height * this->scale, 32, 0);
+        if (!this->image)
+            throw runtime_error("Could not create display image");
+        this->image->data = static_cast<char*>(
+            malloc(this->image->bytes_per_line * this->image->height) );
+    }
+}
+
+void X11DisplayManager::destroyImage()
+{
+    if (!this->image)
+        return;
+
+    #if HAVE_XSHM
+    if (this->useShm)
+    {
+        XShmDetach(this->display, &this->shmInfo);
+        shmdt(this->shmInfo.shmaddr);
+        this->image->data = 0;  // don't let Xlib free shared memory
+    }
+    #endif
+    XDestroyImage(this->image); // frees client-side data
+    this->image = 0;
+}
+
 void X11DisplayManager::eventListen()
 {
     XEvent event;
+    vector<DirtyRect> drawRects;
 
-    int x11_fd = ConnectionNumber(this->display);
+    int x11_fd  = ConnectionNumber(this->display);
+    int wake_fd = this->wakeFds[0];
+    int max_fd  = x11_fd > wake_fd ? x11_fd : wake_fd;
     fd_set in_fds;
-    struct timeval tv;
 
     // initial draw so that there isn't a delay showing window
     this->redraw();
@@ -113,92 +279,249 @@ void X11DisplayManager::eventListen()
     /* look for events forever... */
     while (1)
     {
-        // Create a File Description Set containing x11_fd
+        // Handle XEvents and flush the input.  This also flushes our output,
+        // and must come before select() since Xlib may have queued events
+        // that are no longer waiting on x11_fd.
+        while (XPending(this->display))
+        {
+            XNextEvent(this->display, &event);
+
+            if (event.type == Expose && event.xexpose.count == 0)
+                this->redraw();
+
+            if (event.type == KeyPress || event.type == KeyRelease)
+                this->keyEvent(event.xkey.keycode, event.type == KeyRelease);
+
+            if (event.type == MotionNotify)
+                this->pointerMoved(event.xmotion.x, event.xmotion.y, 0);
+            else if (event.type == ButtonPress || event.type == ButtonRelease)
+            {
+                bool press = event.type == ButtonPress;
+                int  wheel = 0;
+                int  button;
+                switch (event.xbutton.button)
+                {
+                case Button1:   button = POINTER_BUTTON_LEFT;   break;
+                case Button2:   button = POINTER_BUTTON_MIDDLE; break;
+                case Button3:   button = POINTER_BUTTON_RIGHT;  break;
+                // the wheel clicks as buttons 4 and 5; count the presses
+                case Button4:   button = 0; wheel = press ?  1 : 0; break;
+                case Button5:   button = 0; wheel = press ? -1 : 0; break;
+                default:        button = 0; break;
+                }
+                if (press)
+                    this->buttons |= button;
+                else
+                    this->buttons &= ~button;
+                this->pointerMoved(event.xbutton.x, event.xbutton.y, wheel);
+            }
+        }
+
+        // Wait for an X event, or for a request from another thread
         FD_ZERO(&in_fds);
         FD_SET(x11_fd, &in_fds);
+        FD_SET(wake_fd, &in_fds);
+        if (select(max_fd + 1, &in_fds, 0, 0, 0) < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            throw runtime_error("Could not wait for display events");
+        }
 
-        // Set timer
-        tv.tv_usec = 0;
-        tv.tv_sec = 1;
+        if (FD_ISSET(wake_fd, &in_fds))
+        {
+            char buf[64];
+            while (read(wake_fd, buf, sizeof(buf)) > 0);
+        }
 
-        // Wait for X Event or a Timer
-        if (select(x11_fd+1, &in_fds, 0, 0, &tv))
+        if (this->toDestroy)
         {
-            // Event recevied
-            // Nothing to do here
+            this->closeWindow();
+            break;
         }
-        else
-        {   // Timer fired
-            if (this->toDestroy)
+        // Clear before drawing, so that a flush requested during the redraw
+        // is not missed
+        if (this->toFlush.exchange(false))
+        {
+            bool all;
             {
-                this->closeWindow();
-                break;
+                boost::lock_guard<boost::mutex> lock(this->dirtyMutex);
+                drawRects.swap(this->dirtyRects);
+                this->dirtyRects.clear();
+                all = this->dirtyAll;
+                this->dirtyAll = false;
             }
-            else if (this->toFlush)
-            {
-                // This order is important, if guest code calls flush multiple times.
-                // If these were reversed, a flush could be missed.
-                this->toFlush = false;
+
+            if (all)
                 this->redraw();
-            }
+            else
+                this->redraw(drawRects);
+            this->flushed();
         }
+    }
+}
 
-        // Handle XEvents and flush the input
-        while (XPending(this->display))
-        {
-            XNextEvent(this->display, &event);
+void X11DisplayManager::redraw()
+{
+    FramebufferMode mode = this->framebuffer->getMode();
+    if (mode != this->mode)
+        this->setMode(mode);
+
+    DirtyRect all;
+    all.x      = 0;
+    all.y      = 0;
+    all.width  = this->mode.width;
+    all.height = this->mode.height;
+    this->redraw(vector<DirtyRect>(1, all));
+}
 
-            if (event.type == Expose && event.xexpose.count == 0)
-                this->redraw();
+void X11DisplayManager::redraw(const vector<DirtyRect>& rects)
+{
+    if (rects.empty())
+        return;
+
+    // The guest set a new mode; the flush that came with it covers all of it
+    FramebufferMode mode = this->framebuffer->getMode();
+    if (mode != this->mode)
+        this->setMode(mode);
+    if (this->framebuffer->getPaletteSerial() != this->paletteSerial)
+        this->paletteSerial = this->framebuffer->getPalette(this->palette);
+
+    // the same page for every rect, even if the guest flips meanwhile
+    const uint8_t* pixels =
+        this->framebuffer->getPixels(this->framebuffer->getFrontPage());
+
+    const int s = this->scale;
+    for (vector<DirtyRect>::size_type i = 0; i < rects.size(); i++)
+    {
+        // rects from before a mode change may not fit
+        DirtyRect rect = rects[i];
+        rect.width  = min(rect.width,  this->mode.width  - rect.x);
+        rect.height = min(rect.height, this->mode.height - rect.y);
+        if (rect.width <= 0 || rect.height <= 0)
+            continue;
 
-            if (this->ic)
-            {
-                bool keypress   = event.type == KeyPress;
-                bool keyrelease = event.type == KeyRelease;
-                if (keypress || keyrelease)
-                {
-                    // Set CPU pin
-                    this->ic->setPin(KEYBOARD_DATA_PIN, event.xkey.keycode | (keyrelease ? 0x100 : 0));
+        this->convert(pixels, rect);
 
-                    // Interrupt
-                    this->ic->interrupt(KEYBOARD_INT_LINE);
-                }
-                else if (event.type == ButtonPress)
-                {
-                    //int x = event.xbutton.x,
-                    //    y = event.xbutton.y;
-                    // TODO:  interrupt
-                }
-            }
+        #if HAVE_XSHM
+        if (this->useShm)
+        {
+            XShmPutImage(this->display, this->win, this->gc, this->image,
+                         rect.x * s, rect.y * s, rect.x * s, rect.y * s,
+                         rect.width * s, rect.height * s, False);
+            continue;
         }
+        #endif
+        XPutImage(this->display, this->win, this->gc, this->image,
+                  rect.x * s, rect.y * s, rect.x * s, rect.y * s,
+                  rect.width * s, rect.height * s);
     }
+
+    #if HAVE_XSHM
+    if (this->useShm)
+    {
+        // the server must be done reading before we convert the next frame
+        XSync(this->display, False);
+        return;
+    }
+    #endif
+    XFlush(this->display);
 }
 
-// I'm no X11 expert; someone needs to fix this
-void X11DisplayManager::redraw()
+void X11DisplayManager::setMode(const FramebufferMode& mode)
 {
-    vector<uint8_t>& memref = *this->memory;
+    bool resize = mode.width  != this->mode.width ||
+                  mode.height != this->mode.height;
+    this->mode = mode;
+    if (!resize)
+        return;
+
+    this->destroyImage();
+    this->createImage();
+    this->rowBuffer.resize(mode.width);
+    XResizeWindow(this->display, this->win,
+                  mode.width * this->scale, mode.height * this->scale);
+}
 
-    MemAddress addr = videoAddress;
-    for (int y = 0; y < 480; y++)
+void X11DisplayManager::convert(const uint8_t* pixels, const DirtyRect& rect)
+{
+    int pitch  = this->mode.getPitch();
+    int bpp    = this->mode.getBytesPerPixel();
+    int format = this->mode.format;
+    const uint32_t* palette = this->palette;
+
+    Visual* visual = DefaultVisual(this->display, this->screen);
+    #if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+    const int hostOrder = LSBFirst;
+    #else
+    const int hostOrder = MSBFirst;
+    #endif
+    bool xrgb32 = this->image->bits_per_pixel == 32 &&
+                  this->image->byte_order     == hostOrder &&
+                  visual->red_mask   == 0xFF0000 &&
+                  visual->green_mask == 0x00FF00 &&
+                  visual->blue_mask  == 0x0000FF;
+
+    const int s = this->scale;
+    uint32_t* row = &this->rowBuffer[0];
+
+    /* convert guest pixels to the image's format */
+    for (int y = rect.y; y < rect.y + rect.height; y++)
     {
-        for (int x = 0; x < 640; x++)
-        {
-            unsigned long color = memref[addr + 0] << 16 |
-                                  memref[addr + 1] <<  8 |
-                                  memref[addr + 2] <<  0;
-            XSetForeground(this->display, this->gc, color);
-            XDrawPoint(this->display, this->win, this->gc, x, y);
+        const uint8_t* src = pixels + y * pitch + rect.x * bpp;
+        char* line = this->image->data + y * s * this->image->bytes_per_line;
+        uint32_t* dst = reinterpret_cast<uint32_t*>( line ) + rect.x * s;
 
-            addr += 3;
+        if (xrgb32 && s == 1)
+        {
+            convertToXrgb32(format, src, dst, rect.width, palette);
+        }
+        else if (xrgb32)
+        {
+            convertToXrgb32(format, src, row, rect.width, palette);
+            scaleXrgb32(row, rect.width, 1, rect.width * sizeof(uint32_t),
+                        dst, this->image->bytes_per_line, s);
         }
+        else
+        {   // unusual visual; build each pixel from its masks, and let Xlib
+            // pack them
+            convertToXrgb32(format, src, row, rect.width, palette);
+            for (int x = 0; x < rect.width; x++)
+            {
+                row[x] = toMask((row[x] >> 16) & 0xFF, visual->red_mask) |
+                         toMask((row[x] >> 8) & 0xFF, visual->green_mask) |
+                         toMask(row[x] & 0xFF, visual->blue_mask);
+            }
+            for (int x = 0; x < rect.width * s; x++)
+                for (int i = 0; i < s; i++)
+                {
+                    XPutPixel(this->image, rect.x * s + x, y * s + i,
+                              row[x / s]);
+                }
+        }
+    }
+}
 
-        XFlush(this->display);
+void X11DisplayManager::wake()
+{
+    char c = 0;
+    if (write(this->wakeFds[1], &c, 1) < 0)
+    {
+        // the pipe is full, so the loop is already awake
     }
 }
 
+void X11DisplayManager::pointerMoved(int x, int y, int wheel)
+{
+    // window pixels to guest pixels, within the frame
+    x = min(max(x / this->scale, 0), this->mode.width  - 1);
+    y = min(max(y / this->scale, 0), this->mode.height - 1);
+    this->pointerEvent(x, y, this->buttons, wheel);
+}
+
 void X11DisplayManager::closeWindow()
 {
+    this->destroyImage();
     XFreeGC(this->display, this->gc);
     XDestroyWindow(this->display, this->win);
     XCloseDisplay(this->display);
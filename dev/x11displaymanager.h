@@ -5,56 +5,132 @@
 
 #include <X11/Xlib.h>
 #include <X11/Xutil.h>
+#if HAVE_XSHM
+#  include <X11/extensions/XShm.h>
+#endif
 
-#define KEYBOARD_INT_LINE   1
-#define KEYBOARD_DATA_PIN 0x8
-// Allow 8 pins for timer interrupt
+#include <atomic>
+#include <boost/thread/mutex.hpp>
+
+// above this many pending rects, the whole frame is redrawn instead
+#define X11_MAX_DIRTY_RECTS 256
 
 class X11DisplayManager : public DisplayManager
 {
 public:
 
+    /**
+     * @param[in]   scale   Integer factor to scale the guest display up by
+     */
+    X11DisplayManager(int scale = 1);
+
+    ~X11DisplayManager();
+
     void init(
-        std::vector<uint8_t>&           memory,
-        MemAddress                      videoAddress,
-        machine::InterruptController*   ic,
-        int                             width,
-        int                             height
+        const machine::Framebuffer&     framebuffer,
+        machine::InterruptController*   ic
         );
 
     void show();
 
-    void flush();
+    /**
+     * Ask the event loop to redraw the changed areas.  Does not block.
+     * @param[in]   rects   Areas that changed since the last flush
+     */
+    void flush(const std::vector<machine::DirtyRect>& rects);
 
+    /**
+     * Ask the event loop to close the window and return.  Does not block.
+     */
     void destroy();
 
 protected:
 
     void createWindow(int width, int height);
 
+    /**
+     * Create the image that frames are converted into.  The image is in a
+     * MIT-SHM segment if the server supports it, otherwise in client memory.
+     */
+    void createImage();
+
+    void destroyImage();
+
     void eventListen();
 
+    /**
+     * Redraw the whole frame
+     */
     void redraw();
 
+    /**
+     * Redraw areas of the frame from the front page
+     * @param[in]   rects   Areas to redraw
+     */
+    void redraw(const std::vector<machine::DirtyRect>& rects);
+
+    /**
+     * Switch to the guest's new mode, resizing the window and image if the
+     * resolution changed
+     * @param[in]   mode    New mode
+     */
+    void setMode(const machine::FramebufferMode& mode);
+
+    /**
+     * Convert an area of guest memory into the image, scaling it up
+     * @param[in]   pixels  First pixel of the page to convert from
+     * @param[in]   rect    Area to convert, in guest pixels
+     */
+    void convert(const uint8_t* pixels, const machine::DirtyRect& rect);
+
+    /**
+     * Report the pointer to the guest
+     * @param[in]   x       Position, in window pixels
+     * @param[in]   y
+     * @param[in]   wheel   Wheel clicks; positive for up
+     */
+    void pointerMoved(int x, int y, int wheel);
+
     void closeWindow();
 
+    /**
+     * Wake the event loop from select()
+     */
+    void wake();
+
 private:
 
-    std::vector<uint8_t>*           memory;
-    MemAddress                      videoAddress;
+    const machine::Framebuffer*     framebuffer;
     machine::InterruptController*   ic;
 
-    int width;
-    int height;
+    machine::FramebufferMode mode;  //<! Mode of the window and image
+    int scale;
+    int buttons;                    //<! POINTER_BUTTON_ flags held down
+
+    std::vector<uint32_t> rowBuffer;    //<! A converted row, before scaling
+
+    uint32_t palette[FRAMEBUFFER_PALETTE_SIZE]; //<! Copy of the guest palette
+    unsigned paletteSerial;                     //<! Serial of the copy
+
+    std::atomic<bool> toFlush;      //<! Tells the event loop to flush display
+    std::atomic<bool> toDestroy;    //<! Tells the event loop to close window
+
+    int wakeFds[2];                 //<! Pipe that wakes the event loop
 
-    bool toFlush;   //<! Tells the event loop to flush display
-    bool toDestroy; //<! Tells the event loop to quit and destroy window
+    boost::mutex                    dirtyMutex;
+    std::vector<machine::DirtyRect> dirtyRects; //<! Areas waiting to be drawn
+    bool                            dirtyAll;   //<! Redraw all instead
 
     /* X variables */
     Display*    display;
     int         screen;
     Window      win;
     GC          gc;
+    XImage*     image;
+    bool        useShm;     //<! Whether `image` is in shared memory
+    #if HAVE_XSHM
+    XShmSegmentInfo shmInfo;
+    #endif
 
 };
 
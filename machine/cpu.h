@@ -27,6 +27,12 @@ public:
 
     virtual void interrupt(unsigned int line) = 0;
 
+    /**
+     * @return  Number of instructions executed, as of the CPU's last port
+     *          write, or 0 if the CPU does not count them
+     */
+    virtual uint64_t getInstructionCount() const { return 0; }
+
 };
 
 }   // namespace machine
@@ -37,11 +37,32 @@ public:
 
     /**
      * Write to this device
+     *
+     * For a posted port, this is called on a thread that the Motherboard
+     * creates for this device, not on the CPU thread.
      * @param[in]   what    Word to write to device
      * @param[in]   port    Port that was invoked to write to this device
      */
     virtual void write(MemAddress what, int port) { }
 
+    /**
+     * Declare how writes to a port reach this device.  This is asked once,
+     * when the port is obtained.
+     * @param[in]   port    Port that this device has obtained
+     * @return  PORT_SYNCHRONOUS to be written on the CPU thread, or
+     *          PORT_POSTED to have writes queued.  Defaults to synchronous.
+     */
+    virtual PortMode getPortMode(int port) const { return PORT_SYNCHRONOUS; }
+
+    /**
+     * Called on the CPU thread for each write to a posted port, before the
+     * write is queued.  The guest may change its memory as soon as the write
+     * returns, so this is where a device copies out what the write refers to.
+     * @param[in]   what    Word written to the device
+     * @param[in]   port    Port that was written
+     */
+    virtual void posting(MemAddress what, int port) { }
+
     /**
      * Stop a thread
      * @param[in]   thd     Thread to stop
@@ -0,0 +1,188 @@
+/**
+ * @file    dirtytracker.cpp
+ *
+ * Matrix VM
+ */
+
+#include "dirtytracker.h"
+
+#include <stdexcept>
+
+using namespace std;
+using namespace machine;
+
+const int DirtyTracker::TILE_SIZE;
+
+const DirtyTracker::Region DirtyTracker::emptyRegion =
+    { 0, 0, 0, 0, 1, 0, 0, 0, 0, 0 };
+
+/* public DirtyTracker */
+
+DirtyTracker::DirtyTracker()
+: region(&emptyRegion), bitmapWords(0)
+{ }
+
+DirtyTracker::~DirtyTracker()
+{
+    for (vector<Region*>::size_type i = 0; i < this->regions.size(); i++)
+        delete this->regions[i];
+    for (vector<atomic<uint32_t>*>::size_type i = 0;
+         i < this->bitmaps.size();
+         i++)
+        delete[] this->bitmaps[i];
+}
+
+void DirtyTracker::setRegion(MemAddress start, int width, int height,
+                             int bytesPerPixel)
+{
+    if (width <= 0 || height <= 0 || bytesPerPixel <= 0)
+        throw runtime_error("Cannot track an empty pixel buffer");
+
+    // Guests switch back and forth between the same modes; a region made
+    // before is reused, so that only new geometries take memory
+    for (vector<Region*>::size_type i = 0; i < this->regions.size(); i++)
+    {
+        Region* r = this->regions[i];
+        if (r->start == start && r->width == width && r->height == height &&
+            r->bytesPerPixel == bytesPerPixel)
+        {
+            for (int w = 0; w < r->numWords; w++)
+                r->tiles[w].store(0, memory_order_relaxed);
+            this->region.store(r, memory_order_release);
+            return;
+        }
+    }
+
+    Region* r = new Region;
+    r->start         = start;
+    r->width         = width;
+    r->height        = height;
+    r->bytesPerPixel = bytesPerPixel;
+    r->pitch         = width * bytesPerPixel;
+    r->end           = start + r->pitch * height;
+    r->tilesWide     = (width  + TILE_SIZE - 1) / TILE_SIZE;
+    r->tilesHigh     = (height + TILE_SIZE - 1) / TILE_SIZE;
+    r->numWords      = (r->tilesWide * r->tilesHigh + 31) / 32;
+
+    // A mark() that still uses the old region may set bits in a reused
+    // bitmap, but never past the end of it
+    if (r->numWords > this->bitmapWords)
+    {
+        this->bitmaps.push_back(new atomic<uint32_t>[r->numWords]);
+        this->bitmapWords = r->numWords;
+        this->snapshot.resize(r->numWords);
+    }
+    r->tiles = this->bitmaps.back();
+    for (int i = 0; i < this->bitmapWords; i++)
+        r->tiles[i].store(0, memory_order_relaxed);
+
+    this->regions.push_back(r);
+    this->region.store(r, memory_order_release);
+}
+
+void DirtyTracker::collect(vector<DirtyRect>& rects)
+{
+    rects.clear();
+
+    const Region& r = *this->region.load(memory_order_acquire);
+
+    // Take the whole bitmap first, so that tiles marked while we build the
+    // list are left for the next collect()
+    for (int i = 0; i < r.numWords; i++)
+        this->snapshot[i] = r.tiles[i].exchange(0, memory_order_acquire);
+
+    // rects that end on the previous tile row, and those that end on this one
+    vector<vector<DirtyRect>::size_type> above, here;
+    for (int ty = 0; ty < r.tilesHigh; ty++)
+    {
+        vector<vector<DirtyRect>::size_type>::size_type next = 0;
+        here.clear();
+
+        int tx = 0;
+        while (tx < r.tilesWide)
+        {
+            int bit = ty * r.tilesWide + tx;
+            if (!(this->snapshot[bit / 32] & (1u << (bit % 32))))
+            {
+                tx++;
+                continue;
+            }
+
+            // find the run of dirty tiles
+            int runStart = tx;
+            do
+            {
+                tx++;
+                bit++;
+            } while (tx < r.tilesWide &&
+                     (this->snapshot[bit / 32] & (1u << (bit % 32))));
+
+            DirtyRect rect;
+            rect.x      = runStart * TILE_SIZE;
+            rect.y      = ty * TILE_SIZE;
+            rect.width  = min(tx * TILE_SIZE, r.width) - rect.x;
+            rect.height = min(TILE_SIZE, r.height - rect.y);
+
+            // grow a rect from the previous tile row if it has the same span;
+            // both rows are ordered by x, so only look forward
+            while (next < above.size() && rects[above[next]].x < rect.x)
+                next++;
+            if (next < above.size() && rects[above[next]].x == rect.x &&
+                rects[above[next]].width == rect.width)
+            {
+                rects[above[next]].height += rect.height;
+                here.push_back(above[next]);
+            }
+            else
+            {
+                rects.push_back(rect);
+                here.push_back(rects.size() - 1);
+            }
+        }
+
+        above.swap(here);
+    }
+}
+
+/* protected DirtyTracker */
+
+void DirtyTracker::markRange(const Region& r, MemAddress addr, MemAddress len)
+{
+    MemAddress first = max(addr, r.start) - r.start;
+    MemAddress last  = min(addr + len, r.end) - r.start - 1;
+
+    int firstRow = first / r.pitch;
+    int lastRow  = last  / r.pitch;
+
+    if (firstRow == lastRow)
+    {
+        int firstTile = (first % r.pitch) / r.bytesPerPixel / TILE_SIZE;
+        int lastTile  = (last  % r.pitch) / r.bytesPerPixel / TILE_SIZE;
+        markTiles(r, firstRow / TILE_SIZE, firstTile, lastTile);
+    }
+    else
+    {   // spans rows; mark whole tile rows
+        for (int ty = firstRow / TILE_SIZE; ty <= lastRow / TILE_SIZE; ty++)
+            markTiles(r, ty, 0, r.tilesWide - 1);
+    }
+}
+
+inline void DirtyTracker::markTiles(const Region& r, int tileRow,
+                                    int firstTile, int lastTile)
+{
+    int bit  = tileRow * r.tilesWide + firstTile;
+    int last = tileRow * r.tilesWide + lastTile;
+    while (bit <= last)
+    {
+        // set as many bits of this word as we can at once
+        int      word  = bit / 32;
+        int      upto  = min(last, word * 32 + 31);
+        int      count = upto - bit + 1;
+        uint32_t mask  = count == 32 ? 0xFFFFFFFFu : ((1u << count) - 1);
+        mask <<= bit % 32;
+
+        // release, so that whoever collects this tile sees what was written
+        r.tiles[word].fetch_or(mask, memory_order_release);
+        bit = upto + 1;
+    }
+}
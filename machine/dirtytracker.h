@@ -0,0 +1,140 @@
+/**
+ * @file    dirtytracker.h
+ *
+ * Matrix VM
+ */
+
+#ifndef DIRTYTRACKER_H
+#define DIRTYTRACKER_H
+
+#include <common.h>
+
+#include <vector>
+#include <atomic>
+
+namespace machine
+{
+
+/**
+ * A rectangle of pixels, in pixel coordinates
+ */
+struct DirtyRect
+{
+    int x;
+    int y;
+    int width;
+    int height;
+};
+
+/**
+ * @class DirtyTracker
+ *
+ * Tracks which tiles of a pixel buffer in guest memory have been written.
+ *
+ * Whatever writes into guest memory (the CPU, or a device) calls mark() after
+ * writing.  The owner of the pixel buffer calls collect() to find out what
+ * has changed since the last collect().  mark() and collect() may be called
+ * from different threads, and the region may be changed with setRegion()
+ * while another thread calls mark().
+ *
+ * @sa Motherboard::addDirtyTracker
+ */
+class DirtyTracker
+{
+public:
+
+    /* width and height of a tile, in pixels */
+    static const int TILE_SIZE = 16;
+
+    DirtyTracker();
+
+    ~DirtyTracker();
+
+    /**
+     * Set the pixel buffer to track, and clear all tiles.  A mark() that
+     * races with this may be lost, so mark everything afterwards if nothing
+     * else redraws the whole buffer.
+     * @param[in]   start           Address of the first pixel
+     * @param[in]   width           Pixels per row
+     * @param[in]   height          Number of rows
+     * @param[in]   bytesPerPixel   Bytes per pixel
+     */
+    void setRegion(MemAddress start, int width, int height, int bytesPerPixel);
+
+    /**
+     * Mark the tiles that contain a range of memory as dirty.  Ranges outside
+     * of the pixel buffer are ignored.
+     * @param[in]   addr    Start of written memory
+     * @param[in]   len     Number of bytes written
+     */
+    inline void mark(MemAddress addr, MemAddress len)
+    {
+        // acquire, to see the bitmap of a region set on another thread
+        const Region* r = this->region.load(std::memory_order_acquire);
+        if (addr >= r->end || addr + len <= r->start || len <= 0)
+            return;
+        this->markRange(*r, addr, len);
+    }
+
+    /**
+     * Get the dirty tiles, as rectangles, and clear them
+     * @param[out]  rects   Dirty rectangles.  Horizontally and vertically
+     *                      adjacent tiles are merged where possible.
+     */
+    void collect(std::vector<DirtyRect>& rects);
+
+protected:
+
+    /**
+     * A tracked pixel buffer.  Never changed once it is published, so that
+     * mark() can use it without locking.
+     */
+    struct Region
+    {
+        MemAddress  start;
+        MemAddress  end;
+        int         width;
+        int         height;
+        int         bytesPerPixel;
+        int         pitch;          //!< Bytes per row
+        int         tilesWide;
+        int         tilesHigh;
+
+        std::atomic<uint32_t>*  tiles;      //!< One bit per tile, row-major
+        int                     numWords;   //!< Words used in `tiles`
+    };
+
+    /**
+     * Mark the tiles of a range that is known to overlap the pixel buffer
+     * @param[in]   r       Region the range overlaps
+     * @param[in]   addr
+     * @param[in]   len
+     */
+    static void markRange(const Region& r, MemAddress addr, MemAddress len);
+
+    static inline void markTiles(const Region& r, int tileRow,
+                                 int firstTile, int lastTile);
+
+private:
+
+    DirtyTracker(const DirtyTracker& dt) { }    /* copy not permitted */
+
+    /* tracked until a region is set; mark() ignores everything */
+    static const Region emptyRegion;
+
+    std::atomic<const Region*>  region;     //!< Current region
+
+    // Regions and bitmaps that mark() may still be using.  They are only
+    // freed with the tracker; there is one region for each geometry ever
+    // set, and bitmaps are reused when they are large enough.  bitmapWords
+    // is the length of the newest bitmap.
+    std::vector<Region*>                regions;
+    std::vector<std::atomic<uint32_t>*> bitmaps;
+    int                                 bitmapWords;
+
+    std::vector<uint32_t>   snapshot;   //!< collect() scratch space
+};
+
+}   // namespace machine
+
+#endif // DIRTYTRACKER_H
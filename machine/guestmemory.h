@@ -0,0 +1,92 @@
+/**
+ * @file    guestmemory.h
+ *
+ * Matrix VM
+ *
+ * Helpers for devices that read and write structures in guest memory.  The
+ * guest is big endian, and so are the files that devices keep.
+ */
+
+#ifndef GUESTMEMORY_H
+#define GUESTMEMORY_H
+
+#include <common.h>
+
+namespace machine
+{
+
+/**
+ * @param[in]   p   Guest memory
+ * @return  The big endian halfword at p
+ */
+inline uint32_t read16(const uint8_t* p)
+{
+    return static_cast<uint32_t>( p[0] ) << 8 | p[1];
+}
+
+/**
+ * @param[in]   p   Guest memory
+ * @return  The big endian word at p
+ */
+inline uint32_t read32(const uint8_t* p)
+{
+    return static_cast<uint32_t>( p[0] ) << 24 |
+           static_cast<uint32_t>( p[1] ) << 16 |
+           static_cast<uint32_t>( p[2] ) << 8 | p[3];
+}
+
+/**
+ * @param[in]   p   Guest memory
+ * @return  The big endian doubleword at p
+ */
+inline uint64_t read64(const uint8_t* p)
+{
+    return static_cast<uint64_t>( read32(p) ) << 32 | read32(p + 4);
+}
+
+/**
+ * @param[out]  p       Guest memory
+ * @param[in]   value   Halfword to write at p, big endian
+ */
+inline void write16(uint8_t* p, uint32_t value)
+{
+    p[0] = value >> 8;
+    p[1] = value;
+}
+
+/**
+ * @param[out]  p       Guest memory
+ * @param[in]   value   Word to write at p, big endian
+ */
+inline void write32(uint8_t* p, uint32_t value)
+{
+    p[0] = value >> 24;
+    p[1] = value >> 16;
+    p[2] = value >> 8;
+    p[3] = value;
+}
+
+/**
+ * @param[out]  p       Guest memory
+ * @param[in]   value   Doubleword to write at p, big endian
+ */
+inline void write64(uint8_t* p, uint64_t value)
+{
+    write32(p, value >> 32);
+    write32(p + 4, value);
+}
+
+/**
+ * @param[in]   addr
+ * @param[in]   len
+ * @param[in]   memorySize  Bytes of guest memory
+ * @return  Whether [addr, addr + len) is in guest memory
+ */
+inline bool inMemory(int64_t addr, int64_t len, int64_t memorySize)
+{
+    return addr >= 0 && len >= 0 && addr + len <= memorySize;
+}
+
+}   // namespace machine
+
+#endif // GUESTMEMORY_H
@@ -26,6 +26,13 @@ Motherboard::Motherboard()
 
 Motherboard::~Motherboard()
 {
+    for (vector<PostedDevice*>::size_type i = 0;
+         i < this->postedDevices.size();
+         ++i)
+    {
+        delete this->postedDevices[i];
+        this->postedDevices[i] = 0;
+    }
     for (vector<Cpu*>::size_type i = 0; i < this->cpus.size(); ++i)
     {
         delete this->cpus[i];
@@ -169,6 +176,14 @@ bool Motherboard::start()
         (*iter).thd = new boost::thread(&Motherboard::runThread, this, *iter);
     }
 
+    // Start threads that deliver posted port writes
+    for (vector<PostedDevice*>::size_type i = 0;
+         i < this->postedDevices.size();
+         ++i)
+    {
+        PostedDevice* pd = this->postedDevices[i];
+        pd->thd = new boost::thread(&Motherboard::drainPort, this, pd);
+    }
 
     int exeStart = this->exeStart <= 0 ? this->reservedSize : this->exeStart;
     // align start point to instruction-length value
@@ -193,6 +208,23 @@ bool Motherboard::start()
 
     printf("Stopping devices\n");
 
+    // Deliver outstanding posted writes before the devices are stopped
+    for (vector<PostedDevice*>::size_type i = 0;
+         i < this->postedDevices.size();
+         ++i)
+    {
+        PostedDevice* pd = this->postedDevices[i];
+        pd->run = false;
+        wakePort(*pd);
+        pd->thd->join();
+        delete pd->thd;
+        pd->thd = 0;
+    }
+
+    #if EMULATOR_BENCHMARK
+    this->printPortStats();
+    #endif
+
     // Tell each thread to stop
     for (list<DeviceThread>::iterator iter = this->deviceThreads.begin();
          iter != this->deviceThreads.end();
@@ -255,6 +287,34 @@ bool Motherboard::requestThread(Device* dev, DeviceCallFunc cb)
     return true;
 }
 
+void Motherboard::addDirtyTracker(DirtyTracker* tracker)
+{
+    assert(tracker);
+    this->dirtyTrackers.push_back(tracker);
+}
+
+const vector<DirtyTracker*>& Motherboard::getDirtyTrackers() const
+{
+    return this->dirtyTrackers;
+}
+
+void Motherboard::printPortStats() const
+{
+    for (vector<PostedDevice*>::size_type i = 0;
+         i < this->postedDevices.size();
+         ++i)
+    {
+        const PostedDevice* pd = this->postedDevices[i];
+        printf("Posted writes to %-32s:  %10llu "
+               "(%llu stalled, max depth %lu/%lu)\n",
+            pd->dev->getName().c_str(),
+            pd->stats.posted,
+            pd->stats.stalls,
+            static_cast<unsigned long>( pd->stats.maxDepth ),
+            static_cast<unsigned long>( pd->queue.capacity() ));
+    }
+}
+
 /* protected Motherboard */
 
 vector<uint8_t>& Motherboard::getMemory()
@@ -272,6 +332,10 @@ MemAddress Motherboard::reserveMemIO(Device& dev, MemAddress size)
     {
         return -1;  // not enough mem
     }
+    else if (this->exeStart > 0 && this->reservedSize + size > this->exeStart)
+    {
+        return -1;  // would be overwritten by the BIOS
+    }
     else
     {
         printf("Memory for %-32s:  0x%08x - 0x%08x\n",
@@ -294,22 +358,119 @@ int Motherboard::requestPort(Device* dev, int port /* = 0 */)
         return 0 /* false */;
     }
 
-    this->devicePorts[port] = dev;
+    DevicePort dp;
+    dp.dev    = dev;
+    dp.posted = 0;
+    if (dev->getPortMode(port) == PORT_POSTED)
+    {
+        // all posted ports of a device share one queue, so they stay ordered
+        for (vector<PostedDevice*>::size_type i = 0;
+             i < this->postedDevices.size();
+             ++i)
+        {
+            if (this->postedDevices[i]->dev == dev)
+                dp.posted = this->postedDevices[i];
+        }
+        if (!dp.posted)
+        {
+            dp.posted = new PostedDevice(dev);
+            this->postedDevices.push_back(dp.posted);
+        }
+    }
+    this->devicePorts[port] = dp;
 
     return port;
 }
 
 void Motherboard::write(int port, MemAddress what)
 {
-    std::unordered_map<int,Device*>::const_iterator iter = this->devicePorts.find(port);
+    std::unordered_map<int,DevicePort>::const_iterator iter =
+        this->devicePorts.find(port);
     if (iter == this->devicePorts.end())
         throw runtime_error("Cannot write to port; no device is installed");
     // TODO:  generate fault instead of throwing error!
 
-    Device* dev = (*iter).second;
-    assert(dev);
+    const DevicePort& dp = (*iter).second;
+    assert(dp.dev);
+
+    if (dp.posted)
+    {
+        dp.dev->posting(what, port);
+        this->post(*dp.posted, port, what);
+    }
+    else
+        dp.dev->write(what, port);
+}
+
+Motherboard::PostedDevice::PostedDevice(Device* dev)
+: dev(dev), queue(POSTED_QUEUE_SIZE), thd(0), sleeping(false), run(true)
+{
+    this->stats.posted   = 0;
+    this->stats.stalls   = 0;
+    this->stats.maxDepth = 0;
+}
+
+void Motherboard::post(PostedDevice& pd, int port, MemAddress what)
+{
+    PortWrite pw;
+    pw.port = port;
+    pw.what = what;
+
+    if (!pd.queue.push(pw))
+    {   // back-pressure; the device has fallen behind
+        ++pd.stats.stalls;
+        do
+        {
+            wakePort(pd);
+            boost::this_thread::yield();
+        } while (!pd.queue.push(pw));
+    }
+
+    ++pd.stats.posted;
+    size_t depth = pd.queue.size();
+    if (depth > pd.stats.maxDepth)
+        pd.stats.maxDepth = depth;
 
-    dev->write(what, port);
+    // Pairs with the fence in drainPort, so that either the drain thread sees
+    // the new write or we see that it is sleeping
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (pd.sleeping.load(std::memory_order_relaxed))
+        wakePort(pd);
+}
+
+void Motherboard::drainPort(Motherboard* mb, PostedDevice* pd)
+{
+    PortWrite pw;
+    while (1)
+    {
+        while (pd->queue.pop(pw))
+        {
+            try
+            {
+                pd->dev->write(pw.what, pw.port);
+            }
+            catch (exception& e)
+            {
+                mb->reportException(e);
+            }
+        }
+
+        if (!pd->run)
+            break;
+
+        boost::unique_lock<boost::mutex> lock(pd->mutex);
+        pd->sleeping.store(true, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        if (pd->queue.empty() && pd->run)
+            pd->ready.wait(lock);
+        pd->sleeping.store(false, std::memory_order_relaxed);
+    }
+}
+
+void Motherboard::wakePort(PostedDevice& pd)
+{
+    boost::lock_guard<boost::mutex> lock(pd.mutex);
+    pd.ready.notify_one();
 }
 
 void Motherboard::runThread(Motherboard* mb, DeviceThread& dt)
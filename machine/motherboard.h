@@ -8,9 +8,11 @@
 #define MOTHERBOARD_H
 
 #include <common.h>
+#include "spscqueue.h"
 
 #include <vector>
 #include <unordered_map>
+#include <atomic>
 #include <boost/thread.hpp>
 
 // minimum amount of memory (in bytes) required to run the machine
@@ -19,6 +21,9 @@
 // minimum amount of memory (in bytes) after reserved memory
 #define MIN_AVAIL_MEMORY 512
 
+// number of writes that can be queued on a posted port before the CPU stalls
+#define POSTED_QUEUE_SIZE 256
+
 namespace machine
 {
 
@@ -26,10 +31,30 @@ class Motherboard;
 class Device;
 class Cpu;
 class InterruptController;
+class DirtyTracker;
 
 typedef void (*DeviceCallFunc)(Device* dev, Motherboard& mb);
 typedef void (*ReportExceptionFunc)(Motherboard& mb, std::exception& e);
 
+/**
+ * How a port write reaches its device
+ */
+enum PortMode
+{
+    PORT_SYNCHRONOUS,   //!< Device::write is called on the CPU thread
+    PORT_POSTED         //!< Write is queued and delivered on a device thread
+};
+
+/**
+ * Statistics for a device with posted ports
+ */
+struct PortStats
+{
+    unsigned long long  posted;     //!< Number of writes posted
+    unsigned long long  stalls;     //!< Writes that found the queue full
+    size_t              maxDepth;   //!< Deepest the queue has been
+};
+
 /**
  * Central class to the Matrix VM
  *
@@ -140,6 +165,26 @@ public:
      */
     bool requestThread(Device* dev, DeviceCallFunc cb);
 
+    /**
+     * Register a tracker that is told about writes to guest memory
+     *
+     * Devices that scan guest memory (such as a framebuffer) add a tracker
+     * while initializing.  CPUs and devices that write guest memory mark the
+     * trackers returned by getDirtyTrackers().
+     * @param[in]   tracker     Tracker; the Motherboard does not delete it
+     */
+    void addDirtyTracker(DirtyTracker* tracker);
+
+    /**
+     * @return  Registered dirty trackers
+     */
+    const std::vector<DirtyTracker*>& getDirtyTrackers() const;
+
+    /**
+     * Print statistics of posted ports to stdout
+     */
+    void printPortStats() const;
+
 protected:
 
     /**
@@ -153,7 +198,8 @@ protected:
      * This is to be called from Devices for memory-mapped I/O.
      *
      * This function may fail if there is not enough memory for the requested
-     * size.  In this case, -1 is returned.
+     * size, or if the memory would reach the address the BIOS is loaded at.
+     * In this case, -1 is returned.
      * @param[in] dev   Device that is reserving memory
      * @param[in] size  The size of memory needed for direct memory access
      * @return  The start address of the granted DMA memory, or -1 on failure
@@ -168,6 +214,10 @@ protected:
      *   write 11
      * will write to the device that obtained port 11.
      *
+     * The device is asked for the PortMode of the obtained port.  Writes to
+     * a posted port are queued, and are delivered in order on a thread that
+     * the Motherboard creates for the device.
+     *
      * @param[in]   dev     Device that is requesting the port.  It is this
      *                      device that will be written to.
      * @param[in]   port    Port to obtain, or 0 to request the next available
@@ -179,6 +229,9 @@ protected:
 
     /**
      * Write to a port
+     *
+     * If the port is posted, this only waits if the device's queue is full.
+     * Posted ports must only be written from one thread (the CPU thread).
      * @param[in]   port    Port number to write to
      * @param[in]   what    A 32-bit value to write to the port
      */
@@ -200,6 +253,56 @@ protected:
      */
     static void runThread(Motherboard* mb, DeviceThread& dt);
 
+    struct PortWrite
+    {
+        int         port;
+        MemAddress  what;
+    };
+
+    /**
+     * Queue and thread that deliver writes to a device's posted ports
+     */
+    struct PostedDevice
+    {
+        Device*                     dev;
+        SpscQueue<PortWrite>        queue;
+        boost::thread*              thd;
+        boost::mutex                mutex;
+        boost::condition_variable   ready;
+        std::atomic<bool>           sleeping;   //!< Drain thread is waiting
+        std::atomic<bool>           run;
+        PortStats                   stats;      //!< Only updated by producer
+
+        PostedDevice(Device* dev);
+    };
+
+    struct DevicePort
+    {
+        Device*         dev;
+        PostedDevice*   posted;     //!< null if the port is synchronous
+    };
+
+    /**
+     * Queue a write to a posted port, waiting if the queue is full
+     * @param[in]   pd      Posted device to write to
+     * @param[in]   port    Port number that was written
+     * @param[in]   what    Word that was written
+     */
+    void post(PostedDevice& pd, int port, MemAddress what);
+
+    /**
+     * Entry to a posted device's drain thread
+     * @param[in]   mb  Motherboard
+     * @param[in]   pd  Posted device to deliver writes to
+     */
+    static void drainPort(Motherboard* mb, PostedDevice* pd);
+
+    /**
+     * Wake a posted device's drain thread if it is waiting
+     * @param[in]   pd
+     */
+    static void wakePort(PostedDevice& pd);
+
 private:
 
     Motherboard(const Motherboard& mb) { }; /* copy not permitted */
@@ -220,6 +323,8 @@ private:
 
     std::vector<Device*> devices;
 
+    std::vector<DirtyTracker*> dirtyTrackers;
+
     int masterCpu;                  //!< Index of CPU to boot from
 
     std::vector<uint8_t> memory;    //!< Main memory
@@ -228,7 +333,9 @@ private:
 
     std::list<DeviceThread> deviceThreads;
 
-    std::unordered_map<int,Device*> devicePorts;
+    std::unordered_map<int,DevicePort> devicePorts;
+
+    std::vector<PostedDevice*> postedDevices;
 
     ReportExceptionFunc reportCb;   //!< Function to call to report errors to
 };
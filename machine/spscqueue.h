@@ -0,0 +1,105 @@
+/**
+ * @file    spscqueue.h
+ *
+ * Matrix VM
+ */
+
+#ifndef SPSCQUEUE_H
+#define SPSCQUEUE_H
+
+#include <vector>
+#include <atomic>
+#include <cstddef>
+
+namespace machine
+{
+
+/**
+ * @class SpscQueue
+ *
+ * A bounded, lock-free, single-producer/single-consumer queue.
+ *
+ * Exactly one thread may call push() and exactly one (other) thread may call
+ * pop().  The capacity is rounded up to a power of two.
+ */
+template <typename T>
+class SpscQueue
+{
+public:
+
+    /**
+     * @param[in]   capacity    Minimum number of items the queue can hold
+     */
+    explicit SpscQueue(size_t capacity)
+    : head(0), tail(0)
+    {
+        size_t size = 1;
+        while (size < capacity)
+            size <<= 1;
+        this->items.resize(size);
+        this->mask = size - 1;
+    }
+
+    /**
+     * Add an item to the back of the queue.  Producer only.
+     * @param[in]   item
+     * @return  false if the queue is full
+     */
+    bool push(const T& item)
+    {
+        size_t head = this->head.load(std::memory_order_relaxed);
+        if (head - this->tail.load(std::memory_order_acquire) > this->mask)
+            return false;
+
+        this->items[head & this->mask] = item;
+        this->head.store(head + 1, std::memory_order_release);
+        return true;
+    }
+
+    /**
+     * Remove an item from the front of the queue.  Consumer only.
+     * @param[out]  item
+     * @return  false if the queue is empty
+     */
+    bool pop(T& item)
+    {
+        size_t tail = this->tail.load(std::memory_order_relaxed);
+        if (tail == this->head.load(std::memory_order_acquire))
+            return false;
+
+        item = this->items[tail & this->mask];
+        this->tail.store(tail + 1, std::memory_order_release);
+        return true;
+    }
+
+    /**
+     * @return  Number of queued items.  Exact only when called from the
+     *          producer or the consumer while the other side is idle.
+     */
+    size_t size() const
+    {
+        return this->head.load(std::memory_order_acquire)
+             - this->tail.load(std::memory_order_acquire);
+    }
+
+    bool empty() const { return this->size() == 0; }
+
+    size_t capacity() const { return this->mask + 1; }
+
+private:
+
+    SpscQueue(const SpscQueue& q) { }   /* copy not permitted */
+
+    std::vector<T>  items;
+    size_t          mask;
+
+    // Keep the producer and consumer indexes on separate cache lines
+    char                padHead[64];
+    std::atomic<size_t> head;   //!< Next slot to write
+    char                padTail[64];
+    std::atomic<size_t> tail;   //!< Next slot to read
+};
+
+}   // namespace machine
+
+#endif // SPSCQUEUE_H
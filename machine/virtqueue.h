@@ -0,0 +1,410 @@
+/**
+ * @file    virtqueue.h
+ *
+ * Matrix VM
+ */
+
+#ifndef VIRTQUEUE_H
+#define VIRTQUEUE_H
+
+#include <common.h>
+#include <machine/guestmemory.h>
+
+#include <vector>
+#include <atomic>
+
+/* queue config, wherever the device puts it (big endian):
+    0   4   address of the queue area, written by the guest; 0 while the
+            queue is detached
+    4   4   entries in each ring, written by the guest:  a power of 2, at
+            most the next field
+    8   4   most entries the device allows, written by the device
+   12   4   used entries to gather before interrupting, written by the guest;
+            0 or 1 for no gathering.  A device that has nothing left to do
+            interrupts for what it has. */
+#define VIRTQUEUE_CONFIG_ADDRESS    0
+#define VIRTQUEUE_CONFIG_ENTRIES    4
+#define VIRTQUEUE_CONFIG_MAX        8
+#define VIRTQUEUE_CONFIG_COALESCE   12
+#define VIRTQUEUE_CONFIG_SIZE       16
+
+/* queue area, for n entries (big endian):
+    0       16n     descriptor table
+    16n     4n+12   available ring, written by the guest
+    20n+12  8n+12   used ring, written by the device
+
+   descriptor:
+    0   4   address of the buffer
+    4   4   bytes in the buffer
+    8   4   VIRTQUEUE_DESC_ flags
+   12   4   index of the next descriptor in the chain, with VIRTQUEUE_DESC_NEXT
+
+   available ring:
+    0   4   VIRTQUEUE_AVAIL_ flags
+    4   4   index:  chains made available so far
+    8   4n  head descriptor of chain i, in entry i % n
+   ..   4   used event:  the device interrupts when the used index passes it
+
+   used ring:
+    0   4   VIRTQUEUE_USED_ flags
+    4   4   index:  chains used so far
+    8   8n  head descriptor of chain i and the bytes written to it, in entry
+            i % n
+   ..   4   available event:  the guest need only notify when the available
+            index passes it */
+#define VIRTQUEUE_DESC_ADDRESS      0
+#define VIRTQUEUE_DESC_LENGTH       4
+#define VIRTQUEUE_DESC_FLAGS        8
+#define VIRTQUEUE_DESC_NEXT_INDEX   12
+#define VIRTQUEUE_DESC_SIZE         16
+
+#define VIRTQUEUE_RING_FLAGS        0
+#define VIRTQUEUE_RING_INDEX        4
+#define VIRTQUEUE_RING_ENTRIES      8
+
+#define VIRTQUEUE_AVAIL(n)          (VIRTQUEUE_DESC_SIZE * (n))
+#define VIRTQUEUE_USED(n)           (VIRTQUEUE_AVAIL(n) + \
+                                     VIRTQUEUE_RING_ENTRIES + 4 * (n) + 4)
+#define VIRTQUEUE_AREA_SIZE(n)      (VIRTQUEUE_USED(n) + \
+                                     VIRTQUEUE_RING_ENTRIES + 8 * (n) + 4)
+#define VIRTQUEUE_USED_EVENT(n)     (VIRTQUEUE_AVAIL(n) + \
+                                     VIRTQUEUE_RING_ENTRIES + 4 * (n))
+#define VIRTQUEUE_AVAIL_EVENT(n)    (VIRTQUEUE_USED(n) + \
+                                     VIRTQUEUE_RING_ENTRIES + 8 * (n))
+
+#define VIRTQUEUE_DESC_NEXT         0x1     // the chain goes on
+#define VIRTQUEUE_DESC_WRITE        0x2     // the device writes the buffer
+
+#define VIRTQUEUE_AVAIL_NO_INTERRUPT    0x1 // the guest wants no interrupts
+#define VIRTQUEUE_USED_NO_NOTIFY        0x1 // the device is taking chains
+
+/* written to a device's queue port:  the number of the queue, with
+   VIRTQUEUE_KICK_ATTACH to attach it from its config first */
+#define VIRTQUEUE_KICK_QUEUE        0xffff
+#define VIRTQUEUE_KICK_ATTACH       0x10000
+
+namespace machine
+{
+
+/**
+ * @class VirtQueue
+ *
+ * The device side of a split ring in guest memory, for devices to move
+ * requests through instead of a protocol of their own.
+ *
+ * The guest builds a request as a chain of descriptors, readable buffers
+ * first, and adds its head to the available ring.  The device takes chains
+ * with pop(), and when it is done with one, returns it with push().  Used
+ * chains become visible together on publish(), which also decides whether to
+ * interrupt.
+ *
+ * Notifications are suppressed both ways.  While the device is taking chains
+ * it sets VIRTQUEUE_USED_NO_NOTIFY and leaves the available event behind, so
+ * the guest can add more without writing the port; enableNotify() catches
+ * what arrived meanwhile.  The guest sets the used event to what it has seen,
+ * or VIRTQUEUE_AVAIL_NO_INTERRUPT, and is interrupted only past it.  On top
+ * of that, interrupts wait for the coalescing count of used chains, unless
+ * the device says it is idle.
+ *
+ * The guest stores a word a byte at a time, so its flags, used event and
+ * coalescing count are taken by kick(), on the thread that writes the port,
+ * and publish() goes by those.  A guest that moves the used event writes the
+ * port, and then checks the used index for chains used before it did.
+ *
+ * The device must not call two methods at once; the queue does no locking.
+ */
+class VirtQueue
+{
+public:
+
+    /* a buffer in a chain */
+    struct Buffer
+    {
+        MemAddress  address;
+        uint32_t    length;
+        bool        writable;   //!< Whether the device writes it
+    };
+
+    /* a chain taken from the available ring */
+    struct Chain
+    {
+        uint32_t            head;   //!< Index of the first descriptor
+        std::vector<Buffer> buffers;
+    };
+
+    VirtQueue()
+    : memory(0), memorySize(0), config(0), entries(0), area(0),
+      lastAvail(0), used(0), signalled(0), notifying(true), availFlags(0),
+      usedEvent(0), coalesce(0)
+    { }
+
+    /**
+     * Set up the config, detached
+     * @param[in]   memory      Guest memory
+     * @param[in]   memorySize  Bytes of guest memory
+     * @param[in]   config      Address of the config, in guest memory
+     * @param[in]   maxEntries  Most entries to allow in each ring
+     */
+    void init(uint8_t* memory, MemAddress memorySize, MemAddress config,
+              uint32_t maxEntries)
+    {
+        this->memory     = memory;
+        this->memorySize = memorySize;
+        this->config     = memory + config;
+        this->entries    = 0;
+        write32(this->config + VIRTQUEUE_CONFIG_ADDRESS, 0);
+        write32(this->config + VIRTQUEUE_CONFIG_ENTRIES, 0);
+        write32(this->config + VIRTQUEUE_CONFIG_MAX, maxEntries);
+        write32(this->config + VIRTQUEUE_CONFIG_COALESCE, 0);
+    }
+
+    /**
+     * Attach the queue the config describes, with its rings empty.  Chains
+     * still in flight from before are lost.
+     * @return  Whether the config is good; if not, the queue is detached and
+     *          the config's address cleared
+     */
+    bool attach()
+    {
+        uint32_t address = read32(this->config + VIRTQUEUE_CONFIG_ADDRESS);
+        uint32_t entries = read32(this->config + VIRTQUEUE_CONFIG_ENTRIES);
+        int64_t  size    = VIRTQUEUE_AREA_SIZE(static_cast<int64_t>( entries ));
+
+        if (!address || !entries || (entries & (entries - 1)) ||
+            entries > read32(this->config + VIRTQUEUE_CONFIG_MAX) ||
+            !inMemory(address, size, this->memorySize))
+        {
+            this->detach();
+            return false;
+        }
+
+        this->entries   = entries;
+        this->area      = this->memory + address;
+        this->lastAvail = 0;
+        this->used      = 0;
+        this->signalled = 0;
+        this->notifying = true;
+
+        uint8_t* usedRing = this->area + VIRTQUEUE_USED(entries);
+        write32(usedRing + VIRTQUEUE_RING_FLAGS, 0);
+        write32(usedRing + VIRTQUEUE_RING_INDEX, 0);
+        write32(this->area + VIRTQUEUE_AVAIL_EVENT(entries), 0);
+        return true;
+    }
+
+    /**
+     * Detach the queue, and clear the config's address so that the guest can
+     * tell.  Chains still in flight are dropped when pushed.
+     */
+    void detach()
+    {
+        this->entries = 0;
+        write32(this->config + VIRTQUEUE_CONFIG_ADDRESS, 0);
+    }
+
+    bool isAttached() const { return this->entries != 0; }
+
+    /**
+     * Take the guest's flags, used event and coalescing count, for publish()
+     * to go by until the next kick.  Call it when the guest writes the port,
+     * on the thread it writes from.
+     */
+    void kick()
+    {
+        this->coalesce = read32(this->config + VIRTQUEUE_CONFIG_COALESCE);
+        if (!this->entries)
+            return;
+
+        const uint8_t* availRing = this->area + VIRTQUEUE_AVAIL(this->entries);
+        this->availFlags = read32(availRing + VIRTQUEUE_RING_FLAGS);
+        this->usedEvent  =
+            read32(this->area + VIRTQUEUE_USED_EVENT(this->entries));
+    }
+
+    /**
+     * Take the next available chain.  One that cannot be followed, being
+     * out of memory, too long, or with a readable buffer after a writable
+     * one, is returned used with nothing written, and the next is tried.  An
+     * available index more than a ring ahead of what was taken breaks the
+     * queue, which is detached.
+     * @param[out]  chain
+     * @return  Whether a chain was taken
+     */
+    bool pop(Chain& chain)
+    {
+        if (!this->entries)
+            return false;
+
+        const uint8_t* availRing = this->area + VIRTQUEUE_AVAIL(this->entries);
+        while (true)
+        {
+            uint32_t availIndex = read32(availRing + VIRTQUEUE_RING_INDEX);
+            if (availIndex == this->lastAvail)
+                return false;
+            if (availIndex - this->lastAvail > this->entries)
+            {   // the guest cannot have made more available than fit
+                this->detach();
+                return false;
+            }
+
+            // the entry must be read after the index that covers it
+            std::atomic_thread_fence(std::memory_order_acquire);
+            uint32_t head = read32(availRing + VIRTQUEUE_RING_ENTRIES +
+                                   4 * (this->lastAvail % this->entries));
+            this->lastAvail++;
+            if (this->notifying)
+            {
+                write32(this->area + VIRTQUEUE_AVAIL_EVENT(this->entries),
+                        this->lastAvail);
+            }
+
+            if (this->follow(head, chain))
+                return true;
+            this->push(head, 0);
+        }
+    }
+
+    /**
+     * Return a chain to the guest; it becomes visible on publish()
+     * @param[in]   head        Index of the first descriptor
+     * @param[in]   written     Bytes written to the chain's buffers
+     */
+    void push(uint32_t head, uint32_t written)
+    {
+        if (!this->entries)
+            return;
+
+        uint8_t* usedRing = this->area + VIRTQUEUE_USED(this->entries);
+        uint8_t* entry    = usedRing + VIRTQUEUE_RING_ENTRIES +
+                            8 * (this->used % this->entries);
+        write32(entry, head);
+        write32(entry + 4, written);
+        this->used++;
+    }
+
+    /**
+     * Make the pushed chains visible to the guest
+     * @param[in]   idle    Whether the device has nothing left in flight, so
+     *                      that it should not wait to gather more
+     * @return  Whether to interrupt
+     */
+    bool publish(bool idle)
+    {
+        if (!this->entries)
+            return false;
+
+        // the entries must be in place before the guest sees the index
+        std::atomic_thread_fence(std::memory_order_release);
+        uint8_t* usedRing = this->area + VIRTQUEUE_USED(this->entries);
+        write32(usedRing + VIRTQUEUE_RING_INDEX, this->used);
+
+        uint32_t pending = this->used - this->signalled;
+        if (!pending)
+            return false;
+        if (!idle && pending < this->coalesce)
+            return false;
+
+        uint32_t old    = this->signalled;
+        this->signalled = this->used;
+
+        if (this->availFlags & VIRTQUEUE_AVAIL_NO_INTERRUPT)
+            return false;
+        // whether the event is in [old, used)
+        return this->used - this->usedEvent - 1 < this->used - old;
+    }
+
+    /**
+     * Tell the guest not to notify; for while the device is taking chains
+     */
+    void disableNotify()
+    {
+        if (!this->entries)
+            return;
+
+        uint8_t* usedRing = this->area + VIRTQUEUE_USED(this->entries);
+        this->notifying = false;
+        write32(usedRing + VIRTQUEUE_RING_FLAGS, VIRTQUEUE_USED_NO_NOTIFY);
+    }
+
+    /**
+     * Tell the guest to notify again
+     * @return  Whether chains were made available while it was not told to,
+     *          which the device must take itself
+     */
+    bool enableNotify()
+    {
+        if (!this->entries)
+            return false;
+
+        const uint8_t* availRing = this->area + VIRTQUEUE_AVAIL(this->entries);
+        uint8_t*       usedRing  = this->area + VIRTQUEUE_USED(this->entries);
+        this->notifying = true;
+        write32(usedRing + VIRTQUEUE_RING_FLAGS, 0);
+        write32(this->area + VIRTQUEUE_AVAIL_EVENT(this->entries),
+                this->lastAvail);
+
+        // the guest's index must be read after the flags are out
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        return read32(availRing + VIRTQUEUE_RING_INDEX) != this->lastAvail;
+    }
+
+protected:
+
+    /**
+     * Gather the buffers of a chain
+     * @param[in]   head    Index of the first descriptor
+     * @param[out]  chain
+     * @return  Whether the chain is good
+     */
+    bool follow(uint32_t head, Chain& chain) const
+    {
+        chain.head = head;
+        chain.buffers.clear();
+
+        uint32_t index = head;
+        while (index < this->entries && chain.buffers.size() < this->entries)
+        {
+            const uint8_t* desc = this->area + VIRTQUEUE_DESC_SIZE * index;
+            uint32_t flags = read32(desc + VIRTQUEUE_DESC_FLAGS);
+
+            Buffer buffer;
+            buffer.address  = read32(desc + VIRTQUEUE_DESC_ADDRESS);
+            buffer.length   = read32(desc + VIRTQUEUE_DESC_LENGTH);
+            buffer.writable = flags & VIRTQUEUE_DESC_WRITE;
+            if (!inMemory(static_cast<uint32_t>( buffer.address ),
+                          buffer.length, this->memorySize))
+                return false;
+            // readable buffers must come before every writable one
+            if (!buffer.writable && !chain.buffers.empty() &&
+                chain.buffers.back().writable)
+                return false;
+            chain.buffers.push_back(buffer);
+
+            if (!(flags & VIRTQUEUE_DESC_NEXT))
+                return true;
+            index = read32(desc + VIRTQUEUE_DESC_NEXT_INDEX);
+        }
+        return false;   // out of the table, or in a loop
+    }
+
+private:
+
+    uint8_t*    memory;
+    MemAddress  memorySize;
+    uint8_t*    config;
+    uint32_t    entries;    //!< In each ring; 0 while detached
+    uint8_t*    area;
+    uint32_t    lastAvail;  //!< Chains taken so far
+    uint32_t    used;       //!< Chains pushed so far
+    uint32_t    signalled;  //!< Used index when the event was last checked
+    bool        notifying;  //!< Whether the available event tracks lastAvail
+
+    /* the guest's, as of its last kick */
+    uint32_t    availFlags;
+    uint32_t    usedEvent;
+    uint32_t    coalesce;
+};
+
+}   // namespace machine
+
+#endif // VIRTQUEUE_H
@@ -3,9 +3,21 @@
 #include <machine/cpu.h>
 #include <dev/basicinterruptcontroller.h>
 #include <dev/timerdevice.h>
+#include <dev/keyboarddevice.h>
+#include <dev/pointerdevice.h>
+#include <dev/serialdevice.h>
 #include <dev/displaydevice.h>
+#include <dev/charoutputdevice.h>
+#include <dev/tileengine.h>
+#include <dev/blockdevice.h>
+#include <dev/hostfsdevice.h>
+#include <dev/nvramdevice.h>
 #include <dev/x11displaymanager.h>
 #include <dev/nulldisplaymanager.h>
+#include <dev/capturedisplaymanager.h>
+#include <dev/hashdisplaymanager.h>
+#include <dev/shmdisplaymanager.h>
+#include <dev/rfbdisplaymanager.h>
 
 #include <getopt.h>
 #include <stdexcept>
@@ -17,19 +29,46 @@ using namespace machine;
 struct Options
 {
     int graphics;
+    int completionInterrupts;   //!< Whether flushes and prints interrupt
+    int shareReadOnly;              //!< Whether the share is read-only
+    int scale;      //!< Factor to scale the display window up by
+    FramebufferMode displayMode;    //!< Largest mode the guest may set
+    const char* capture;            //!< File to capture frames to, or null
+    const char* hashLog;            //!< File to log frame hashes to, or null
+    const char* expectHash;         //!< File of expected frame hashes, or null
+    const char* shm;                //!< Shared memory for frames, or null
+    const char* rfb;                //!< Address to serve RFB on, or null
+    const char* charOutput;         //!< File for character output, or null
+    const char* serial;             //!< Serial console connection, or null
+    int serialRing;                 //!< Bytes in each serial ring
+    const char* disk;               //!< Disk image to attach, or null
+    const char* overlay;            //!< Overlay for the disk's writes, or null
+    const char* share;              //!< Host directory to share, or null
+    const char* nvram;              //!< File that keeps the NVRAM, or null
 
     Options()
-    : graphics(1)
-    { }
+    : graphics(1), completionInterrupts(0), shareReadOnly(0), scale(1),
+      capture(0), hashLog(0), expectHash(0), shm(0), rfb(0), charOutput(0),
+      serial(0), serialRing(SERIAL_DEFAULT_RING_SIZE), disk(0), overlay(0),
+      share(0), nvram(0)
+    {
+        this->displayMode.width  = DISPLAY_DEFAULT_WIDTH;
+        this->displayMode.height = DISPLAY_DEFAULT_HEIGHT;
+        this->displayMode.format = DISPLAY_DEFAULT_FORMAT;
+    }
 } options;
 
 void readFile(const char* filename, uint8_t*& contents, int& fileSize);
 
 int getFileLength(FILE* file);
 
+/* nonzero once anything has gone wrong, e.g. a frame hash did not match */
+static int exitStatus = 0;
+
 void motherboardException(Motherboard& mb, exception& e)
 {
     printf("Motherboard exception:  %s\n", e.what());
+    exitStatus = 1;
     mb.abort();
 }
 
@@ -43,8 +82,25 @@ void parseArgs(int argc, char** argv)
         {
             /* These options set a flag. */
             {"nographic",   no_argument,    &options.graphics, 0},
+            {"completion-interrupts", no_argument,
+                                &options.completionInterrupts, 1},
+            {"share-readonly", no_argument, &options.shareReadOnly, 1},
             /* These options don't set a flag.
                We distinguish them by their indices. */
+            {"scale",       required_argument,  0, 's'},
+            {"display",     required_argument,  0, 'd'},
+            {"capture",     required_argument,  0, 'c'},
+            {"hash",        required_argument,  0, 'h'},
+            {"expect-hash", required_argument,  0, 'e'},
+            {"shm",         required_argument,  0, 'm'},
+            {"rfb",         required_argument,  0, 'r'},
+            {"char-output", required_argument,  0, 'o'},
+            {"serial",      required_argument,  0, 'S'},
+            {"serial-ring", required_argument,  0, 'R'},
+            {"disk",        required_argument,  0, 'D'},
+            {"overlay",     required_argument,  0, 'O'},
+            {"share",       required_argument,  0, 'f'},
+            {"nvram",       required_argument,  0, 'n'},
             {0, 0, 0, 0}
         };
         /* getopt_long stores the option index here. */
@@ -66,11 +122,101 @@ void parseArgs(int argc, char** argv)
             printf("\n");
             break;
 
+        case 's':
+            options.scale = atoi(optarg);
+            if (options.scale < 1)
+            {
+                fprintf(stderr, "Invalid display scale:  %s\n", optarg);
+                exit(1);
+            }
+            break;
+
+        case 'd':
+        {   // WIDTHxHEIGHT or WIDTHxHEIGHTxBITS, bits being 8, 16 or 24
+            int width = 0, height = 0, bits = 24;
+            int n = sscanf(optarg, "%dx%dx%d", &width, &height, &bits);
+            options.displayMode.width  = width;
+            options.displayMode.height = height;
+            options.displayMode.format = bits == 8  ? FRAMEBUFFER_INDEXED8 :
+                                         bits == 16 ? FRAMEBUFFER_RGB565 :
+                                         bits == 24 ? FRAMEBUFFER_RGB24 : 0;
+            if (n < 2 || width <= 0 || width > 0xFFFF ||
+                height <= 0 || height > 0xFFFF ||
+                !options.displayMode.getBytesPerPixel())
+            {
+                fprintf(stderr, "Invalid display mode:  %s\n", optarg);
+                exit(1);
+            }
+            break;
+        }
+
+        case 'c':
+            options.capture = optarg;
+            break;
+
+        case 'h':
+            options.hashLog = optarg;
+            break;
+
+        case 'e':
+            options.expectHash = optarg;
+            if (!options.hashLog)
+                options.hashLog = "-";
+            break;
+
+        case 'm':
+            options.shm = optarg;
+            break;
+
+        case 'r':
+            options.rfb = optarg;
+            break;
+
+        case 'o':
+            options.charOutput = optarg;
+            break;
+
+        case 'S':
+            options.serial = optarg;
+            break;
+
+        case 'R':
+            options.serialRing = atoi(optarg);
+            if (options.serialRing <= 0 ||
+                (options.serialRing & (options.serialRing - 1)))
+            {
+                fprintf(stderr, "Invalid serial ring size:  %s\n", optarg);
+                exit(1);
+            }
+            break;
+
+        case 'D':
+            options.disk = optarg;
+            break;
+
+        case 'O':
+            options.overlay = optarg;
+            break;
+
+        case 'f':
+            options.share = optarg;
+            break;
+
+        case 'n':
+            options.nvram = optarg;
+            break;
+
         default:
             abort();
         }
     }
 
+    if (options.overlay && !options.disk)
+    {
+        fprintf(stderr, "An overlay needs a disk image to go over\n");
+        exit(1);
+    }
+
     if (optind < argc)
     {
         /* remaining command line arguments (not options) */
@@ -109,12 +255,32 @@ int main(int argc, char** argv)
     TimerDevice* timer = new TimerDevice;
     mb->addDevice(timer);
 
+    /* Keys typed and pointer moved in the display; plugged in after the
+       other devices, to keep their memory where guests expect it */
+    KeyboardDevice* keyboard = new KeyboardDevice;
+    PointerDevice*  pointer  = new PointerDevice;
+
     /* Initialize guest-to-host display output device */
     DisplayDeviceArgs ddargs;
-    if (options.graphics)
-        ddargs.displayManager = new X11DisplayManager;
+    if (options.completionInterrupts)
+        ddargs.interruptLine = DISPLAY_INT_LINE;
+    ddargs.maxMode = options.displayMode;
+    if (options.hashLog)
+        ddargs.displayManager = new HashDisplayManager(
+            options.hashLog, options.expectHash ? options.expectHash : "",
+            mb->getMasterCpu());
+    else if (options.capture)
+        ddargs.displayManager = new CaptureDisplayManager(options.capture);
+    else if (options.shm)
+        ddargs.displayManager = new ShmDisplayManager(options.shm);
+    else if (options.rfb)
+        ddargs.displayManager = new RfbDisplayManager(options.rfb);
+    else if (options.graphics)
+        ddargs.displayManager = new X11DisplayManager(options.scale);
     else
         ddargs.displayManager = new NullDisplayManager;
+    ddargs.displayManager->setKeyboard(keyboard);
+    ddargs.displayManager->setPointer(pointer);
     Device* displayDevice = dynamic_cast<Device*>(
         dlLoader->loadDevice("dev/" + DlAdapter::getLibraryName("displaydevice"), *mb, &ddargs)
         );
@@ -124,14 +290,89 @@ int main(int argc, char** argv)
         throw runtime_error("Could not load display device");
 
     /* Initialize guest-to-host character output device */
+    CharOutputDeviceArgs codargs;
+    if (options.completionInterrupts)
+        codargs.interruptLine = OUTDEV_INT_LINE;
+    codargs.path = options.charOutput;
     Device* charOutputDevice = dynamic_cast<Device*>(
-        dlLoader->loadDevice("dev/" + DlAdapter::getLibraryName("charoutputdevice"), *mb, 0)
+        dlLoader->loadDevice(
+            "dev/" + DlAdapter::getLibraryName("charoutputdevice"),
+            *mb, &codargs)
         );
     if (charOutputDevice)
         mb->addDevice(charOutputDevice);
     else
         throw runtime_error("Could not load character output device");
 
+    /* Initialize tile and sprite renderer */
+    TileEngineArgs teargs;
+    Device* tileEngine = dynamic_cast<Device*>(
+        dlLoader->loadDevice(
+            "dev/" + DlAdapter::getLibraryName("tileengine"),
+            *mb, &teargs)
+        );
+    if (tileEngine)
+        mb->addDevice(tileEngine);
+    else
+        throw runtime_error("Could not load tile engine");
+
+    mb->addDevice(keyboard);
+    mb->addDevice(pointer);
+
+    /* Serial console, only when asked for */
+    if (options.serial)
+        mb->addDevice(new SerialDevice(options.serial, options.serialRing));
+
+    /* Virtual disk, only when there is an image */
+    if (options.disk)
+    {
+        BlockDeviceArgs bdargs;
+        bdargs.path    = options.disk;
+        bdargs.overlay = options.overlay;
+        Device* blockDevice = dynamic_cast<Device*>(
+            dlLoader->loadDevice(
+                "dev/" + DlAdapter::getLibraryName("blockdevice"),
+                *mb, &bdargs)
+            );
+        if (blockDevice)
+            mb->addDevice(blockDevice);
+        else
+            throw runtime_error("Could not load block device");
+    }
+
+    /* Host files, only when there is a directory to share */
+    if (options.share)
+    {
+        HostFsDeviceArgs hfargs;
+        hfargs.root     = options.share;
+        hfargs.readOnly = options.shareReadOnly;
+        Device* hostFsDevice = dynamic_cast<Device*>(
+            dlLoader->loadDevice(
+                "dev/" + DlAdapter::getLibraryName("hostfsdevice"),
+                *mb, &hfargs)
+            );
+        if (hostFsDevice)
+            mb->addDevice(hostFsDevice);
+        else
+            throw runtime_error("Could not load host file device");
+    }
+
+    /* NVRAM, only when there is a file to keep it in */
+    if (options.nvram)
+    {
+        NvramDeviceArgs nvargs;
+        nvargs.path = options.nvram;
+        Device* nvramDevice = dynamic_cast<Device*>(
+            dlLoader->loadDevice(
+                "dev/" + DlAdapter::getLibraryName("nvramdevice"),
+                *mb, &nvargs)
+            );
+        if (nvramDevice)
+            mb->addDevice(nvramDevice);
+        else
+            throw runtime_error("Could not load NVRAM device");
+    }
+
     /* read bios */
     uint8_t* bios;
     int      biosSize;
@@ -146,7 +387,10 @@ int main(int argc, char** argv)
     /* Start the emulator */
     if (mb->start());
     else
+    {
         fprintf(stderr, "Emulator aborted\n");
+        exitStatus = 1;
+    }
 
     /* Cleanup */
     delete ddargs.displayManager;
@@ -154,7 +398,7 @@ int main(int argc, char** argv)
     delete ic;
     delete mb;
     dlLoader->cleanup();
-    return 0;
+    return exitStatus;
 }
 
 // An abomination mix of C and C++; sry